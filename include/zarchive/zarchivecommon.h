@@ -67,9 +67,25 @@
 
 namespace _ZARCHIVE
 {
-	inline constexpr size_t COMPRESSED_BLOCK_SIZE = 64 * 1024; // 64KiB
+	inline constexpr size_t COMPRESSED_BLOCK_SIZE = 64 * 1024; // 64KiB, default and the only block size supported by version 1 archives
+	inline constexpr size_t MIN_COMPRESSED_BLOCK_SIZE = 4 * 1024; // 4KiB
+	inline constexpr size_t MAX_COMPRESSED_BLOCK_SIZE = 4 * 1024 * 1024; // 4MiB
 	inline constexpr size_t ENTRIES_PER_OFFSETRECORD = 16; // must be aligned to two
 
+	inline bool IsZeroData(const uint8_t* data, size_t size)
+	{
+		if (size == 0)
+			return true;
+		// if the first byte is zero and every byte equals its successor then all bytes are zero
+		return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+	}
+
+	inline bool IsValidBlockSize(size_t blockSize)
+	{
+		// must be a power of two
+		return blockSize >= MIN_COMPRESSED_BLOCK_SIZE && blockSize <= MAX_COMPRESSED_BLOCK_SIZE && (blockSize & (blockSize - 1)) == 0;
+	}
+
 	template<class T, std::size_t... N>
 	constexpr T bswap_impl(T i, std::index_sequence<N...>)
 	{
@@ -108,6 +124,11 @@ namespace _ZARCHIVE
 		uint64_t baseOffset;
 		uint16_t size[ENTRIES_PER_OFFSETRECORD]; // compressed size - 1
 
+		uint32_t GetCompressedSize(size_t index) const
+		{
+			return (uint32_t)size[index] + 1;
+		}
+
 		static void Serialize(const CompressionOffsetRecord* input, size_t count, CompressionOffsetRecord* output)
 		{
 			while (count)
@@ -130,6 +151,84 @@ namespace _ZARCHIVE
 	static_assert(std::is_standard_layout<CompressionOffsetRecord>::value);
 	static_assert(sizeof(CompressionOffsetRecord) == (8 + 2 * 16));
 
+	// version 2 archives prefix the offset record section with this header
+	struct OffsetRecordsHeaderV2
+	{
+		static constexpr uint32_t FLAG_DELTA = 0x1; // delta archive, the header is followed by DeltaHeaderV2
+
+		uint32_t blockSize;
+		uint32_t flags; // unknown flags must be zero
+		uint64_t blockCount; // the last offset record can have unused entries, which are indistinguishable from real blocks
+
+		static void Serialize(const OffsetRecordsHeaderV2* input, OffsetRecordsHeaderV2* output)
+		{
+			output->blockSize = _store(input->blockSize);
+			output->flags = _store(input->flags);
+			output->blockCount = _store(input->blockCount);
+		}
+
+		static void Deserialize(OffsetRecordsHeaderV2* input, OffsetRecordsHeaderV2* output)
+		{
+			Serialize(input, output);
+		}
+	};
+
+	static_assert(sizeof(OffsetRecordsHeaderV2) == 16);
+
+	// delta archives only store the blocks which are not found in their base archive
+	struct DeltaHeaderV2
+	{
+		uint8_t baseIntegrityHash[32]; // integrity hash of the base archive
+	};
+
+	static_assert(sizeof(DeltaHeaderV2) == 32);
+
+	inline constexpr uint32_t BASE_BLOCK_FLAG = 0x80000000; // set in the size field of a delta archive's offset record if the block is stored in the base archive. The lower 31 bits are its block index there
+
+	// number of bytes a block occupies in the compressed data section, given the value of its size field
+	inline uint32_t GetStoredDataSize(uint32_t sizeField)
+	{
+		return (sizeField & BASE_BLOCK_FLAG) ? 0 : sizeField;
+	}
+
+	struct CompressionOffsetRecordV2
+	{
+		// same scheme as CompressionOffsetRecord but with 32bit size fields to allow for blocks larger than 64KiB
+		uint64_t baseOffset;
+		uint32_t size[ENTRIES_PER_OFFSETRECORD]; // compressed size. If equal to the block size then the block is stored uncompressed. Zero means the block is all zero bytes and has no stored data. See BASE_BLOCK_FLAG for delta archives
+
+		uint32_t GetCompressedSize(size_t index) const
+		{
+			return GetStoredDataSize(size[index]);
+		}
+
+		bool IsBaseBlock(size_t index) const
+		{
+			return (size[index] & BASE_BLOCK_FLAG) != 0;
+		}
+
+		static void Serialize(const CompressionOffsetRecordV2* input, size_t count, CompressionOffsetRecordV2* output)
+		{
+			while (count)
+			{
+				output->baseOffset = _store(input->baseOffset);
+				for (size_t i = 0; i < ENTRIES_PER_OFFSETRECORD; i++)
+					output->size[i] = _store(input->size[i]);
+				input++;
+				output++;
+				count--;
+			}
+		}
+
+		static void Deserialize(CompressionOffsetRecordV2* input, size_t count, CompressionOffsetRecordV2* output)
+		{
+			Serialize(input, count, output);
+		}
+	};
+
+	static_assert(std::is_standard_layout<CompressionOffsetRecordV2>::value);
+	static_assert(sizeof(CompressionOffsetRecordV2) == (8 + 4 * 16));
+
 	struct FileDirectoryEntry
 	{
 		uint32_t nameOffsetAndTypeFlag; // MSB is type. 0 -> directory, 1 -> file. Lower 31 bit are the offset into the node name table
@@ -248,6 +347,7 @@ namespace _ZARCHIVE
 	{
 		static inline uint32_t kMagic = 0x169f52d6;
 		static inline uint32_t kVersion1 = 0x61bf3a01; // also acts as an extended magic
+		static inline uint32_t kVersion2 = 0x61bf3a02; // adds configurable block size (see OffsetRecordsHeaderV2) zero-block elision and delta archives
 
 		struct OffsetInfo
 		{
@@ -299,7 +399,76 @@ namespace _ZARCHIVE
 
 	static_assert(sizeof(Footer) == (16 * 6 + 32 + 8 + 4 + 4));
 
-	static bool GetNextPathNode(std::string_view& pathParser, std::string_view& node)
+	// access trace files as written by ZArchiveReader::SaveTrace
+	struct TraceHeader
+	{
+		static inline uint32_t kMagic = 0x7a617274;
+		static inline uint32_t kVersion1 = 1;
+
+		uint32_t magic;
+		uint32_t version;
+		uint8_t archiveHash[32]; // integrity hash of the traced archive
+		uint64_t recordCount;
+
+		static void Serialize(const TraceHeader* input, TraceHeader* output)
+		{
+			output->magic = _store(input->magic);
+			output->version = _store(input->version);
+			memcpy(output->archiveHash, input->archiveHash, 32);
+			output->recordCount = _store(input->recordCount);
+		}
+
+		static void Deserialize(TraceHeader* input, TraceHeader* output)
+		{
+			Serialize(input, output);
+		}
+	};
+
+	static_assert(sizeof(TraceHeader) == (4 + 4 + 32 + 8));
+
+	struct TraceRecord
+	{
+		uint64_t timestamp; // microseconds since tracing started
+		uint64_t offset; // read offset within the file
+		uint64_t blockIndexAndHit; // lower 63 bits are the block index, MSB is set if the block was served from the cache
+		uint32_t nodeHandle;
+		uint32_t length; // number of bytes read from this block
+
+		uint64_t GetBlockIndex() const
+		{
+			return blockIndexAndHit & 0x7FFFFFFFFFFFFFFFull;
+		}
+
+		bool IsCacheHit() const
+		{
+			return (blockIndexAndHit & 0x8000000000000000ull) != 0;
+		}
+
+		static void Serialize(const TraceRecord* input, size_t count, TraceRecord* output)
+		{
+			while (count)
+			{
+				output->timestamp = _store(input->timestamp);
+				output->offset = _store(input->offset);
+				output->blockIndexAndHit = _store(input->blockIndexAndHit);
+				output->nodeHandle = _store(input->nodeHandle);
+				output->length = _store(input->length);
+				input++;
+				output++;
+				count--;
+			}
+		}
+
+		static void Deserialize(TraceRecord* input, size_t count, TraceRecord* output)
+		{
+			Serialize(input, count, output);
+		}
+	};
+
+	static_assert(std::is_standard_layout<TraceRecord>::value);
+	static_assert(sizeof(TraceRecord) == 32);
+
+	inline bool GetNextPathNode(std::string_view& pathParser, std::string_view& node)
 	{
 		// skip leading slashes
 		while (!pathParser.empty() && (pathParser.front() == '/' || pathParser.front() == '\\'))
@@ -318,7 +487,7 @@ namespace _ZARCHIVE
 		return true;
 	}
 
-	static void SplitFilenameFromPath(std::string_view& pathInOut, std::string_view& filename)
+	inline void SplitFilenameFromPath(std::string_view& pathInOut, std::string_view& filename)
 	{
 		if (pathInOut.empty())
 		{
@@ -343,7 +512,7 @@ namespace _ZARCHIVE
 		pathInOut.remove_suffix(pathInOut.size() - index);
 	}
 
-	static bool CompareNodeNameBool(std::string_view n1, std::string_view n2)
+	inline bool CompareNodeNameBool(std::string_view n1, std::string_view n2)
 	{
 		if (n1.size() != n2.size())
 			return false;
@@ -361,7 +530,7 @@ namespace _ZARCHIVE
 		return true;
 	}
 
-	static int CompareNodeName(std::string_view n1, std::string_view n2)
+	inline int CompareNodeName(std::string_view n1, std::string_view n2)
 	{
 		for (size_t i = 0; i < std::min(n1.size(), n2.size()); i++)
 		{
@@ -381,5 +550,30 @@ namespace _ZARCHIVE
 		return 0;
 	}
 
+	// hash and equality for node names following the same case-insensitive rules as CompareNodeNameBool
+	struct NodeNameHash
+	{
+		size_t operator()(std::string_view name) const
+		{
+			// FNV-1a on the lowercase name
+			uint64_t h = 0xcbf29ce484222325ull;
+			for (char c : name)
+			{
+				if (c >= 'A' && c <= 'Z')
+					c -= ('A' - 'a');
+				h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+			}
+			return (size_t)h;
+		}
+	};
+
+	struct NodeNameEqual
+	{
+		bool operator()(std::string_view n1, std::string_view n2) const
+		{
+			return CompareNodeNameBool(n1, n2);
+		}
+	};
+
 };
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <filesystem>
+
+#include "zarchivereader.h"
+#include "zarchivesharedcache.h"
+
+// read-only view of several archives stacked on top of each other, for example a base archive plus updates
+// files in higher layers shadow files and directories with the same path in lower layers, directories are merged
+// the combined tree is built once when opening, after that every path is resolved with a single hash lookup
+class ZArchiveOverlay
+{
+public:
+	using DirEntry = ZArchiveReader::DirEntry;
+
+	// layerPaths[0] is the lowest layer. All layers share one cache of cacheSize bytes in which blocks are keyed by their archive and block index, so a frequently read small layer keeps its blocks no matter how large the others are
+	// the cache holds at least 8 blocks, and each layer additionally keeps the block it read last
+	static ZArchiveOverlay* OpenFromFiles(const std::vector<std::filesystem::path>& layerPaths, uint64_t cacheSize = 4 * 1024 * 1024);
+
+	~ZArchiveOverlay();
+
+	// same interface as ZArchiveReader. Node handles refer to the combined tree and are not valid for the individual layers
+	ZArchiveNodeHandle LookUp(std::string_view path, bool allowFile = true, bool allowDirectory = true) const;
+	bool IsDirectory(ZArchiveNodeHandle nodeHandle) const;
+	bool IsFile(ZArchiveNodeHandle nodeHandle) const;
+
+	// directory operations. Entries are sorted by name
+	uint32_t GetDirEntryCount(ZArchiveNodeHandle nodeHandle) const;
+	bool GetDirEntry(ZArchiveNodeHandle nodeHandle, uint32_t index, DirEntry& dirEntry) const;
+
+	// file operations
+	uint64_t GetFileSize(ZArchiveNodeHandle nodeHandle) const;
+	uint64_t ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint64_t length, void* buffer);
+
+	// layers
+	uint32_t GetLayerCount() const { return (uint32_t)m_layers.size(); }
+	ZArchiveReader* GetLayer(uint32_t layerIndex) const { return m_layers[layerIndex].get(); }
+	bool GetNodeSource(ZArchiveNodeHandle nodeHandle, uint32_t& layerIndex, ZArchiveNodeHandle& layerNodeHandle) const; // the layer which provides a file. For directories the highest layer containing it
+
+private:
+	struct OverlayNode
+	{
+		std::string_view name; // points into the name table of the layer
+		uint32_t layerIndex;
+		ZArchiveNodeHandle layerNodeHandle;
+		bool isFile;
+		uint64_t fileSize;
+		// directories only
+		uint32_t firstSubnode;
+		uint32_t subnodeCount;
+	};
+
+	struct LayerNode
+	{
+		uint32_t layerIndex;
+		ZArchiveNodeHandle layerNodeHandle;
+	};
+
+	ZArchiveOverlay(std::unique_ptr<ZArchiveSharedCache>&& cache, std::vector<std::unique_ptr<ZArchiveReader>>&& layers);
+
+	bool BuildTree();
+	bool MergeDirectory(uint32_t nodeIndex, const std::vector<LayerNode>& sources, std::string& pathKey);
+
+	static void AppendPathKey(std::string& pathKey, std::string_view name);
+
+	std::unique_ptr<ZArchiveSharedCache> m_cache; // declared first so that it outlives the layers using it
+	std::vector<std::unique_ptr<ZArchiveReader>> m_layers;
+	std::vector<OverlayNode> m_nodes; // node 0 is the root, the subnodes of each directory are stored consecutively
+	std::unordered_map<std::string, uint32_t> m_pathLookup; // lowercase path with '/' separators -> node index
+};
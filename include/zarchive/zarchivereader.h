@@ -5,15 +5,23 @@
 #include <string_view>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <list>
 
 #include <filesystem>
 #include <fstream>
 
 #include "zarchivecommon.h"
 
+class ZArchiveSharedCache;
+
 using ZArchiveNodeHandle = uint32_t;
 
-static inline ZArchiveNodeHandle ZARCHIVE_INVALID_NODE = 0xFFFFFFFF;
+inline constexpr ZArchiveNodeHandle ZARCHIVE_INVALID_NODE = 0xFFFFFFFF;
 
 class ZArchiveReader
 {
@@ -21,12 +29,38 @@ public:
 	struct DirEntry
 	{
 		std::string_view name;
+		ZArchiveNodeHandle nodeHandle;
 		bool isFile;
 		bool isDirectory;
 		uint64_t size; // only valid for directories
 	};
 
-	static ZArchiveReader* OpenFromFile(const std::filesystem::path& path);
+	struct Stats
+	{
+		static constexpr size_t kHistogramBuckets = 24; // bucket i counts calls which took [2^i, 2^(i+1)) microseconds, bucket 0 also includes anything faster
+
+		// cache
+		uint64_t cacheHits;
+		uint64_t cacheMisses;
+		uint64_t cacheEvictions;
+		uint64_t sharedCacheHits; // blocks which missed the private cache but were found in the shared cache
+		uint64_t compressedCacheHits; // blocks which missed the private cache but were decompressed from the compressed cache instead of being read from disk
+		// block loading
+		uint64_t bytesReadFromDisk;
+		uint64_t bytesDecompressed;
+		uint64_t ioTime; // in nanoseconds
+		uint64_t decompressTime; // in nanoseconds
+		uint64_t lockWaitTime; // time spent waiting for the access mutex, in nanoseconds
+		// latency histograms
+		uint64_t readFromFileLatency[kHistogramBuckets];
+		uint64_t lookUpLatency[kHistogramBuckets];
+		// current memory usage of caches and archive tables in bytes
+		uint64_t memoryUsage;
+	};
+
+	static ZArchiveReader* OpenFromFile(const std::filesystem::path& path, uint64_t cacheSize = 4 * 1024 * 1024); // parts of a split archive are picked up automatically if they are named <path>.1, <path>.2, ...
+	static ZArchiveReader* OpenFromFiles(const std::vector<std::filesystem::path>& partPaths, uint64_t cacheSize = 4 * 1024 * 1024); // opens an archive split into the given parts, in order
+	static ZArchiveReader* OpenDelta(const std::filesystem::path& basePath, const std::filesystem::path& deltaPath, uint64_t cacheSize = 4 * 1024 * 1024); // opens a delta archive together with the base archive it was created against. Blocks stored in the base are read from there
 
 	~ZArchiveReader();
 
@@ -40,45 +74,164 @@ public:
 
 	// file operations
 	uint64_t GetFileSize(ZArchiveNodeHandle nodeHandle);
+	uint64_t GetFileDataOffset(ZArchiveNodeHandle nodeHandle) const; // position of the file data in the uncompressed data stream. Block-aligned files start at a multiple of the block size
 	uint64_t ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint64_t length, void* buffer);
 
+	// archive properties
+	uint32_t GetBlockSize() const { return m_blockSize; }
+	uint64_t GetBlockCount() const { return m_blockCount; }
+	const uint8_t* GetIntegrityHash() const { return m_integrityHash; } // 32 bytes
+
+	// raw block access, used for copying blocks between archives without recompressing them
+	// reads blockCount consecutive blocks in their stored form. data receives the stored bytes of all blocks back to back and storedSizes the size of each block
+	// a stored size of 0 is an all-zero block without data, a size equal to the block size is an uncompressed block, anything else is a zstd frame
+	// for delta archives blocks which live in the base archive are read from there
+	bool ReadStoredBlocks(uint64_t firstBlockIndex, uint32_t blockCount, std::vector<uint8_t>& data, std::vector<uint32_t>& storedSizes) const;
+
+	// look up blocks in a cache shared with other readers and processes before loading them, and publish every loaded block to it. Pass nullptr to detach
+	// the cache is not owned by the reader and has to outlive it. Returns false if the block size of this archive exceeds the slot size of the cache
+	bool SetSharedCache(ZArchiveSharedCache* sharedCache);
+
+	// second cache tier which keeps the compressed data of recently loaded blocks, so a block evicted from the (decompressed) cache is decompressed again without a disk read
+	// compressed blocks are typically several times smaller, so this covers far more of the archive per byte. 0 disables it (default)
+	// for delta archives the base archive gets a compressed cache of the same size
+	void SetCompressedCacheSize(uint64_t size);
+
+	// performance counters. Returns false if the library was built without ZARCHIVE_ENABLE_STATS
+	// the define is part of the public interface since it changes the layout of this class. The CMake target passes it on, other builds have to define it for the library and all users alike
+	// GetStats takes no locks and can be polled while other threads read from the archive
+	bool GetStats(Stats& stats) const;
+	void ResetStats();
+
+	// access tracing and warm start
+	void StartTracing(size_t maxRecords = 1024 * 1024); // record every block access made by ReadFromFile. Recording stops once maxRecords (32 bytes each) are held, since the earliest accesses matter most for warm starts
+	void StopTracing();
+	bool SaveTrace(const std::filesystem::path& path);
+	bool PrefetchFromTrace(const std::filesystem::path& path, uint32_t numThreads = 2); // load the blocks recorded in a trace of this archive into the cache using background threads
+
 private:
 	struct CacheBlock
 	{
 		uint8_t* data;
 		uint64_t blockIndex;
+		bool isLoading; // data is being loaded outside of m_accessMutex
 		// linked-list for LRU
 		CacheBlock* prev;
 		CacheBlock* next;
 	};
 
-	std::mutex m_accessMutex;
+	struct CompressedCacheBlock
+	{
+		uint64_t blockIndex;
+		std::vector<uint8_t> data;
+	};
+
+	// one part of a split archive. Non-split archives consist of a single part
+	struct ArchivePart
+	{
+		std::filesystem::path path;
+		uint64_t offset; // position of the part within the archive
+		uint64_t size;
+		std::ifstream file;
+		std::mutex fileMutex; // each part has its own lock so that reads from different parts can run in parallel
+	};
+
+	mutable std::mutex m_accessMutex;
 
 	std::vector<uint8_t> m_cacheDataBuffer;
 	std::vector<CacheBlock> m_cacheBlocks;
 	CacheBlock* m_lruChainFirst;
 	CacheBlock* m_lruChainLast;
 	std::unordered_map<uint64_t, CacheBlock*> m_blockLookup;
+	std::condition_variable m_blockLoaded; // signaled whenever a block finished loading
+
+	static ZArchiveReader* OpenFromFilesWithBase(const std::vector<std::filesystem::path>& partPaths, uint64_t cacheSize, std::unique_ptr<ZArchiveReader>& baseReader);
+	static std::vector<std::filesystem::path> GetSplitPartPaths(const std::filesystem::path& path);
 
-	ZArchiveReader(std::ifstream&& file, std::vector<_ZARCHIVE::CompressionOffsetRecord>&& offsetRecords, std::vector<uint8_t>&& nameTable, std::vector<_ZARCHIVE::FileDirectoryEntry>&& fileTree, uint64_t compressedDataOffset, uint64_t compressedDataSize);
+	ZArchiveReader(std::vector<std::unique_ptr<ArchivePart>>&& parts, const _ZARCHIVE::Footer& footer, uint32_t blockSize, std::vector<_ZARCHIVE::CompressionOffsetRecord>&& offsetRecords, std::vector<_ZARCHIVE::CompressionOffsetRecordV2>&& offsetRecordsV2, std::vector<uint8_t>&& nameTable, std::vector<_ZARCHIVE::FileDirectoryEntry>&& fileTree, uint64_t cacheSize);
 
-	CacheBlock* GetCachedBlock(uint64_t blockIndex);
+	CacheBlock* GetCachedBlock(std::unique_lock<std::mutex>& lock, uint64_t blockIndex);
 	CacheBlock* RecycleLRUBlock(uint64_t newBlockIndex);
 	void MarkBlockAsMRU(CacheBlock* block);
 
 	void RegisterBlock(CacheBlock* block, uint64_t blockIndex);
 	void UnregisterBlock(CacheBlock* block);
 	bool LoadBlock(CacheBlock* block);
+	bool LoadBlockData(std::vector<std::ifstream>* privateFiles, std::vector<uint8_t>& compressedBuffer, uint64_t blockIndex, uint8_t* output) const;
+	bool ReadAndDecompressBlock(std::vector<std::ifstream>* privateFiles, std::vector<uint8_t>& compressedBuffer, uint64_t blockIndex, uint8_t* output) const;
+	bool GetCompressedCacheBlock(uint64_t blockIndex, std::vector<uint8_t>& compressedBuffer) const;
+	void StoreCompressedCacheBlock(uint64_t blockIndex, const uint8_t* data, uint32_t size) const;
+	void TrimCompressedCache(uint64_t capacity) const;
+	bool GetCompressedBlockRange(uint64_t blockIndex, uint64_t& offset, uint32_t& compressedSize) const;
+	bool GetBaseBlockIndex(uint64_t blockIndex, uint64_t& baseBlockIndex) const; // returns true if the block is stored in the base archive
+
+	void AddTraceRecord(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint32_t length, uint64_t blockIndex, bool isCacheHit);
+	void PrefetchWorker();
+	void StopPrefetch();
 
 	static std::string_view GetName(const std::vector<uint8_t>& nameTable, uint32_t nameOffset);
+	static bool ReadArchiveData(const std::vector<std::unique_ptr<ArchivePart>>& parts, std::vector<std::ifstream>* privateFiles, uint64_t offset, void* buffer, uint64_t size);
 
-	std::ifstream m_file;
-	std::vector<_ZARCHIVE::CompressionOffsetRecord> m_offsetRecords;
+	std::vector<std::unique_ptr<ArchivePart>> m_parts;
+	uint8_t m_integrityHash[32];
+	uint32_t m_blockSize;
+	std::vector<_ZARCHIVE::CompressionOffsetRecord> m_offsetRecords; // version 1
+	std::vector<_ZARCHIVE::CompressionOffsetRecordV2> m_offsetRecordsV2; // version 2
 	std::vector<uint8_t> m_nameTable;
 	std::vector<_ZARCHIVE::FileDirectoryEntry> m_fileTree;
 	uint64_t m_compressedDataOffset;
 	uint64_t m_compressedDataSize;
 	uint64_t m_blockCount;
+	std::unique_ptr<ZArchiveReader> m_baseReader; // delta archives only
+	std::atomic<ZArchiveSharedCache*> m_sharedCache{ nullptr };
 
-	std::vector<uint8_t> m_blockDecompressionBuffer;
+#ifdef ZARCHIVE_ENABLE_STATS
+	// performance counters, updated with relaxed atomics. Each thread adds to one of several shards so that concurrent readers don't contend on the same cache line
+	static constexpr size_t kStatsShards = 16;
+	struct alignas(64) StatsShard
+	{
+		std::atomic<uint64_t> cacheHits;
+		std::atomic<uint64_t> cacheMisses;
+		std::atomic<uint64_t> cacheEvictions;
+		std::atomic<uint64_t> sharedCacheHits;
+		std::atomic<uint64_t> compressedCacheHits;
+		std::atomic<uint64_t> bytesReadFromDisk;
+		std::atomic<uint64_t> bytesDecompressed;
+		std::atomic<uint64_t> ioTime;
+		std::atomic<uint64_t> decompressTime;
+		std::atomic<uint64_t> lockWaitTime;
+		std::atomic<uint64_t> readFromFileLatency[Stats::kHistogramBuckets];
+		std::atomic<uint64_t> lookUpLatency[Stats::kHistogramBuckets];
+	};
+	mutable StatsShard m_stats[kStatsShards]{};
+#endif
+	mutable std::atomic<uint64_t> m_variableMemoryUsage{ 0 }; // trace, prefetch list and compressed cache, so memory usage can be reported without locking
+
+	// compressed cache tier. Blocks are loaded outside of m_accessMutex, so it has its own lock
+	mutable struct
+	{
+		std::mutex mutex;
+		std::atomic<uint64_t> capacity{ 0 }; // atomic so that loads can skip the lock while the tier is disabled
+		uint64_t size{ 0 }; // total compressed bytes held
+		std::list<CompressedCacheBlock> lruList; // most recently used first
+		std::unordered_map<uint64_t, std::list<CompressedCacheBlock>::iterator> blockLookup;
+	}m_compressedCache;
+
+	// tracing, protected by m_accessMutex
+	struct
+	{
+		bool isEnabled{ false };
+		std::chrono::steady_clock::time_point startTime;
+		std::vector<_ZARCHIVE::TraceRecord> records;
+		size_t maxRecords{ 0 };
+	}m_trace;
+
+	// prefetching
+	struct
+	{
+		std::vector<std::thread> threads;
+		std::vector<uint64_t> blocks; // block indices in the order they are loaded
+		std::atomic<size_t> nextIndex{ 0 };
+		std::atomic<bool> stop{ false };
+	}m_prefetch;
 };
\ No newline at end of file
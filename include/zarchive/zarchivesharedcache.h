@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// cache of decompressed blocks in a named shared memory segment, shared by all readers on the machine which open the same name
+// blocks are keyed by the integrity hash of their archive and their block index, so any number of archives can share one cache
+// the cache is split into sets of a few slots each. Slots are protected by sequence counters, readers never block and writers skip a slot instead of waiting for it
+// writers claim a slot with a random token of their process and the claim time. Pids are not used since processes in different pid namespaces can share a segment
+// a claim older than a few seconds is considered abandoned, e.g. by a process which crashed while writing, and the slot is taken over by the next writer
+// a writer which stalls for longer than that loses its claim. It checks the claim between 4KiB chunks of the copy and before publishing the block, so only a chunk copy already in flight can overlap the new owner
+// claim times come from the monotonic clock, all processes using a segment have to share it (the default, unless they run in different time namespaces)
+// named segments are only available on POSIX systems, private caches work everywhere
+class ZArchiveSharedCache
+{
+public:
+	// opens the segment or creates it with the given size. Blocks larger than slotSize are not cached
+	// returns nullptr if shared memory is unavailable or an existing segment was created with a different slot size
+	static ZArchiveSharedCache* Open(const char* name, uint64_t size, uint32_t slotSize = 64 * 1024);
+	static bool Remove(const char* name); // deletes the segment once all processes detached from it
+	// same cache in ordinary memory, for readers within one process which should share a single budget. Returns nullptr if the allocation fails
+	static ZArchiveSharedCache* CreatePrivate(uint64_t size, uint32_t slotSize = 64 * 1024);
+
+	~ZArchiveSharedCache();
+
+	uint32_t GetSlotSize() const { return m_slotSize; }
+	uint64_t GetSlotCount() const { return m_setCount * m_ways; }
+
+	// used by ZArchiveReader
+	bool ReadBlock(const uint8_t* archiveHash, uint64_t blockIndex, uint8_t* output, uint32_t blockSize);
+	void WriteBlock(const uint8_t* archiveHash, uint64_t blockIndex, const uint8_t* data, uint32_t blockSize);
+
+private:
+	struct SegmentHeader;
+	struct SlotHeader;
+
+	ZArchiveSharedCache(void* mapping, uint64_t mappingSize, bool isPrivate);
+
+	static void InitSegment(SegmentHeader* header, uint32_t slotSize, uint64_t setCount);
+
+	uint64_t GetSetIndex(uint64_t archiveId0, uint64_t blockIndex) const;
+	SlotHeader* GetSlotHeader(uint64_t slotIndex) const;
+	uint8_t* GetSlotData(uint64_t slotIndex) const;
+
+	void* m_mapping;
+	uint64_t m_mappingSize;
+	bool m_isPrivate;
+	SegmentHeader* m_header;
+	uint32_t m_slotSize;
+	uint32_t m_ways;
+	uint64_t m_setCount;
+	uint64_t m_dataOffset;
+};
@@ -4,11 +4,22 @@
 #include <vector>
 #include <string_view>
 #include <unordered_map>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <deque>
 
 #include "zarchivecommon.h"
 
+class ZArchiveReader;
+
 class ZArchiveWriter
 {
+	static constexpr uint32_t INVALID_NODE_INDEX = 0xFFFFFFFF;
+
 	struct PathNode
 	{
 		PathNode() : isFile(false), nameIndex(0xFFFFFFFF) {};
@@ -17,7 +28,11 @@ class ZArchiveWriter
 		bool isFile;
 		uint32_t nameIndex; // index in m_nodeNames
 
-		std::vector<PathNode*> subnodes;
+		// subnodes form a singly linked list of node indices
+		uint32_t firstSubnode{ INVALID_NODE_INDEX };
+		uint32_t nextSibling{ INVALID_NODE_INDEX };
+		uint32_t subnodeCount{};
+		uint32_t subnodeLookupIndex{ INVALID_NODE_INDEX }; // index in m_subnodeLookups, only assigned to large directories
 
 		// file properties
 		uint64_t fileOffset{};
@@ -27,27 +42,143 @@ class ZArchiveWriter
 	};
 
 public:
+	struct Stats
+	{
+		uint64_t uncompressedBytes; // size of the uncompressed data stream, including padding
+		uint64_t compressedBytes; // size of the output, including data still held in the output buffer
+		uint64_t blockCount;
+		// time per stage, in nanoseconds
+		uint64_t inputCopyTime; // buffering of data passed to AppendData
+		uint64_t compressTime;
+		uint64_t hashTime; // integrity and deduplication hashing
+		uint64_t outputTime; // time spent in the output callback
+		uint64_t elapsedTime; // since the writer was created
+		int compressionLevel; // current level, can change in adaptive mode
+
+		double GetCompressionRatio() const { return compressedBytes ? (double)uncompressedBytes / (double)compressedBytes : 0.0; }
+		double GetBlocksPerSecond() const { return elapsedTime ? (double)blockCount * 1000000000.0 / (double)elapsedTime : 0.0; }
+	};
+
+	// handle for writing a single file from any thread, see OpenFile
+	class FileWriter
+	{
+		friend class ZArchiveWriter;
+	public:
+		void AppendData(const void* data, size_t size);
+
+	private:
+		FileWriter(ZArchiveWriter* writer, PathNode* fileNode, struct ZSTD_CCtx_s* zstdCCtx, int compressionLevel);
+		~FileWriter();
+
+		void EncodeCurrentBlock();
+
+		ZArchiveWriter* m_writer;
+		PathNode* m_fileNode;
+		struct ZSTD_CCtx_s* m_zstdCCtx;
+		int m_compressionLevel;
+		std::vector<uint8_t> m_currentBlock;
+		std::vector<uint8_t> m_encodedData; // stored data of all completed blocks
+		std::vector<uint32_t> m_encodedSizes; // stored size per block
+		// instrumentation
+		uint64_t m_inputCopyTime{ 0 };
+		uint64_t m_compressTime{ 0 };
+		uint64_t m_hashTime{ 0 };
+		// deduplication
+		struct Sha_256* m_shaCtx{};
+		std::array<uint8_t, 32> m_contentHash;
+	};
+
 	typedef void(*CB_NewOutputFile)(const int32_t partIndex, void* ctx);
 	typedef void(*CB_WriteOutputData)(const void* data, size_t length, void* ctx);
+	typedef void(*CB_Progress)(const Stats& stats, void* ctx);
+	typedef bool(*CB_SelectNode)(std::string_view path, bool isDirectory, void* ctx); // path is relative to the root of the source archive. Selecting a directory selects everything below it
 
 	ZArchiveWriter(CB_NewOutputFile cbNewOutputFile, CB_WriteOutputData cbWriteOutputData, void* ctx);
 	~ZArchiveWriter();
 
-	bool StartNewFile(const char* path); // creates a new virtual file and makes it active
+	bool StartNewFile(const char* path, bool blockAligned = false); // creates a new virtual file and makes it active. If blockAligned is set the file data starts at a block boundary which trades some padding for fewer block decompressions when reading it
 	void AppendData(const void* data, size_t size); // appends data to currently active file
 	bool MakeDir(const char* path, bool recursive = false);
-	void Finalize();
+	void Finalize(); // all handles returned by OpenFile must be closed before finalizing
+
+	// multi-producer interface. OpenFile and CloseFile can be called from any thread, each handle can then be written by one thread at a time
+	// handles compress their data into their own blocks in parallel. The file only enters the output stream when closed, starting at a block boundary
+	// the compressed data of a file is held in memory until then
+	FileWriter* OpenFile(const char* path);
+	void CloseFile(FileWriter* fileWriter); // appends the file to the archive and destroys the handle
+
+	// adds the files of another archive below path (root if empty) by copying its compressed blocks verbatim. Directories are merged, the block size must match
+	// if cbSelectNode is set only the selected files and directories are added. Blocks which also hold data of unselected files are decompressed, have that data zeroed and are compressed again
+	// returns false if a file already exists or a read fails. Conflicts are detected before any data is copied
+	bool AppendArchive(ZArchiveReader* reader, const char* path = "", CB_SelectNode cbSelectNode = nullptr, void* ctx = nullptr);
+	// recompresses all blocks of another archive with the settings of this writer, using numThreads threads (0 for one per core). The tree and all file offsets are kept exactly
+	// the block size may differ from the source archive. Must be called before anything else is added, adaptive compression and deduplication do not apply
+	bool TranscodeArchive(ZArchiveReader* reader, uint32_t numThreads = 0);
+
+	// compression settings, should be set before any data is appended
+	bool SetBlockSize(uint32_t blockSize); // block sizes other than the default 64KiB require format version 2
+	void SetCompressionLevel(int level);
+	void EnableAdaptiveCompression(int minLevel, int maxLevel); // dynamically adjust the level within [minLevel, maxLevel] based on the time spent compressing vs the time the output callback needs for the produced data. The latter is a moving average, so buffered and asynchronous output are judged by the sink's actual speed
+	int GetCompressionLevel() const { return m_compressionLevel; } // current level, changes over time in adaptive mode
+	bool SetZeroBlockElision(bool enable); // store all-zero blocks without any data. Requires format version 2
+	void SetDeduplication(bool enable, uint64_t maxFileSize = 64 * 1024 * 1024); // files with identical content share the same data. Files are held in memory until complete, larger files are never deduplicated
+	// create a delta archive against baseReader: blocks whose content already exists in the base are stored as references to it. Reading the result requires ZArchiveReader::OpenDelta with the same base
+	// the block size must be set before and match the base. Requires format version 2
+	// the base is read and hashed one block at a time and only the hash table (about 64 bytes per block) is kept, the reader is not used afterwards
+	// blocks are only matched at block boundaries of the data stream: content which moved by anything other than a multiple of the block size, e.g. after an insertion earlier in the archive, is not found in the base
+	bool SetDeltaBase(ZArchiveReader* baseReader);
+
+	// output is collected into chunks of this size before it is passed to the output callback. Every call except the final one receives a full chunk from a 4KiB aligned buffer
+	// the size must be a multiple of 4KiB, 0 passes every write through immediately, which is the default
+	bool SetOutputBufferSize(size_t size);
+	// pass full output chunks to a dedicated thread which calls the output callback, so that compression continues while data is written
+	// up to bufferCount chunks of the output buffer size are in flight. When all are in use the writer waits, this wait is reported as output time
+	// requires a non-zero output buffer size. The output callback is then invoked from the output thread
+	bool EnableAsyncOutput(uint32_t bufferCount = 4);
+	// split the output into parts of at most partSize bytes. After the initial output file (partIndex -1) the new output file callback is invoked with partIndex 1, 2, ... whenever a part is full
+	// readers expect the parts of <name> to be named <name>.1, <name>.2 and so on. Must be set before any output is written, 0 disables splitting
+	// a multiple of the output buffer size keeps every write aligned
+	bool SetSplitSize(uint64_t partSize);
+
+	// instrumentation
+	Stats GetStats() const;
+	void SetProgressCallback(CB_Progress cbProgress, void* ctx, uint64_t interval = 64 * 1024 * 1024); // called after every interval bytes of uncompressed data and once more when finalizing
 
 private:
 	PathNode* GetNodeByPath(PathNode* root, std::string_view path);
 	PathNode* FindSubnodeByName(PathNode* parent, std::string_view nodeName);
+	PathNode* AddSubnode(PathNode* parent, bool isFile, std::string_view name);
+	PathNode* MakeDirRecursive(std::string_view path);
+	PathNode& GetNode(uint32_t nodeIndex) { return m_nodeChunks[nodeIndex / NODES_PER_CHUNK][nodeIndex % NODES_PER_CHUNK]; }
+	void CloseCurrentFile();
 
 	uint32_t CreateNameEntry(std::string_view name);
+	void GrowNameTable();
 
 	void OutputData(const void* data, size_t length);
+	void FlushOutputBuffer();
+	void WriteOutputParts(const uint8_t* data, size_t length);
+	void UpdateSinkCost(size_t length, uint64_t outputTime);
+	void AsyncOutputWorker();
+	void StopAsyncOutput();
 	uint64_t GetCurrentOutputOffset() const;
 
+	void WriteStreamData(const void* data, size_t size);
+	void PadToBlockBoundary();
 	void StoreBlock(const uint8_t* uncompressedData);
+	uint32_t EncodeBlock(struct ZSTD_CCtx_s* zstdCCtx, int compressionLevel, const uint8_t* uncompressedData, std::vector<uint8_t>& output, uint64_t& compressTime) const;
+	void CommitFile(FileWriter* fileWriter);
+	void CommitPendingFiles();
+	struct ArchiveMergeState;
+	bool CollectArchiveNodes(ArchiveMergeState& state, uint32_t dirHandle, PathNode* dir, std::string& path, bool isSelected, bool& hasSelectedNodes);
+	void AddArchiveNodes(ArchiveMergeState& state, uint32_t dirHandle, PathNode* dir);
+	bool CopyStoredBlocks(ArchiveMergeState& state, uint64_t firstBlockIndex, uint64_t blockCount);
+	struct TranscodeBatch;
+	bool TranscodeBatchData(ZArchiveReader* reader, struct ZSTD_CCtx_s* zstdCCtx, struct ZSTD_DCtx_s* zstdDCtx, uint64_t beginOffset, uint64_t endOffset, uint64_t dataEnd, TranscodeBatch& batch) const;
+	void AddOffsetRecordEntry(uint64_t compressedOffset, uint32_t compressedSize);
+	void UpdateFormatVersion();
+	void UpdateAdaptiveCompression();
+	void ReportProgress();
 
 	void WriteOffsetRecords();
 	void WriteNameTable();
@@ -60,22 +191,112 @@ private:
 	CB_NewOutputFile m_cbNewOutputFile;
 	CB_WriteOutputData m_cbWriteOutputData;
 	void* m_cbCtx;
-	// file tree
-	PathNode m_rootNode;
+	// output buffering
+	static constexpr size_t OUTPUT_BUFFER_ALIGNMENT = 4096;
+	std::vector<uint8_t> m_outputBufferStorage;
+	uint8_t* m_outputBuffer{ nullptr }; // aligned pointer into m_outputBufferStorage
+	size_t m_outputBufferSize{ 0 };
+	size_t m_outputBufferUsed{ 0 };
+	struct
+	{
+		bool isEnabled{ false };
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable bufferQueued;
+		std::condition_variable bufferReleased;
+		std::vector<std::vector<uint8_t>> storage;
+		std::vector<uint8_t*> freeBuffers;
+		std::deque<std::pair<uint8_t*, size_t>> queuedBuffers; // buffer and used size, in output order
+		bool stop{ false };
+	}m_asyncOutput;
+	// split output, only accessed by the thread which invokes the output callbacks
+	struct
+	{
+		uint64_t partSize{ 0 };
+		uint64_t partOffset{ 0 }; // bytes written to the current part
+		int32_t partIndex{ 0 };
+	}m_split;
+	// protects the file tree and the output stream, so that files can be opened and closed from multiple threads
+	std::mutex m_mutex;
+	// multi-producer files
+	std::vector<struct ZSTD_CCtx_s*> m_zstdCCtxPool; // contexts not in use by any handle
+	std::vector<FileWriter*> m_pendingFiles; // closed while a file started with StartNewFile was active
+	// file tree. Nodes are allocated from fixed-size chunks so that their addresses stay stable, node 0 is the root
+	static constexpr uint32_t NODES_PER_CHUNK = 16 * 1024;
+	std::vector<std::unique_ptr<PathNode[]>> m_nodeChunks;
+	uint32_t m_nodeCount{ 0 };
 	PathNode* m_currentFileNode{ nullptr };
-	std::vector<std::string> m_nodeNames;
+	// node names are stored in large chunks and referenced by views
+	static constexpr size_t NAME_CHUNK_SIZE = 1024 * 1024;
+	std::vector<std::unique_ptr<char[]>> m_nameChunks;
+	size_t m_nameChunkUsed{ NAME_CHUNK_SIZE }; // bytes used in the last chunk
+	std::vector<std::string_view> m_nodeNames;
 	std::vector<uint32_t> m_nodeNameOffsets;
-	std::unordered_map<std::string, uint32_t> m_nodeNameLookup;
+	std::vector<uint32_t> m_nodeNameTable; // open addressing hash table of indices into m_nodeNames, INVALID_NODE_INDEX marks free slots. The size is a power of two and at most half of it is used
+	// case-insensitive name -> node index, built for directories once they exceed SUBNODE_LOOKUP_THRESHOLD entries
+	static constexpr uint32_t SUBNODE_LOOKUP_THRESHOLD = 32;
+	using SubnodeLookup = std::unordered_map<std::string_view, uint32_t, _ZARCHIVE::NodeNameHash, _ZARCHIVE::NodeNameEqual>;
+	std::vector<std::unique_ptr<SubnodeLookup>> m_subnodeLookups;
 	// footer
 	_ZARCHIVE::Footer m_footer;
+	// format
+	uint32_t m_formatVersion;
+	uint32_t m_blockSize;
+	bool m_elideZeroBlocks{ false };
 	// writes and compression
 	std::vector<uint8_t> m_currentWriteBuffer;
 	std::vector<uint8_t> m_compressionBuffer;
 	uint64_t m_currentCompressedWriteIndex{ 0 }; // output file write index
 	uint64_t m_currentInputOffset{ 0 }; // current offset within uncompressed file data
+	struct ZSTD_CCtx_s* m_zstdCCtx{};
+	int m_compressionLevel{ 6 };
+	// adaptive compression
+	struct
+	{
+		bool isEnabled{ false };
+		int minLevel;
+		int maxLevel;
+		uint64_t windowInputSize{ 0 };
+		uint64_t windowCompressTime{ 0 }; // in nanoseconds
+		uint64_t windowOutputSize{ 0 }; // stored bytes
+		std::atomic<double> sinkNsPerByte{ -1.0 }; // moving average, written by whichever thread invokes the output callback. Negative until the first write
+	}m_adaptiveCompression;
 	// uncompressed-to-compressed offset records
 	uint64_t m_numWrittenOffsetRecords{ 0 };
 	std::vector<_ZARCHIVE::CompressionOffsetRecord> m_compressionOffsetRecord;
+	std::vector<_ZARCHIVE::CompressionOffsetRecordV2> m_compressionOffsetRecordV2;
+	// instrumentation
+	Stats m_stats{};
+	uint64_t m_creationTime;
+	CB_Progress m_cbProgress{ nullptr };
+	void* m_cbProgressCtx{ nullptr };
+	uint64_t m_progressInterval{ 0 };
+	uint64_t m_nextProgressReport{ 0 };
+	// deduplication
+	struct ContentHashFunc
+	{
+		size_t operator()(const std::array<uint8_t, 32>& hash) const
+		{
+			size_t h;
+			memcpy(&h, hash.data(), sizeof(size_t));
+			return h;
+		}
+	};
+	struct
+	{
+		bool isEnabled{ false };
+		bool isBuffering{ false }; // true while the data of the current file is held back
+		uint64_t maxFileSize;
+		std::vector<uint8_t> pendingData;
+		std::unordered_map<std::array<uint8_t, 32>, PathNode*, ContentHashFunc> contentLookup; // sha256 of file content -> first file with this content
+	}m_dedup;
+	// delta archives
+	struct
+	{
+		bool isEnabled{ false };
+		uint8_t baseIntegrityHash[32];
+		std::unordered_map<std::array<uint8_t, 32>, uint32_t, ContentHashFunc> blockLookup; // sha256 of block content -> block index in the base archive
+	}m_delta;
 	// hashing
 	struct Sha_256* m_mainShaCtx{};
 	uint8_t m_integritySha[32];
@@ -0,0 +1,420 @@
+#include "zarchive/zarchivewriter.h"
+#include "zarchive/zarchivereader.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <optional>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace fs = std::filesystem;
+
+// Benchmark suite for ZArchive
+// Generates synthetic corpora, packs them with various settings and measures reader performance
+// Results are printed as JSON lines, one per measurement
+
+struct BenchOptions
+{
+	double scale{ 1.0 }; // multiplier for the corpus sizes
+	std::optional<std::string> corpusFilter;
+	fs::path tempDirectory{ fs::temp_directory_path() };
+	FILE* output{ stdout };
+};
+
+class Xorshift64
+{
+public:
+	Xorshift64(uint64_t seed) : m_state(seed ? seed : 1) {};
+
+	uint64_t Next()
+	{
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 7;
+		m_state ^= m_state << 17;
+		return m_state;
+	}
+
+	uint64_t NextRange(uint64_t min, uint64_t max) // inclusive
+	{
+		return min + Next() % (max - min + 1);
+	}
+
+private:
+	uint64_t m_state;
+};
+
+static uint64_t GetTimestampNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct CorpusFile
+{
+	std::string path;
+	uint64_t size;
+	uint64_t seed;
+};
+
+struct Corpus
+{
+	std::string name;
+	bool compressible;
+	std::vector<std::string> directories; // parents are listed before their children
+	std::vector<CorpusFile> files;
+};
+
+static void GenerateFileData(const CorpusFile& file, bool compressible, std::vector<uint8_t>& data)
+{
+	static const char* s_words[] = { "archive", "block", "texture", "model", "sound", "level", "script", "shader", "0x00000000", "vertex", "index", "\n", " ", "\t", "{", "}" };
+	data.resize(file.size);
+	Xorshift64 rng(file.seed);
+	if (!compressible)
+	{
+		for (size_t i = 0; i < data.size(); i++)
+			data[i] = (uint8_t)rng.Next();
+		return;
+	}
+	size_t i = 0;
+	while (i < data.size())
+	{
+		const char* word = s_words[rng.Next() % (sizeof(s_words) / sizeof(s_words[0]))];
+		for (const char* c = word; *c && i < data.size(); c++)
+			data[i++] = (uint8_t)*c;
+	}
+}
+
+static Corpus GenerateCorpusSmallFiles(double scale, bool compressible)
+{
+	Corpus corpus;
+	corpus.name = compressible ? "small_files_text" : "small_files_random";
+	corpus.compressible = compressible;
+	Xorshift64 rng(1);
+	size_t numDirs = std::max<size_t>(1, (size_t)(64 * scale));
+	size_t numFiles = std::max<size_t>(1, (size_t)(20000 * scale));
+	for (size_t i = 0; i < numDirs; i++)
+		corpus.directories.emplace_back("dir" + std::to_string(i));
+	for (size_t i = 0; i < numFiles; i++)
+		corpus.files.push_back({ "dir" + std::to_string(i % numDirs) + "/file" + std::to_string(i) + ".bin", rng.NextRange(64, 16 * 1024), rng.Next() });
+	return corpus;
+}
+
+static Corpus GenerateCorpusHugeFiles(double scale, bool compressible)
+{
+	Corpus corpus;
+	corpus.name = compressible ? "huge_files_text" : "huge_files_random";
+	corpus.compressible = compressible;
+	Xorshift64 rng(2);
+	uint64_t fileSize = std::max<uint64_t>(1024 * 1024, (uint64_t)(64.0 * 1024.0 * 1024.0 * scale));
+	for (size_t i = 0; i < 4; i++)
+		corpus.files.push_back({ "huge" + std::to_string(i) + ".dat", fileSize, rng.Next() });
+	return corpus;
+}
+
+static Corpus GenerateCorpusDeepTree(double scale)
+{
+	Corpus corpus;
+	corpus.name = "deep_tree";
+	corpus.compressible = true;
+	Xorshift64 rng(3);
+	size_t numBranches = std::max<size_t>(1, (size_t)(16 * scale));
+	for (size_t b = 0; b < numBranches; b++)
+	{
+		std::string path = "branch" + std::to_string(b);
+		corpus.directories.emplace_back(path);
+		for (size_t depth = 0; depth < 32; depth++)
+		{
+			corpus.files.push_back({ path + "/data" + std::to_string(depth) + ".txt", rng.NextRange(256, 8 * 1024), rng.Next() });
+			path.append("/level").append(std::to_string(depth));
+			corpus.directories.emplace_back(path);
+		}
+	}
+	return corpus;
+}
+
+static Corpus GenerateCorpusWideTree(double scale)
+{
+	Corpus corpus;
+	corpus.name = "wide_tree";
+	corpus.compressible = true;
+	Xorshift64 rng(4);
+	size_t numFiles = std::max<size_t>(1, (size_t)(50000 * scale));
+	for (size_t i = 0; i < numFiles; i++)
+		corpus.files.push_back({ "entry_" + std::to_string(rng.Next() % 1000000) + "_" + std::to_string(i) + ".txt", rng.NextRange(16, 512), rng.Next() });
+	return corpus;
+}
+
+class BenchReporter
+{
+public:
+	BenchReporter(FILE* output) : m_output(output) {};
+
+	void Report(const Corpus& corpus, uint32_t blockSize, const char* metric, double value, const char* unit, const char* extraKey = nullptr, uint64_t extraValue = 0)
+	{
+		fprintf(m_output, "{\"corpus\":\"%s\",\"blockSize\":%u,\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"", corpus.name.c_str(), blockSize, metric, value, unit);
+		if (extraKey)
+			fprintf(m_output, ",\"%s\":%llu", extraKey, (unsigned long long)extraValue);
+		fprintf(m_output, "}\n");
+		fflush(m_output);
+	}
+
+private:
+	FILE* m_output;
+};
+
+struct BenchOutputContext
+{
+	fs::path path;
+	std::ofstream file;
+};
+
+static void _bench_NewOutputFile([[maybe_unused]] const int32_t partIndex, void* ctx)
+{
+	BenchOutputContext* outputContext = (BenchOutputContext*)ctx;
+	outputContext->file = std::ofstream(outputContext->path, std::ios::binary);
+}
+
+static void _bench_WriteOutputData(const void* data, size_t length, void* ctx)
+{
+	BenchOutputContext* outputContext = (BenchOutputContext*)ctx;
+	outputContext->file.write((const char*)data, length);
+}
+
+static bool BenchPack(const Corpus& corpus, uint32_t blockSize, const fs::path& archivePath, BenchReporter& reporter)
+{
+	// generate all data upfront so that the measurement only covers the writer
+	std::vector<std::vector<uint8_t>> fileData(corpus.files.size());
+	uint64_t totalSize = 0;
+	for (size_t i = 0; i < corpus.files.size(); i++)
+	{
+		GenerateFileData(corpus.files[i], corpus.compressible, fileData[i]);
+		totalSize += fileData[i].size();
+	}
+	BenchOutputContext outputContext;
+	outputContext.path = archivePath;
+	uint64_t startTime = GetTimestampNs();
+	{
+		ZArchiveWriter writer(_bench_NewOutputFile, _bench_WriteOutputData, &outputContext);
+		if (!writer.SetBlockSize(blockSize))
+			return false;
+		for (auto& dir : corpus.directories)
+		{
+			if (!writer.MakeDir(dir.c_str(), false))
+				return false;
+		}
+		for (size_t i = 0; i < corpus.files.size(); i++)
+		{
+			if (!writer.StartNewFile(corpus.files[i].path.c_str()))
+				return false;
+			writer.AppendData(fileData[i].data(), fileData[i].size());
+		}
+		writer.Finalize();
+		outputContext.file.close();
+	}
+	double elapsed = (double)(GetTimestampNs() - startTime) / 1000000000.0;
+	std::error_code ec;
+	uint64_t archiveSize = fs::file_size(archivePath, ec);
+	reporter.Report(corpus, blockSize, "pack_throughput", (double)totalSize / (1024.0 * 1024.0) / elapsed, "MiB/s");
+	reporter.Report(corpus, blockSize, "compression_ratio", archiveSize ? (double)totalSize / (double)archiveSize : 0.0, "x");
+	reporter.Report(corpus, blockSize, "archive_size", (double)archiveSize, "bytes");
+	return true;
+}
+
+static void BenchOpen(const Corpus& corpus, uint32_t blockSize, const fs::path& archivePath, BenchReporter& reporter)
+{
+	const int iterations = 5;
+	uint64_t startTime = GetTimestampNs();
+	for (int i = 0; i < iterations; i++)
+		delete ZArchiveReader::OpenFromFile(archivePath);
+	reporter.Report(corpus, blockSize, "open_time", (double)(GetTimestampNs() - startTime) / 1000.0 / iterations, "us");
+}
+
+static void BenchLookUp(const Corpus& corpus, uint32_t blockSize, ZArchiveReader* reader, BenchReporter& reporter)
+{
+	std::vector<size_t> order(corpus.files.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	Xorshift64 rng(5);
+	for (size_t i = order.size(); i > 1; i--)
+		std::swap(order[i - 1], order[rng.Next() % i]);
+	uint64_t startTime = GetTimestampNs();
+	size_t numFound = 0;
+	for (size_t i : order)
+	{
+		if (reader->LookUp(corpus.files[i].path) != ZARCHIVE_INVALID_NODE)
+			numFound++;
+	}
+	double elapsed = (double)(GetTimestampNs() - startTime) / 1000000000.0;
+	reporter.Report(corpus, blockSize, "lookup_rate", (double)numFound / elapsed, "lookups/s");
+}
+
+static void BenchSequentialRead(const Corpus& corpus, uint32_t blockSize, ZArchiveReader* reader, uint64_t cacheSize, BenchReporter& reporter)
+{
+	std::vector<uint8_t> buffer(1024 * 1024);
+	uint64_t totalRead = 0;
+	uint64_t startTime = GetTimestampNs();
+	for (auto& file : corpus.files)
+	{
+		ZArchiveNodeHandle handle = reader->LookUp(file.path);
+		uint64_t offset = 0;
+		while (true)
+		{
+			uint64_t bytesRead = reader->ReadFromFile(handle, offset, buffer.size(), buffer.data());
+			if (bytesRead == 0)
+				break;
+			offset += bytesRead;
+		}
+		totalRead += offset;
+	}
+	double elapsed = (double)(GetTimestampNs() - startTime) / 1000000000.0;
+	reporter.Report(corpus, blockSize, "sequential_read_throughput", (double)totalRead / (1024.0 * 1024.0) / elapsed, "MiB/s", "cacheSize", cacheSize);
+}
+
+// random 4KiB reads at random file offsets from numThreads threads at once
+static void BenchRandomRead(const Corpus& corpus, uint32_t blockSize, ZArchiveReader* reader, uint64_t cacheSize, uint32_t numThreads, BenchReporter& reporter)
+{
+	const size_t readsPerThread = 20000;
+	const uint64_t readSize = 4096;
+	std::vector<ZArchiveNodeHandle> handles;
+	for (auto& file : corpus.files)
+		handles.emplace_back(reader->LookUp(file.path));
+	std::vector<std::vector<uint64_t>> latencies(numThreads);
+	std::vector<std::thread> threads;
+	uint64_t startTime = GetTimestampNs();
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		threads.emplace_back([&, t]()
+			{
+				Xorshift64 rng(100 + t);
+				std::vector<uint8_t> buffer(readSize);
+				latencies[t].reserve(readsPerThread);
+				for (size_t i = 0; i < readsPerThread; i++)
+				{
+					size_t fileIndex = rng.Next() % handles.size();
+					uint64_t fileSize = corpus.files[fileIndex].size;
+					uint64_t offset = fileSize > readSize ? rng.Next() % (fileSize - readSize) : 0;
+					uint64_t readStartTime = GetTimestampNs();
+					reader->ReadFromFile(handles[fileIndex], offset, readSize, buffer.data());
+					latencies[t].emplace_back(GetTimestampNs() - readStartTime);
+				}
+			});
+	}
+	for (auto& it : threads)
+		it.join();
+	double elapsed = (double)(GetTimestampNs() - startTime) / 1000000000.0;
+	std::vector<uint64_t> allLatencies;
+	for (auto& it : latencies)
+		allLatencies.insert(allLatencies.end(), it.begin(), it.end());
+	std::sort(allLatencies.begin(), allLatencies.end());
+	if (numThreads == 1)
+	{
+		reporter.Report(corpus, blockSize, "random_read_latency_p50", (double)allLatencies[allLatencies.size() / 2] / 1000.0, "us", "cacheSize", cacheSize);
+		reporter.Report(corpus, blockSize, "random_read_latency_p99", (double)allLatencies[allLatencies.size() * 99 / 100] / 1000.0, "us", "cacheSize", cacheSize);
+	}
+	reporter.Report(corpus, blockSize, "random_read_rate", (double)allLatencies.size() / elapsed, "reads/s", "threads", numThreads);
+}
+
+static void BenchCorpus(const Corpus& corpus, const BenchOptions& options, BenchReporter& reporter)
+{
+	fs::path archivePath = options.tempDirectory / ("zarchive_bench_" + corpus.name + ".zar");
+	for (uint32_t blockSize : { 16u * 1024, 64u * 1024, 256u * 1024, 1024u * 1024 })
+	{
+		if (!BenchPack(corpus, blockSize, archivePath, reporter))
+		{
+			fprintf(stderr, "Failed to pack corpus %s\n", corpus.name.c_str());
+			continue;
+		}
+		BenchOpen(corpus, blockSize, archivePath, reporter);
+		for (uint64_t cacheSize : { 1ull * 1024 * 1024, 4ull * 1024 * 1024, 64ull * 1024 * 1024 })
+		{
+			ZArchiveReader* reader = ZArchiveReader::OpenFromFile(archivePath, cacheSize);
+			if (!reader)
+			{
+				fprintf(stderr, "Failed to open archive of corpus %s\n", corpus.name.c_str());
+				break;
+			}
+			if (cacheSize == 4ull * 1024 * 1024)
+				BenchLookUp(corpus, blockSize, reader, reporter);
+			BenchSequentialRead(corpus, blockSize, reader, cacheSize, reporter);
+			BenchRandomRead(corpus, blockSize, reader, cacheSize, 1, reporter);
+			delete reader;
+		}
+		// multi-threaded scaling with the default cache size
+		ZArchiveReader* reader = ZArchiveReader::OpenFromFile(archivePath);
+		if (reader)
+		{
+			for (uint32_t numThreads : { 2u, 4u, 8u })
+				BenchRandomRead(corpus, blockSize, reader, 4ull * 1024 * 1024, numThreads, reporter);
+			delete reader;
+		}
+	}
+	std::error_code ec;
+	fs::remove(archivePath, ec);
+}
+
+static void PrintHelp()
+{
+	puts("Usage: zarchive_bench [options]");
+	puts("--scale=F          multiply corpus sizes by F (default 1.0)");
+	puts("--corpus=NAME      only run the corpus with the given name");
+	puts("--temp-dir=PATH    directory for temporary archives");
+	puts("--output=FILE      write results to FILE instead of stdout");
+	puts("Results are written as JSON lines");
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg.starts_with("--scale="))
+			options.scale = atof(argv[i] + 8);
+		else if (arg.starts_with("--corpus="))
+			options.corpusFilter = std::string(arg.substr(9));
+		else if (arg.starts_with("--temp-dir="))
+			options.tempDirectory = fs::path(arg.substr(11));
+		else if (arg.starts_with("--output="))
+		{
+			options.output = fopen(argv[i] + 9, "w");
+			if (!options.output)
+			{
+				printf("Failed to open output file %s\n", argv[i] + 9);
+				return -1;
+			}
+		}
+		else
+		{
+			PrintHelp();
+			return arg == "--help" ? 0 : -1;
+		}
+	}
+	if (options.scale <= 0.0)
+	{
+		puts("Invalid scale");
+		return -1;
+	}
+	std::vector<Corpus> corpora;
+	corpora.emplace_back(GenerateCorpusSmallFiles(options.scale, true));
+	corpora.emplace_back(GenerateCorpusSmallFiles(options.scale, false));
+	corpora.emplace_back(GenerateCorpusHugeFiles(options.scale, true));
+	corpora.emplace_back(GenerateCorpusHugeFiles(options.scale, false));
+	corpora.emplace_back(GenerateCorpusDeepTree(options.scale));
+	corpora.emplace_back(GenerateCorpusWideTree(options.scale));
+	BenchReporter reporter(options.output);
+	for (auto& corpus : corpora)
+	{
+		if (options.corpusFilter && *options.corpusFilter != corpus.name)
+			continue;
+		BenchCorpus(corpus, options, reporter);
+	}
+	if (options.output != stdout)
+		fclose(options.output);
+	return 0;
+}
@@ -6,61 +6,180 @@
 #include <filesystem>
 #include <cassert>
 #include <optional>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 namespace fs = std::filesystem;
 
-void PrintHelp()
+struct PackOptions
 {
-	puts("Usage:\n");
-	puts("zarchive.exe input_path [output_path]");
-	puts("If input_path is a directory, then output_path will be the ZArchive output file path");
-	puts("If input_path is a ZArchive file path, then output_path will be the output directory");
-	puts("output_path is optional");
-}
+	std::optional<uint32_t> blockSize; // 64KiB when packing, merge and subset keep the block size of the input
+	int compressionLevel{ 6 };
+	bool elideZeroBlocks{ false };
+	bool deduplicate{ false };
+	std::optional<uint64_t> alignMinSize; // block-align files of at least this size
+	std::vector<std::string> alignExtensions; // block-align files with these extensions
+	std::optional<fs::path> accessOrderFile;
+	bool showProgress{ false };
+	bool adaptiveCompression{ false };
+	int adaptiveMinLevel{ 1 };
+	int adaptiveMaxLevel{ 19 };
+	uint32_t numThreads{ std::max<uint32_t>(std::thread::hardware_concurrency(), 1) }; // threads for scanning and reading input files
+	uint64_t readAheadSize{ 64 * 1024 * 1024 }; // maximum amount of input data buffered ahead of the writer
+	uint64_t outputBufferSize{ 4 * 1024 * 1024 };
+	uint32_t asyncOutputBuffers{ 0 }; // 0 writes synchronously
+	uint64_t splitSize{ 0 };
+	bool directIO{ false };
+	std::optional<fs::path> deltaBase; // create a delta archive against this archive
+};
 
-bool ExtractFile(ZArchiveReader* reader, std::string_view srcPath, const fs::path& path)
+// parses sizes such as 4096, 64K or 1M
+std::optional<uint64_t> ParseSize(const char* str)
 {
-	ZArchiveNodeHandle fileHandle = reader->LookUp(srcPath, true, false);
-	if (fileHandle == ZARCHIVE_INVALID_NODE)
+	char* end;
+	uint64_t v = strtoull(str, &end, 10);
+	if (end == str)
+		return std::nullopt;
+	if (*end == 'K' || *end == 'k')
 	{
-		puts("Unable to extract file:");
-		puts(std::string(srcPath).c_str());
-		return false;
+		v *= 1024;
+		end++;
+	}
+	else if (*end == 'M' || *end == 'm')
+	{
+		v *= 1024 * 1024;
+		end++;
 	}
+	else if (*end == 'G' || *end == 'g')
+	{
+		v *= 1024 * 1024 * 1024;
+		end++;
+	}
+	if (*end != '\0')
+		return std::nullopt;
+	return v;
+}
 
-	std::vector<uint8_t> buffer;
-	buffer.resize(64 * 1024);
+struct ExtractOptions
+{
+	bool printStats{ false };
+	uint32_t numThreads{ std::max<uint32_t>(std::thread::hardware_concurrency(), 1) };
+	std::optional<fs::path> deltaBase; // base archive required to read a delta archive
+};
 
-	std::ofstream fileOut(path, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
-	if (!fileOut.is_open())
+// readers pick up <output>.1, <output>.2, ... as parts of a split archive, so leftover parts of an earlier archive are refused as well
+bool CheckOutputFileIsNew(const fs::path& outputFile)
+{
+	std::error_code ec;
+	if (fs::exists(outputFile, ec))
 	{
-		puts("Unable to write file:");
-		puts(path.generic_string().c_str());
+		puts("The output file already exists");
+		return false;
 	}
-	uint64_t readOffset = 0;
-	while (true)
+	fs::path firstPartPath = outputFile;
+	firstPartPath += ".1";
+	if (fs::exists(firstPartPath, ec))
 	{
-		uint64_t bytesRead = reader->ReadFromFile(fileHandle, readOffset, buffer.size(), buffer.data());
-		if (bytesRead == 0)
+		printf("A split archive part named %s already exists\n", firstPartPath.string().c_str());
+		return false;
+	}
+	return true;
+}
+
+// deletes the output of a failed command including every split part written so far. CheckOutputFileIsNew made sure that none of them existed before
+void RemoveIncompleteOutput(const fs::path& outputFile)
+{
+	std::error_code ec;
+	fs::remove(outputFile, ec);
+	for (uint32_t partIndex = 1;; partIndex++)
+	{
+		fs::path partPath = outputFile;
+		partPath += ".";
+		partPath += std::to_string(partIndex);
+		if (!fs::remove(partPath, ec))
 			break;
-		fileOut.write((const char*)buffer.data(), bytesRead);
-		readOffset += bytesRead;
 	}
-	if (readOffset != reader->GetFileSize(fileHandle))
-		return false;
+}
 
-	return true;
+ZArchiveReader* OpenArchive(const fs::path& path, const std::optional<fs::path>& deltaBase)
+{
+	if (deltaBase)
+		return ZArchiveReader::OpenDelta(*deltaBase, path);
+	return ZArchiveReader::OpenFromFile(path);
 }
 
-bool ExtractRecursive(ZArchiveReader* reader, std::string srcPath, fs::path outputDirectory)
+void PrintHelp()
+{
+	puts("Usage:\n");
+	puts("zarchive.exe [options] input_path [output_path]");
+	puts("If input_path is a directory, then output_path will be the ZArchive output file path");
+	puts("If input_path is a ZArchive file path, then output_path will be the output directory");
+	puts("output_path is optional");
+	puts("");
+	puts("zarchive.exe [options] merge output_path input_path1 [input_path2 ...]");
+	puts("Combines multiple archives into one without recompressing them. Directories are merged, all archives must use the same block size");
+	puts("With --delta-base any of the inputs may be a delta and the output is one");
+	puts("");
+	puts("zarchive.exe [options] subset output_path input_path pattern1 [pattern2 ...]");
+	puts("Creates an archive with only the files matching any of the patterns. A pattern selects a file or directory by path, patterns with * or ? are matched against the full path");
+	puts("Compressed blocks are copied as-is, only blocks shared with unselected files are recompressed");
+	puts("With --delta-base the input may be a delta and the output is one");
+	puts("");
+	puts("zarchive.exe [options] recompress output_path input_path");
+	puts("Compresses an archive again using the given pack options, in parallel and without extracting it. Keeps the block size unless --block-size is set");
+	puts("--dedup, --adapt, --align-min-size, --align-ext and --order are not supported. With --delta-base the input may be a delta and the output is one");
+	puts("");
+	puts("Pack options:");
+	puts("--block-size=N     size of compressed blocks, power of two from 4K to 4M (default 64K). Non-default sizes create a version 2 archive");
+	puts("--sparse           store all-zero blocks without data. Creates a version 2 archive");
+	puts("--dedup            store files with identical content only once");
+	puts("--align-min-size=N start files of at least N bytes at a block boundary");
+	puts("--align-ext=A,B    start files with the given extensions (e.g. .pak,.bin) at a block boundary");
+	puts("--order=FILE       store files in the order they are listed in FILE (one path per line, e.g. an access trace). Unlisted files are stored last");
+	puts("--progress         periodically print throughput statistics");
+	puts("--level=N          zstd compression level (default 6)");
+	puts("--adapt[=MIN:MAX]  adapt the compression level to the speed of the output device (default range 1:19)");
+	puts("--read-ahead=N     maximum amount of input data read ahead of the compressor (default 64M)");
+	puts("--output-buffer=N  write the archive in chunks of N bytes, multiple of 4K (default 4M)");
+	puts("--split=N          split the archive into parts of N bytes named <output>, <output>.1, <output>.2, ... (e.g. 4095M for FAT32)");
+	puts("--async-output[=N] write the archive on a separate thread with N output buffers in flight (default 4)");
+	puts("--direct-io        write the archive with O_DIRECT, bypassing the page cache (Linux only). A --split size must be a multiple of 4K");
+	puts("");
+	puts("Extract options:");
+	puts("--stats            print reader performance counters after extraction");
+	puts("");
+	puts("Common options:");
+	puts("--delta-base=FILE  create a delta archive which only stores blocks not found in FILE, or extract a delta archive created against FILE");
+	puts("--threads=N        number of threads for extracting files, or for scanning and reading input files when packing (default: number of CPU cores)");
+}
+
+struct ExtractJob
+{
+	ZArchiveNodeHandle fileHandle;
+	std::string srcPath;
+	fs::path path;
+	uint64_t dataOffset; // position in the uncompressed data stream
+	uint64_t size;
+};
+
+// walks the tree by node handle, creates the output directories and collects the files to extract
+bool GatherExtractJobs(ZArchiveReader* reader, ZArchiveNodeHandle dirHandle, const std::string& srcPath, const fs::path& outputDirectory, std::vector<ExtractJob>& jobs)
 {
-	ZArchiveNodeHandle dirHandle = reader->LookUp(srcPath, false, true);
-	if (dirHandle == ZARCHIVE_INVALID_NODE)
-		return false;
 	std::error_code ec;
-	fs::create_directories(outputDirectory);
+	fs::create_directories(outputDirectory, ec);
 	uint32_t numEntries = reader->GetDirEntryCount(dirHandle);
 	for (uint32_t i = 0; i < numEntries; i++)
 	{
@@ -70,22 +189,130 @@ bool ExtractRecursive(ZArchiveReader* reader, std::string srcPath, fs::path outp
 			puts("Directory contains invalid node");
 			return false;
 		}
-		puts(std::string(srcPath).append("/").append(dirEntry.name).c_str());
+		std::string entryPath = std::string(srcPath).append("/").append(dirEntry.name);
+		puts(entryPath.c_str());
 		if (dirEntry.isDirectory)
 		{
-			ExtractRecursive(reader, std::string(srcPath).append("/").append(dirEntry.name), outputDirectory / dirEntry.name);
+			if (!GatherExtractJobs(reader, dirEntry.nodeHandle, entryPath, outputDirectory / dirEntry.name, jobs))
+				return false;
 		}
 		else
+			jobs.push_back({ dirEntry.nodeHandle, std::move(entryPath), outputDirectory / dirEntry.name, reader->GetFileDataOffset(dirEntry.nodeHandle), dirEntry.size });
+	}
+	return true;
+}
+
+bool ExtractFile(ZArchiveReader* reader, const ExtractJob& job, std::vector<uint8_t>& buffer)
+{
+	// preallocate the output file at its final size, then fill it in place
+	{
+		std::ofstream fileCreate(job.path, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+		if (!fileCreate.is_open())
 		{
-			// extract file
-			if (!ExtractFile(reader, std::string(srcPath).append("/").append(dirEntry.name), outputDirectory / dirEntry.name))
-				return false;
+			printf("Unable to write file:\n%s\n", job.path.generic_string().c_str());
+			return false;
 		}
 	}
+	std::error_code ec;
+	fs::resize_file(job.path, job.size, ec);
+	if (ec)
+	{
+		printf("Unable to allocate file:\n%s\n", job.path.generic_string().c_str());
+		return false;
+	}
+	std::ofstream fileOut(job.path, std::ios_base::binary | std::ios_base::in | std::ios_base::out);
+	if (!fileOut.is_open())
+	{
+		printf("Unable to write file:\n%s\n", job.path.generic_string().c_str());
+		return false;
+	}
+	const uint64_t rangeSize = reader->GetBlockSize();
+	uint64_t readOffset = 0;
+	while (readOffset < job.size)
+	{
+		uint64_t bytesRead = reader->ReadFromFile(job.fileHandle, readOffset, buffer.size(), buffer.data());
+		if (bytesRead == 0)
+			break;
+		// the file is already at its final size, so zero ranges can be skipped and stay sparse
+		// the buffer spans many blocks, check each block-sized range separately and write the ranges in between in one go
+		uint64_t writeOffset = 0;
+		for (uint64_t rangeOffset = 0; rangeOffset < bytesRead; rangeOffset += rangeSize)
+		{
+			uint64_t size = std::min<uint64_t>(rangeSize, bytesRead - rangeOffset);
+			if (!_ZARCHIVE::IsZeroData(buffer.data() + rangeOffset, size))
+				continue;
+			fileOut.write((const char*)buffer.data() + writeOffset, rangeOffset - writeOffset);
+			fileOut.seekp(size, std::ios_base::cur);
+			writeOffset = rangeOffset + size;
+		}
+		fileOut.write((const char*)buffer.data() + writeOffset, bytesRead - writeOffset);
+		readOffset += bytesRead;
+	}
+	if (readOffset != job.size || !fileOut.good())
+	{
+		printf("Unable to extract file:\n%s\n", job.srcPath.c_str());
+		return false;
+	}
 	return true;
 }
 
-int Extract(fs::path inputFile, fs::path outputDirectory)
+void PrintReaderStats(const ZArchiveReader::Stats& stats)
+{
+	printf("Cache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)stats.cacheHits, (unsigned long long)stats.cacheMisses, (unsigned long long)stats.cacheEvictions);
+	if (stats.sharedCacheHits != 0)
+		printf("Shared cache: %llu hits\n", (unsigned long long)stats.sharedCacheHits);
+	if (stats.compressedCacheHits != 0)
+		printf("Compressed cache: %llu hits\n", (unsigned long long)stats.compressedCacheHits);
+	printf("Read from disk: %llu bytes in %.3fs\n", (unsigned long long)stats.bytesReadFromDisk, (double)stats.ioTime / 1000000000.0);
+	printf("Decompressed: %llu bytes in %.3fs\n", (unsigned long long)stats.bytesDecompressed, (double)stats.decompressTime / 1000000000.0);
+	printf("Lock wait: %.3fs\n", (double)stats.lockWaitTime / 1000000000.0);
+	printf("Memory usage: %llu bytes\n", (unsigned long long)stats.memoryUsage);
+	puts("ReadFromFile latency:");
+	for (size_t i = 0; i < ZArchiveReader::Stats::kHistogramBuckets; i++)
+	{
+		if (stats.readFromFileLatency[i] != 0)
+			printf("  <%lluus: %llu\n", 2ull << i, (unsigned long long)stats.readFromFileLatency[i]);
+	}
+}
+
+struct ExtractBatch
+{
+	size_t firstJob;
+	size_t jobCount;
+};
+
+struct ExtractContext
+{
+	ZArchiveReader* reader;
+	std::vector<ExtractJob> jobs; // sorted by data offset
+	std::vector<ExtractBatch> batches; // never share a block with each other
+	std::atomic<size_t> nextBatch{ 0 };
+	std::atomic<bool> hasError{ false };
+};
+
+// all workers share one reader, blocks are loaded outside of its lock so that the workers still decompress in parallel
+void ExtractWorker(ExtractContext* ctx)
+{
+	ZArchiveReader* reader = ctx->reader;
+	std::vector<uint8_t> buffer(4 * 1024 * 1024);
+	while (!ctx->hasError)
+	{
+		size_t batchIndex = ctx->nextBatch.fetch_add(1);
+		if (batchIndex >= ctx->batches.size())
+			break;
+		const ExtractBatch& batch = ctx->batches[batchIndex];
+		for (size_t i = batch.firstJob; i < batch.firstJob + batch.jobCount; i++)
+		{
+			if (!ExtractFile(reader, ctx->jobs[i], buffer))
+			{
+				ctx->hasError = true;
+				break;
+			}
+		}
+	}
+}
+
+int Extract(fs::path inputFile, fs::path outputDirectory, const ExtractOptions& options)
 {
 	std::error_code ec;
 	if (!fs::exists(inputFile, ec))
@@ -94,20 +321,67 @@ int Extract(fs::path inputFile, fs::path outputDirectory)
 		return -10;
 	}
 
-	ZArchiveReader* reader = ZArchiveReader::OpenFromFile(inputFile);
+	ZArchiveReader* reader = OpenArchive(inputFile, options.deltaBase);
 	if (!reader)
 	{
 		puts("Failed to open ZArchive");
 		return -11;
 	}
-	bool r = ExtractRecursive(reader, "", outputDirectory);
-	if (!r)
+	ExtractContext ctx;
+	ctx.reader = reader;
+	ZArchiveNodeHandle rootHandle = reader->LookUp("", false, true);
+	if (rootHandle == ZARCHIVE_INVALID_NODE || !GatherExtractJobs(reader, rootHandle, "", outputDirectory, ctx.jobs))
 	{
 		puts("Extraction failed");
 		delete reader;
 		return -12;
 	}
+	// extract files in the order of their data so that every block is decompressed only once
+	std::stable_sort(ctx.jobs.begin(), ctx.jobs.end(), [](const ExtractJob& a, const ExtractJob& b) { return a.dataOffset < b.dataOffset; });
+	// split the stream into contiguous batches, several per thread to balance the load
+	// a batch only ends where the next file starts in a new block, otherwise two workers would need the same block at the same time
+	uint32_t numThreads = std::max<uint32_t>(options.numThreads, 1);
+	uint64_t blockSize = reader->GetBlockSize();
+	uint64_t totalSize = 0;
+	for (auto& it : ctx.jobs)
+		totalSize += it.size;
+	uint64_t batchTargetSize = std::max<uint64_t>(totalSize / ((uint64_t)numThreads * 8), blockSize);
+	uint64_t batchSize = 0;
+	uint64_t batchEndBlock = 0; // one past the last block used so far
+	for (size_t i = 0; i < ctx.jobs.size(); i++)
+	{
+		const ExtractJob& job = ctx.jobs[i];
+		if (ctx.batches.empty() || (batchSize >= batchTargetSize && job.dataOffset / blockSize >= batchEndBlock))
+		{
+			ctx.batches.push_back({ i, 0 });
+			batchSize = 0;
+		}
+		ctx.batches.back().jobCount++;
+		batchSize += job.size;
+		if (job.size != 0)
+			batchEndBlock = std::max(batchEndBlock, (job.dataOffset + job.size + blockSize - 1) / blockSize);
+	}
+	numThreads = (uint32_t)std::min<size_t>(numThreads, ctx.batches.size());
+	std::vector<std::thread> workerThreads;
+	for (uint32_t i = 1; i < numThreads; i++)
+		workerThreads.emplace_back(ExtractWorker, &ctx);
+	ExtractWorker(&ctx);
+	for (auto& it : workerThreads)
+		it.join();
+	if (options.printStats)
+	{
+		ZArchiveReader::Stats stats;
+		if (reader->GetStats(stats))
+			PrintReaderStats(stats);
+		else
+			puts("Reader statistics are not available in this build");
+	}
 	delete reader;
+	if (ctx.hasError)
+	{
+		puts("Extraction failed");
+		return -12;
+	}
 	return 0;
 }
 
@@ -116,15 +390,76 @@ struct PackContext
 	fs::path outputFilePath;
 	std::ofstream currentOutputFile;
 	bool hasError{false};
+#ifdef __linux__
+	// direct output bypassing the page cache. The writer hands over 4KiB aligned chunks
+	bool useDirectIO{ false };
+	int fd{ -1 };
+	bool isDirect{ false };
+	uint64_t writeOffset{ 0 };
+#endif
 };
 
+#ifdef __linux__
+bool _pack_WriteDirect(PackContext* packContext, const void* data, size_t length)
+{
+	const size_t alignment = 4096;
+	if (packContext->isDirect && (((uintptr_t)data % alignment) != 0 || (length % alignment) != 0 || (packContext->writeOffset % alignment) != 0))
+	{
+		// O_DIRECT requires aligned memory, sizes and offsets. This is usually only the final chunk, write it and anything after through the page cache
+		int flags = fcntl(packContext->fd, F_GETFL);
+		if (flags == -1 || fcntl(packContext->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+			return false;
+		packContext->isDirect = false;
+	}
+	const uint8_t* input = (const uint8_t*)data;
+	while (length > 0)
+	{
+		ssize_t r = pwrite(packContext->fd, input, length, (off_t)packContext->writeOffset);
+		if (r <= 0)
+			return false;
+		input += r;
+		length -= (size_t)r;
+		packContext->writeOffset += (uint64_t)r;
+	}
+	return true;
+}
+#endif
+
 void _pack_NewOutputFile(const int32_t partIndex, void* ctx)
 {
 	PackContext* packContext = (PackContext*)ctx;
-	packContext->currentOutputFile = std::ofstream(packContext->outputFilePath, std::ios::binary);
+	// parts of a split archive are named <output>.1, <output>.2, ...
+	fs::path outputFilePath = packContext->outputFilePath;
+	if (partIndex > 0)
+		outputFilePath += "." + std::to_string(partIndex);
+#ifdef __linux__
+	if (packContext->useDirectIO)
+	{
+		if (packContext->fd >= 0 && close(packContext->fd) != 0)
+			packContext->hasError = true;
+		packContext->fd = open(outputFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		packContext->isDirect = packContext->fd >= 0;
+		if (packContext->fd < 0 && errno == EINVAL)
+			packContext->fd = open(outputFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); // filesystem does not support O_DIRECT
+		packContext->writeOffset = 0;
+		if (packContext->fd < 0)
+		{
+			printf("Failed to create output file: %s\n", outputFilePath.string().c_str());
+			packContext->hasError = true;
+		}
+		return;
+	}
+#endif
+	if (packContext->currentOutputFile.is_open())
+	{
+		packContext->currentOutputFile.close();
+		if (packContext->currentOutputFile.fail())
+			packContext->hasError = true;
+	}
+	packContext->currentOutputFile = std::ofstream(outputFilePath, std::ios::binary);
 	if (!packContext->currentOutputFile.is_open())
 	{
-		printf("Failed to create output file: %s\n", packContext->outputFilePath.string().c_str());
+		printf("Failed to create output file: %s\n", outputFilePath.string().c_str());
 		packContext->hasError = true;
 	}
 }
@@ -132,62 +467,639 @@ void _pack_NewOutputFile(const int32_t partIndex, void* ctx)
 void _pack_WriteOutputData(const void* data, size_t length, void* ctx)
 {
 	PackContext* packContext = (PackContext*)ctx;
+#ifdef __linux__
+	if (packContext->fd >= 0)
+	{
+		if (!_pack_WriteDirect(packContext, data, length))
+			packContext->hasError = true;
+		return;
+	}
+#endif
 	packContext->currentOutputFile.write((const char*)data, length);
 }
 
-int Pack(fs::path inputDirectory, fs::path outputFile)
+bool ClosePackOutput(PackContext& packContext)
 {
-	std::vector<uint8_t> buffer;
-	buffer.resize(64 * 1024);
+#ifdef __linux__
+	if (packContext.fd >= 0)
+	{
+		bool r = close(packContext.fd) == 0;
+		packContext.fd = -1;
+		return r && !packContext.hasError;
+	}
+#endif
+	packContext.currentOutputFile.close();
+	return !packContext.currentOutputFile.fail() && !packContext.hasError;
+}
 
-	std::error_code ec;
+void _pack_Progress(const ZArchiveWriter::Stats& stats, [[maybe_unused]] void* ctx)
+{
+	auto toSeconds = [](uint64_t ns) { return (double)ns / 1000000000.0; };
+	printf("Progress: %.1f MiB -> %.1f MiB (ratio %.2f, level %d), %.0f blocks/s | input copy %.2fs, compress %.2fs, hash %.2fs, output %.2fs, total %.2fs\n",
+		(double)stats.uncompressedBytes / (1024.0 * 1024.0), (double)stats.compressedBytes / (1024.0 * 1024.0), stats.GetCompressionRatio(), stats.compressionLevel, stats.GetBlocksPerSecond(),
+		toSeconds(stats.inputCopyTime), toSeconds(stats.compressTime), toSeconds(stats.hashTime), toSeconds(stats.outputTime), toSeconds(stats.elapsedTime));
+}
+
+struct PackFileEntry
+{
+	PackFileEntry(const fs::path& path, uint64_t size) : path(path), size(size) {};
+
+	fs::path path; // relative to the input directory
+	uint64_t size;
+};
+
+// builds a key for case-insensitive path comparison that follows the same rules as the archive
+std::string GetPathKey(std::string_view path)
+{
+	std::string key;
+	std::string_view nodeName;
+	while (_ZARCHIVE::GetNextPathNode(path, nodeName))
+	{
+		if (!key.empty())
+			key.push_back('/');
+		for (char c : nodeName)
+			key.push_back((c >= 'A' && c <= 'Z') ? (c - ('A' - 'a')) : c);
+	}
+	return key;
+}
+
+// reorders files to match the first-access order listed in the access order file (one path per line)
+// files which are not listed keep their relative order and are placed at the end
+bool ApplyAccessOrder(std::vector<PackFileEntry>& files, const fs::path& accessOrderFile)
+{
+	std::ifstream orderFile(accessOrderFile);
+	if (!orderFile.is_open())
+	{
+		printf("Failed to open access order file %s\n", accessOrderFile.string().c_str());
+		return false;
+	}
+	std::unordered_map<std::string, size_t> accessRank;
+	std::string line;
+	while (std::getline(orderFile, line))
+	{
+		while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+			line.pop_back();
+		std::string key = GetPathKey(line);
+		if (!key.empty())
+			accessRank.try_emplace(key, accessRank.size());
+	}
+	std::vector<size_t> fileRank;
+	fileRank.reserve(files.size());
+	for (auto& it : files)
+	{
+		auto rankIt = accessRank.find(GetPathKey(it.path.generic_string()));
+		fileRank.emplace_back(rankIt != accessRank.end() ? rankIt->second : accessRank.size());
+	}
+	std::vector<size_t> order(files.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return fileRank[a] < fileRank[b]; });
+	std::vector<PackFileEntry> orderedFiles;
+	orderedFiles.reserve(files.size());
+	for (size_t i : order)
+		orderedFiles.emplace_back(std::move(files[i]));
+	files = std::move(orderedFiles);
+	return true;
+}
+
+bool ShouldAlignFile(const fs::path& path, uint64_t fileSize, const PackOptions& options)
+{
+	if (options.alignMinSize && fileSize >= *options.alignMinSize)
+		return true;
+	std::string extension = path.extension().string();
+	for (auto& it : options.alignExtensions)
+	{
+		if (_ZARCHIVE::CompareNodeNameBool(extension, it))
+			return true;
+	}
+	return false;
+}
+
+struct PackScanContext
+{
+	fs::path outputFile;
+	std::mutex mutex;
+	std::condition_variable dirAvailable;
+	std::vector<std::pair<fs::path, fs::path>> pendingDirs; // absolute path, path relative to the input directory
+	uint32_t activeWorkers{ 0 };
+	bool hasError{ false };
+	// results
+	std::vector<fs::path> dirs;
+	std::vector<PackFileEntry> files;
+};
+
+// lists directories from a shared queue. Querying file sizes involves a stat per file, which is slow on network filesystems, so it is spread across threads
+void PackScanWorker(PackScanContext* ctx)
+{
+	std::unique_lock _l(ctx->mutex);
+	while (true)
+	{
+		ctx->dirAvailable.wait(_l, [ctx]() { return !ctx->pendingDirs.empty() || ctx->activeWorkers == 0; });
+		if (ctx->pendingDirs.empty())
+			break; // no queued directories and no worker which could queue more
+		auto [dirPath, relativeDirPath] = std::move(ctx->pendingDirs.back());
+		ctx->pendingDirs.pop_back();
+		ctx->activeWorkers++;
+		_l.unlock();
+		std::vector<std::pair<fs::path, fs::path>> subDirs;
+		std::vector<PackFileEntry> files;
+		std::error_code ec;
+		bool hasError = false;
+		for (fs::directory_iterator it(dirPath, ec), end; !ec && it != end; it.increment(ec))
+		{
+			const fs::directory_entry& dirEntry = *it;
+			fs::path pathEntry = relativeDirPath / dirEntry.path().filename();
+			if (dirEntry.is_directory(ec))
+			{
+				// like recursive_directory_iterator, symlinks to directories are added but not followed
+				if (dirEntry.is_symlink(ec))
+					subDirs.emplace_back(fs::path(), pathEntry);
+				else
+					subDirs.emplace_back(dirEntry.path(), pathEntry);
+			}
+			else if (dirEntry.is_regular_file(ec))
+			{
+				if (dirEntry.path() == ctx->outputFile)
+					continue;
+				files.emplace_back(pathEntry, dirEntry.file_size(ec));
+			}
+			if (ec)
+				break;
+		}
+		if (ec)
+		{
+			printf("Failed to read directory %s\n", dirPath.string().c_str());
+			hasError = true;
+		}
+		_l.lock();
+		ctx->activeWorkers--;
+		ctx->hasError |= hasError;
+		for (auto& it : subDirs)
+		{
+			ctx->dirs.emplace_back(it.second);
+			if (!it.first.empty() && !ctx->hasError)
+				ctx->pendingDirs.emplace_back(std::move(it));
+		}
+		ctx->files.insert(ctx->files.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+		ctx->dirAvailable.notify_all();
+	}
+}
+
+// gathers the input tree using multiple threads. Paths are sorted so that the output does not depend on the enumeration order
+bool ScanInputDirectory(const fs::path& inputDirectory, const fs::path& outputFile, uint32_t numThreads, std::vector<fs::path>& dirs, std::vector<PackFileEntry>& files)
+{
+	PackScanContext ctx;
+	ctx.outputFile = outputFile;
+	ctx.pendingDirs.emplace_back(inputDirectory, fs::path());
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < numThreads; i++)
+		threads.emplace_back(PackScanWorker, &ctx);
+	PackScanWorker(&ctx);
+	for (auto& it : threads)
+		it.join();
+	if (ctx.hasError)
+		return false;
+	std::sort(ctx.dirs.begin(), ctx.dirs.end(), [](const fs::path& a, const fs::path& b) { return a.generic_string() < b.generic_string(); });
+	std::sort(ctx.files.begin(), ctx.files.end(), [](const PackFileEntry& a, const PackFileEntry& b) { return a.path.generic_string() < b.path.generic_string(); });
+	dirs = std::move(ctx.dirs);
+	files = std::move(ctx.files);
+	return true;
+}
+
+// reads input files ahead of the writer on background threads
+// files are claimed in order and the amount of buffered data is bounded, except that the file the writer is waiting for may always buffer a few chunks
+class PackReadAhead
+{
+public:
+	static constexpr size_t kChunkSize = 4 * 1024 * 1024;
+	static constexpr size_t kMaxChunksOfCurrentFile = 2;
+
+	PackReadAhead(const fs::path& inputDirectory, const std::vector<PackFileEntry>& files, uint32_t numThreads, uint64_t maxBufferedSize)
+		: m_inputDirectory(inputDirectory), m_files(files), m_slots(files.size()), m_maxBufferedSize(maxBufferedSize)
+	{
+		for (uint32_t i = 0; i < numThreads; i++)
+			m_threads.emplace_back(&PackReadAhead::ReadWorker, this);
+	}
+
+	~PackReadAhead()
+	{
+		{
+			std::unique_lock _l(m_mutex);
+			m_abort = true;
+		}
+		m_bufferReleased.notify_all();
+		for (auto& it : m_threads)
+			it.join();
+	}
+
+	// waits for the next chunk of the given file. Returns false once the file is complete or reading failed
+	bool GetNextChunk(size_t fileIndex, std::vector<uint8_t>& chunk, bool& hasError)
+	{
+		std::unique_lock _l(m_mutex);
+		if (m_currentFile != fileIndex)
+		{
+			m_currentFile = fileIndex;
+			m_bufferReleased.notify_all();
+		}
+		Slot& slot = m_slots[fileIndex];
+		m_chunkAvailable.wait(_l, [&slot]() { return !slot.chunks.empty() || slot.isComplete; });
+		hasError = slot.hasError;
+		if (slot.chunks.empty())
+			return false;
+		chunk = std::move(slot.chunks.front());
+		slot.chunks.erase(slot.chunks.begin());
+		m_bufferedSize -= chunk.size();
+		m_bufferReleased.notify_all();
+		return true;
+	}
+
+private:
+	struct Slot
+	{
+		std::vector<std::vector<uint8_t>> chunks;
+		bool isComplete{ false };
+		bool hasError{ false };
+	};
+
+	void ReadWorker()
+	{
+		std::unique_lock _l(m_mutex);
+		while (!m_abort && m_nextFile < m_files.size())
+		{
+			size_t fileIndex = m_nextFile++;
+			Slot& slot = m_slots[fileIndex];
+			_l.unlock();
+			std::ifstream inputFile(m_inputDirectory / m_files[fileIndex].path, std::ios::binary);
+			bool hasError = !inputFile.is_open();
+			// the size is only a hint, read until the end of the file
+			uint64_t remainingSize = m_files[fileIndex].size;
+			while (!hasError)
+			{
+				size_t chunkSize = (size_t)std::clamp<uint64_t>(remainingSize, 64 * 1024, kChunkSize);
+				_l.lock();
+				m_bufferReleased.wait(_l, [&]() { return m_abort || m_bufferedSize + chunkSize <= m_maxBufferedSize || (fileIndex == m_currentFile && slot.chunks.size() < kMaxChunksOfCurrentFile); });
+				if (m_abort)
+					return;
+				m_bufferedSize += chunkSize;
+				_l.unlock();
+				std::vector<uint8_t> chunk(chunkSize);
+				inputFile.read((char*)chunk.data(), chunkSize);
+				size_t readBytes = (size_t)inputFile.gcount();
+				chunk.resize(readBytes);
+				_l.lock();
+				m_bufferedSize -= chunkSize - readBytes;
+				if (readBytes != 0)
+				{
+					slot.chunks.emplace_back(std::move(chunk));
+					m_chunkAvailable.notify_all();
+				}
+				_l.unlock();
+				if (readBytes < chunkSize)
+				{
+					hasError = inputFile.bad();
+					break;
+				}
+				remainingSize -= std::min<uint64_t>(remainingSize, readBytes);
+			}
+			_l.lock();
+			slot.isComplete = true;
+			slot.hasError = hasError;
+			m_chunkAvailable.notify_all();
+		}
+	}
+
+	const fs::path m_inputDirectory;
+	const std::vector<PackFileEntry>& m_files;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_chunkAvailable;
+	std::condition_variable m_bufferReleased;
+	std::vector<Slot> m_slots;
+	size_t m_nextFile{ 0 };
+	size_t m_currentFile{ 0 };
+	uint64_t m_bufferedSize{ 0 };
+	uint64_t m_maxBufferedSize;
+	bool m_abort{ false };
+};
+
+// applies the output and compression options shared by all commands which write an archive
+int ConfigureWriter(ZArchiveWriter& zWriter, const PackOptions& options, uint32_t blockSize)
+{
+	if (!zWriter.SetBlockSize(blockSize))
+	{
+		puts("Invalid block size");
+		return -17;
+	}
+	if (!zWriter.SetOutputBufferSize((size_t)options.outputBufferSize))
+	{
+		puts("Invalid output buffer size, must be a multiple of 4K");
+		return -17;
+	}
+	if (options.asyncOutputBuffers != 0 && !zWriter.EnableAsyncOutput(options.asyncOutputBuffers))
+	{
+		puts("Asynchronous output requires an output buffer and at least 2 buffers");
+		return -17;
+	}
+	if (options.deltaBase)
+	{
+		ZArchiveReader* baseReader = ZArchiveReader::OpenFromFile(*options.deltaBase);
+		if (!baseReader)
+		{
+			printf("Failed to open delta base %s\n", options.deltaBase->string().c_str());
+			return -11;
+		}
+		uint32_t baseBlockSize = baseReader->GetBlockSize();
+		bool r = zWriter.SetDeltaBase(baseReader);
+		delete baseReader;
+		if (!r)
+		{
+			if (baseBlockSize != blockSize)
+				printf("The delta base uses a block size of %uK, use --block-size=%uK\n", baseBlockSize / 1024, baseBlockSize / 1024);
+			else
+				puts("Failed to read the delta base");
+			return -17;
+		}
+	}
+	if (options.directIO && (options.splitSize % 4096) != 0)
+	{
+		// every part after the first would start with an unaligned write and silently fall back to the page cache
+		puts("--direct-io requires a --split size that is a multiple of 4K");
+		return -17;
+	}
+	zWriter.SetSplitSize(options.splitSize);
+	zWriter.SetZeroBlockElision(options.elideZeroBlocks);
+	zWriter.SetDeduplication(options.deduplicate);
+	zWriter.SetCompressionLevel(options.compressionLevel);
+	if (options.adaptiveCompression)
+		zWriter.EnableAdaptiveCompression(options.adaptiveMinLevel, options.adaptiveMaxLevel);
+	if (options.showProgress)
+		zWriter.SetProgressCallback(_pack_Progress, nullptr);
+	return 0;
+}
+
+int Pack(fs::path inputDirectory, fs::path outputFile, const PackOptions& options)
+{
 	PackContext packContext;
 	packContext.outputFilePath = outputFile;
+#ifdef __linux__
+	packContext.useDirectIO = options.directIO;
+#endif
 	ZArchiveWriter zWriter(_pack_NewOutputFile, _pack_WriteOutputData, &packContext);
 	if (packContext.hasError)
 		return -16;
-	for (auto const& dirEntry : fs::recursive_directory_iterator(inputDirectory))
+	if (int r = ConfigureWriter(zWriter, options, options.blockSize.value_or(64 * 1024)); r != 0)
+		return r;
+	// gather the input tree
+	std::vector<fs::path> dirs;
+	std::vector<PackFileEntry> files;
+	if (!ScanInputDirectory(inputDirectory, outputFile, std::max<uint32_t>(options.numThreads, 1), dirs, files))
+		return -13;
+	for (auto& pathEntry : dirs)
 	{
-		fs::path pathEntry = fs::relative(dirEntry.path(), inputDirectory, ec);
-		if (dirEntry.is_directory())
+		if (!zWriter.MakeDir(pathEntry.generic_string().c_str(), false))
 		{
-			if (!zWriter.MakeDir(pathEntry.generic_string().c_str(), false))
-			{
-				printf("Failed to create directory %s\n", pathEntry.string().c_str());
-				return -13;
-			}
+			printf("Failed to create directory %s\n", pathEntry.string().c_str());
+			return -13;
 		}
-		else if (dirEntry.is_regular_file())
+	}
+	if (options.accessOrderFile && !ApplyAccessOrder(files, *options.accessOrderFile))
+		return -18;
+	PackReadAhead readAhead(inputDirectory, files, std::max<uint32_t>(options.numThreads, 1), options.readAheadSize);
+	std::vector<uint8_t> chunk;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		fs::path& pathEntry = files[i].path;
+		printf("Adding %s\n", pathEntry.string().c_str());
+		bool blockAligned = ShouldAlignFile(pathEntry, files[i].size, options);
+		if (!zWriter.StartNewFile(pathEntry.generic_string().c_str(), blockAligned))
 		{
-			if (dirEntry == outputFile) {
-				continue;
-			}
-			printf("Adding %s\n", pathEntry.string().c_str());
-			if (!zWriter.StartNewFile(pathEntry.generic_string().c_str()))
-			{
-				printf("Failed to create archive file %s\n", pathEntry.string().c_str());
-				return -14;
-			}
-			std::ifstream inputFile(inputDirectory / pathEntry, std::ios::binary);
-			if (!inputFile.is_open())
+			printf("Failed to create archive file %s\n", pathEntry.string().c_str());
+			return -14;
+		}
+		bool hasError;
+		while (readAhead.GetNextChunk(i, chunk, hasError))
+			zWriter.AppendData(chunk.data(), chunk.size());
+		if (hasError)
+		{
+			printf("Failed to read input file %s\n", pathEntry.string().c_str());
+			return -15;
+		}
+		if (packContext.hasError)
+			return -16;
+	}
+	zWriter.Finalize();
+	if (!ClosePackOutput(packContext))
+	{
+		puts("Failed to write output file");
+		return -16;
+	}
+	return 0;
+}
+
+int Merge(fs::path outputFile, const std::vector<fs::path>& inputFiles, const PackOptions& options)
+{
+	std::vector<ZArchiveReader*> readers;
+	auto closeReaders = [&readers]()
+	{
+		for (auto& it : readers)
+			delete it;
+	};
+	for (auto& it : inputFiles)
+	{
+		ZArchiveReader* reader = OpenArchive(it, options.deltaBase);
+		if (!reader)
+		{
+			printf("Failed to open ZArchive %s\n", it.string().c_str());
+			closeReaders();
+			return -11;
+		}
+		if (!readers.empty() && reader->GetBlockSize() != readers.front()->GetBlockSize())
+		{
+			printf("%s uses a different block size. Merging requires identical block sizes\n", it.string().c_str());
+			delete reader;
+			closeReaders();
+			return -17;
+		}
+		readers.emplace_back(reader);
+	}
+	PackContext packContext;
+	packContext.outputFilePath = outputFile;
+#ifdef __linux__
+	packContext.useDirectIO = options.directIO;
+#endif
+	int r = 0;
+	{
+		ZArchiveWriter zWriter(_pack_NewOutputFile, _pack_WriteOutputData, &packContext);
+		if (packContext.hasError)
+			r = -16;
+		if (r == 0)
+			r = ConfigureWriter(zWriter, options, readers.front()->GetBlockSize());
+		for (size_t i = 0; i < readers.size() && r == 0; i++)
+		{
+			printf("Adding %s\n", inputFiles[i].string().c_str());
+			if (!zWriter.AppendArchive(readers[i]))
 			{
-				printf("Failed to open input file %s\n", pathEntry.string().c_str());
-				return -15;
+				printf("Failed to merge %s. It contains files which already exist or could not be read\n", inputFiles[i].string().c_str());
+				r = -14;
 			}
-			while( true )
+		}
+		if (r == 0)
+			zWriter.Finalize();
+	}
+	closeReaders();
+	if (r == 0 && !ClosePackOutput(packContext))
+	{
+		puts("Failed to write output file");
+		r = -16;
+	}
+	return r;
+}
+
+// case-insensitive wildcard match, * also matches across directory separators
+bool MatchPathPattern(std::string_view pattern, std::string_view path)
+{
+	size_t p = 0, s = 0;
+	size_t starPattern = std::string_view::npos, starPath = 0;
+	while (s < path.size())
+	{
+		if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == path[s]))
+		{
+			p++;
+			s++;
+		}
+		else if (p < pattern.size() && pattern[p] == '*')
+		{
+			starPattern = p++;
+			starPath = s;
+		}
+		else if (starPattern != std::string_view::npos)
+		{
+			p = starPattern + 1;
+			s = ++starPath;
+		}
+		else
+			return false;
+	}
+	while (p < pattern.size() && pattern[p] == '*')
+		p++;
+	return p == pattern.size();
+}
+
+struct SubsetContext
+{
+	std::vector<std::string> patterns; // in the form returned by GetPathKey
+	size_t matchCount{};
+};
+
+bool _subset_SelectNode(std::string_view path, [[maybe_unused]] bool isDirectory, void* ctx)
+{
+	SubsetContext* subsetContext = (SubsetContext*)ctx;
+	std::string key = GetPathKey(path);
+	for (auto& pattern : subsetContext->patterns)
+	{
+		if (pattern.find_first_of("*?") != std::string::npos)
+		{
+			if (MatchPathPattern(pattern, key))
 			{
-				inputFile.read((char*)buffer.data(), buffer.size());
-				int32_t readBytes = (int32_t)inputFile.gcount();
-				if (readBytes <= 0)
-					break;
-				zWriter.AppendData(buffer.data(), readBytes);
+				subsetContext->matchCount++;
+				return true;
 			}
 		}
+		else if (key == pattern)
+		{
+			subsetContext->matchCount++;
+			return true;
+		}
+	}
+	return false;
+}
+
+int Subset(fs::path outputFile, fs::path inputFile, const std::vector<std::string>& patterns, const PackOptions& options)
+{
+	ZArchiveReader* reader = OpenArchive(inputFile, options.deltaBase);
+	if (!reader)
+	{
+		printf("Failed to open ZArchive %s\n", inputFile.string().c_str());
+		return -11;
+	}
+	SubsetContext subsetContext;
+	for (auto& it : patterns)
+		subsetContext.patterns.emplace_back(GetPathKey(it));
+	PackContext packContext;
+	packContext.outputFilePath = outputFile;
+#ifdef __linux__
+	packContext.useDirectIO = options.directIO;
+#endif
+	int r = 0;
+	{
+		ZArchiveWriter zWriter(_pack_NewOutputFile, _pack_WriteOutputData, &packContext);
 		if (packContext.hasError)
-			return -16;
+			r = -16;
+		if (r == 0)
+			r = ConfigureWriter(zWriter, options, reader->GetBlockSize());
+		if (r == 0 && !zWriter.AppendArchive(reader, "", _subset_SelectNode, &subsetContext))
+		{
+			printf("Failed to read %s\n", inputFile.string().c_str());
+			r = -14;
+		}
+		if (r == 0 && subsetContext.matchCount == 0)
+		{
+			puts("No files or directories match the given patterns");
+			r = -19;
+		}
+		if (r == 0)
+			zWriter.Finalize();
 	}
-	zWriter.Finalize();
-	return 0;
+	delete reader;
+	if (r == 0 && !ClosePackOutput(packContext))
+	{
+		puts("Failed to write output file");
+		r = -16;
+	}
+	return r;
+}
+
+int Recompress(fs::path outputFile, fs::path inputFile, const PackOptions& options)
+{
+	// transcoding keeps the data stream as it is, so options which change the layout or are decided per file do not apply
+	if (options.deduplicate || options.adaptiveCompression || options.alignMinSize || !options.alignExtensions.empty() || options.accessOrderFile)
+	{
+		puts("--dedup, --adapt, --align-min-size, --align-ext and --order cannot be used with recompress");
+		return -1;
+	}
+	ZArchiveReader* reader = OpenArchive(inputFile, options.deltaBase);
+	if (!reader)
+	{
+		printf("Failed to open ZArchive %s\n", inputFile.string().c_str());
+		return -11;
+	}
+	PackContext packContext;
+	packContext.outputFilePath = outputFile;
+#ifdef __linux__
+	packContext.useDirectIO = options.directIO;
+#endif
+	int r = 0;
+	{
+		ZArchiveWriter zWriter(_pack_NewOutputFile, _pack_WriteOutputData, &packContext);
+		if (packContext.hasError)
+			r = -16;
+		if (r == 0)
+			r = ConfigureWriter(zWriter, options, options.blockSize.value_or(reader->GetBlockSize()));
+		if (r == 0 && !zWriter.TranscodeArchive(reader, options.numThreads))
+		{
+			printf("Failed to read %s\n", inputFile.string().c_str());
+			r = -14;
+		}
+		if (r == 0)
+			zWriter.Finalize();
+	}
+	delete reader;
+	if (r == 0 && !ClosePackOutput(packContext))
+	{
+		puts("Failed to write output file");
+		r = -16;
+	}
+	return r;
 }
 
 int main(int argc, char* argv[])
@@ -199,8 +1111,212 @@ int main(int argc, char* argv[])
 	}
 	std::optional<std::string> strInput;
 	std::optional<std::string> strOutput;
+	bool isMerge = false;
+	std::vector<fs::path> mergeInputs;
+	bool isSubset = false;
+	std::vector<std::string> subsetPatterns;
+	bool isRecompress = false;
+	PackOptions packOptions;
+	ExtractOptions extractOptions;
 	for (int i = 1; i < argc; i++)
 	{
+		std::string_view arg = argv[i];
+		if (arg.starts_with("--"))
+		{
+			if (arg.starts_with("--block-size="))
+			{
+				std::optional<uint64_t> blockSize = ParseSize(argv[i] + 13);
+				if (!blockSize || *blockSize > 0xFFFFFFFF)
+				{
+					puts("Invalid block size");
+					return -1;
+				}
+				packOptions.blockSize = (uint32_t)*blockSize;
+			}
+			else if (arg.starts_with("--level="))
+			{
+				packOptions.compressionLevel = atoi(argv[i] + 8);
+			}
+			else if (arg == "--sparse")
+			{
+				packOptions.elideZeroBlocks = true;
+			}
+			else if (arg == "--dedup")
+			{
+				packOptions.deduplicate = true;
+			}
+			else if (arg.starts_with("--align-min-size="))
+			{
+				packOptions.alignMinSize = ParseSize(argv[i] + 17);
+				if (!packOptions.alignMinSize)
+				{
+					puts("Invalid size for --align-min-size");
+					return -1;
+				}
+			}
+			else if (arg.starts_with("--align-ext="))
+			{
+				std::string_view extList = arg.substr(12);
+				while (!extList.empty())
+				{
+					size_t sep = extList.find(',');
+					std::string_view ext = extList.substr(0, sep);
+					if (!ext.empty())
+						packOptions.alignExtensions.emplace_back(ext.front() == '.' ? std::string(ext) : std::string(".").append(ext));
+					if (sep == std::string_view::npos)
+						break;
+					extList.remove_prefix(sep + 1);
+				}
+			}
+			else if (arg.starts_with("--order="))
+			{
+				packOptions.accessOrderFile = fs::path(arg.substr(8));
+			}
+			else if (arg == "--progress")
+			{
+				packOptions.showProgress = true;
+			}
+			else if (arg == "--stats")
+			{
+				extractOptions.printStats = true;
+			}
+			else if (arg.starts_with("--threads="))
+			{
+				int numThreads = atoi(argv[i] + 10);
+				if (numThreads <= 0)
+				{
+					puts("Invalid thread count");
+					return -1;
+				}
+				extractOptions.numThreads = (uint32_t)numThreads;
+				packOptions.numThreads = (uint32_t)numThreads;
+			}
+			else if (arg.starts_with("--read-ahead="))
+			{
+				std::optional<uint64_t> readAheadSize = ParseSize(argv[i] + 13);
+				if (!readAheadSize)
+				{
+					puts("Invalid size for --read-ahead");
+					return -1;
+				}
+				packOptions.readAheadSize = *readAheadSize;
+			}
+			else if (arg.starts_with("--output-buffer="))
+			{
+				std::optional<uint64_t> outputBufferSize = ParseSize(argv[i] + 16);
+				if (!outputBufferSize)
+				{
+					puts("Invalid size for --output-buffer");
+					return -1;
+				}
+				packOptions.outputBufferSize = *outputBufferSize;
+			}
+			else if (arg.starts_with("--split="))
+			{
+				std::optional<uint64_t> splitSize = ParseSize(argv[i] + 8);
+				if (!splitSize || *splitSize == 0)
+				{
+					puts("Invalid size for --split");
+					return -1;
+				}
+				packOptions.splitSize = *splitSize;
+			}
+			else if (arg == "--async-output")
+			{
+				packOptions.asyncOutputBuffers = 4;
+			}
+			else if (arg.starts_with("--async-output="))
+			{
+				packOptions.asyncOutputBuffers = (uint32_t)atoi(argv[i] + 15);
+				if (packOptions.asyncOutputBuffers < 2)
+				{
+					puts("Invalid buffer count for --async-output, at least 2 are required");
+					return -1;
+				}
+			}
+			else if (arg == "--direct-io")
+			{
+#ifdef __linux__
+				packOptions.directIO = true;
+#else
+				puts("--direct-io is not supported on this platform");
+				return -1;
+#endif
+			}
+			else if (arg.starts_with("--delta-base="))
+			{
+				packOptions.deltaBase = argv[i] + 13;
+				extractOptions.deltaBase = argv[i] + 13;
+			}
+			else if (arg == "--adapt")
+			{
+				packOptions.adaptiveCompression = true;
+			}
+			else if (arg.starts_with("--adapt="))
+			{
+				packOptions.adaptiveCompression = true;
+				if (sscanf(argv[i] + 8, "%d:%d", &packOptions.adaptiveMinLevel, &packOptions.adaptiveMaxLevel) != 2)
+				{
+					puts("Invalid compression level range, expected --adapt=MIN:MAX");
+					return -1;
+				}
+			}
+			else
+			{
+				printf("Unknown option: %s\n", argv[i]);
+				return -1;
+			}
+			continue;
+		}
+		if (isMerge)
+		{
+			// merge output_path input_path1 input_path2 ...
+			if (!strOutput)
+				strOutput = argv[i];
+			else
+				mergeInputs.emplace_back(argv[i]);
+			continue;
+		}
+		if (isSubset)
+		{
+			// subset output_path input_path pattern1 pattern2 ...
+			if (!strOutput)
+				strOutput = argv[i];
+			else if (!strInput)
+				strInput = argv[i];
+			else
+				subsetPatterns.emplace_back(argv[i]);
+			continue;
+		}
+		if (!strInput && arg == "merge")
+		{
+			isMerge = true;
+			continue;
+		}
+		if (!strInput && arg == "subset")
+		{
+			isSubset = true;
+			continue;
+		}
+		if (isRecompress)
+		{
+			// recompress output_path input_path
+			if (!strOutput)
+				strOutput = argv[i];
+			else if (!strInput)
+				strInput = argv[i];
+			else
+			{
+				puts("Too many paths specified");
+				return -1;
+			}
+			continue;
+		}
+		if (!strInput && arg == "recompress")
+		{
+			isRecompress = true;
+			continue;
+		}
 		if (strInput)
 		{
 			if (strOutput)
@@ -219,6 +1335,51 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (isMerge)
+	{
+		if (!strOutput || mergeInputs.empty())
+		{
+			puts("Usage: zarchive.exe merge output_path input_path1 [input_path2 ...]");
+			return -1;
+		}
+		fs::path outputFile(*strOutput);
+		if (!CheckOutputFileIsNew(outputFile))
+			return -11;
+		int r = Merge(outputFile, mergeInputs, packOptions);
+		if (r != 0)
+			RemoveIncompleteOutput(outputFile);
+		return r;
+	}
+	if (isSubset)
+	{
+		if (!strOutput || !strInput || subsetPatterns.empty())
+		{
+			puts("Usage: zarchive.exe subset output_path input_path pattern1 [pattern2 ...]");
+			return -1;
+		}
+		fs::path outputFile(*strOutput);
+		if (!CheckOutputFileIsNew(outputFile))
+			return -11;
+		int r = Subset(outputFile, *strInput, subsetPatterns, packOptions);
+		if (r != 0)
+			RemoveIncompleteOutput(outputFile);
+		return r;
+	}
+	if (isRecompress)
+	{
+		if (!strOutput || !strInput)
+		{
+			puts("Usage: zarchive.exe recompress output_path input_path");
+			return -1;
+		}
+		fs::path outputFile(*strOutput);
+		if (!CheckOutputFileIsNew(outputFile))
+			return -11;
+		int r = Recompress(outputFile, *strInput, packOptions);
+		if (r != 0)
+			RemoveIncompleteOutput(outputFile);
+		return r;
+	}
 	if (strInput)
 	{
 		std::error_code ec;
@@ -246,7 +1407,7 @@ int main(int argc, char* argv[])
 				puts("Failed to create output directory");
 				return -4;
 			}
-			return Extract(p, outputDirectory);
+			return Extract(p, outputDirectory, extractOptions);
 		}
 		else if(fs::is_directory(p, ec))
 		{
@@ -265,17 +1426,11 @@ int main(int argc, char* argv[])
 				puts("The specified output path is not a valid file");
 				return -10;
 			}
-			if ((fs::exists(outputFile, ec) && fs::is_regular_file(outputFile, ec)))
-			{
-				puts("The output file already exists");
+			if (!CheckOutputFileIsNew(outputFile))
 				return -11;
-			}
-			int r = Pack(p, outputFile);
+			int r = Pack(p, outputFile, packOptions);
 			if (r != 0)
-			{
-				// delete incomplete output file
-				fs::remove(outputFile, ec);
-			}
+				RemoveIncompleteOutput(outputFile);
 			return r;
 		}
 		else
@@ -0,0 +1,218 @@
+#include "zarchive/zarchiveoverlay.h"
+#include "zarchive/zarchivecommon.h"
+#include "zarchive/zarchivesharedcache.h"
+
+#include <algorithm>
+
+ZArchiveOverlay* ZArchiveOverlay::OpenFromFiles(const std::vector<std::filesystem::path>& layerPaths, uint64_t cacheSize)
+{
+	if (layerPaths.empty())
+		return nullptr;
+	// the layers keep only a single block privately, everything else goes through one cache sized for the largest block size
+	std::vector<std::unique_ptr<ZArchiveReader>> layers;
+	uint32_t maxBlockSize = 0;
+	for (auto& it : layerPaths)
+	{
+		ZArchiveReader* reader = ZArchiveReader::OpenFromFile(it, 0);
+		if (!reader)
+			return nullptr;
+		layers.emplace_back(reader);
+		maxBlockSize = std::max(maxBlockSize, reader->GetBlockSize());
+	}
+	std::unique_ptr<ZArchiveSharedCache> cache(ZArchiveSharedCache::CreatePrivate(cacheSize, maxBlockSize));
+	if (!cache)
+		return nullptr;
+	for (auto& it : layers)
+		it->SetSharedCache(cache.get());
+	ZArchiveOverlay* overlay = new ZArchiveOverlay(std::move(cache), std::move(layers));
+	if (!overlay->BuildTree())
+	{
+		delete overlay;
+		return nullptr;
+	}
+	return overlay;
+}
+
+ZArchiveOverlay::ZArchiveOverlay(std::unique_ptr<ZArchiveSharedCache>&& cache, std::vector<std::unique_ptr<ZArchiveReader>>&& layers) : m_cache(std::move(cache)), m_layers(std::move(layers))
+{
+}
+
+ZArchiveOverlay::~ZArchiveOverlay()
+{
+}
+
+void ZArchiveOverlay::AppendPathKey(std::string& pathKey, std::string_view name)
+{
+	if (!pathKey.empty())
+		pathKey.push_back('/');
+	for (char c : name)
+		pathKey.push_back((c >= 'A' && c <= 'Z') ? (c - ('A' - 'a')) : c);
+}
+
+bool ZArchiveOverlay::BuildTree()
+{
+	std::vector<LayerNode> rootSources;
+	for (uint32_t i = 0; i < (uint32_t)m_layers.size(); i++)
+	{
+		ZArchiveNodeHandle rootHandle = m_layers[i]->LookUp("", false, true);
+		if (rootHandle == ZARCHIVE_INVALID_NODE)
+			return false;
+		rootSources.push_back({ i, rootHandle });
+	}
+	OverlayNode& root = m_nodes.emplace_back();
+	root.layerIndex = rootSources.back().layerIndex;
+	root.layerNodeHandle = rootSources.back().layerNodeHandle;
+	root.isFile = false;
+	root.fileSize = 0;
+	root.firstSubnode = 0;
+	root.subnodeCount = 0;
+	m_pathLookup.emplace("", 0);
+	std::string pathKey;
+	return MergeDirectory(0, rootSources, pathKey);
+}
+
+// combines the entries of the directory in all source layers. sources are ordered from the lowest to the highest layer
+bool ZArchiveOverlay::MergeDirectory(uint32_t nodeIndex, const std::vector<LayerNode>& sources, std::string& pathKey)
+{
+	struct MergedEntry
+	{
+		std::string_view name;
+		bool isFile;
+		uint64_t fileSize;
+		std::vector<LayerNode> sources; // the file or all directories with this name, lowest layer first
+	};
+	std::vector<MergedEntry> entries;
+	std::unordered_map<std::string_view, size_t, _ZARCHIVE::NodeNameHash, _ZARCHIVE::NodeNameEqual> entryLookup;
+	for (auto& source : sources)
+	{
+		ZArchiveReader* reader = m_layers[source.layerIndex].get();
+		uint32_t numEntries = reader->GetDirEntryCount(source.layerNodeHandle);
+		for (uint32_t i = 0; i < numEntries; i++)
+		{
+			DirEntry dirEntry;
+			if (!reader->GetDirEntry(source.layerNodeHandle, i, dirEntry))
+				return false;
+			LayerNode layerNode{ source.layerIndex, dirEntry.nodeHandle };
+			auto it = entryLookup.find(dirEntry.name);
+			if (it == entryLookup.end())
+			{
+				entryLookup.emplace(dirEntry.name, entries.size());
+				entries.push_back({ dirEntry.name, dirEntry.isFile, dirEntry.size, { layerNode } });
+				continue;
+			}
+			// the higher layer wins, unless both are directories in which case they are merged
+			MergedEntry& entry = entries[it->second];
+			if (!entry.isFile && !dirEntry.isFile)
+				entry.sources.emplace_back(layerNode);
+			else
+			{
+				entry.isFile = dirEntry.isFile;
+				entry.fileSize = dirEntry.size;
+				entry.sources.assign(1, layerNode);
+			}
+			entry.name = dirEntry.name;
+		}
+	}
+	std::sort(entries.begin(), entries.end(), [](const MergedEntry& a, const MergedEntry& b) { return _ZARCHIVE::CompareNodeName(a.name, b.name) > 0; });
+	uint32_t firstSubnode = (uint32_t)m_nodes.size();
+	m_nodes[nodeIndex].firstSubnode = firstSubnode;
+	m_nodes[nodeIndex].subnodeCount = (uint32_t)entries.size();
+	for (auto& it : entries)
+	{
+		OverlayNode& node = m_nodes.emplace_back();
+		node.name = it.name;
+		node.layerIndex = it.sources.back().layerIndex;
+		node.layerNodeHandle = it.sources.back().layerNodeHandle;
+		node.isFile = it.isFile;
+		node.fileSize = it.isFile ? it.fileSize : 0;
+		node.firstSubnode = 0;
+		node.subnodeCount = 0;
+	}
+	for (uint32_t i = 0; i < (uint32_t)entries.size(); i++)
+	{
+		size_t parentKeyLength = pathKey.size();
+		AppendPathKey(pathKey, entries[i].name);
+		m_pathLookup.emplace(pathKey, firstSubnode + i);
+		if (!entries[i].isFile && !MergeDirectory(firstSubnode + i, entries[i].sources, pathKey))
+			return false;
+		pathKey.resize(parentKeyLength);
+	}
+	return true;
+}
+
+ZArchiveNodeHandle ZArchiveOverlay::LookUp(std::string_view path, bool allowFile, bool allowDirectory) const
+{
+	std::string pathKey;
+	std::string_view pathParser = path;
+	std::string_view pathNodeName;
+	while (_ZARCHIVE::GetNextPathNode(pathParser, pathNodeName))
+		AppendPathKey(pathKey, pathNodeName);
+	auto it = m_pathLookup.find(pathKey);
+	if (it == m_pathLookup.end())
+		return ZARCHIVE_INVALID_NODE;
+	const OverlayNode& node = m_nodes[it->second];
+	if ((node.isFile && !allowFile) || (!node.isFile && !allowDirectory))
+		return ZARCHIVE_INVALID_NODE;
+	return (ZArchiveNodeHandle)it->second;
+}
+
+bool ZArchiveOverlay::IsDirectory(ZArchiveNodeHandle nodeHandle) const
+{
+	if (nodeHandle >= m_nodes.size())
+		return false;
+	return !m_nodes[nodeHandle].isFile;
+}
+
+bool ZArchiveOverlay::IsFile(ZArchiveNodeHandle nodeHandle) const
+{
+	if (nodeHandle >= m_nodes.size())
+		return false;
+	return m_nodes[nodeHandle].isFile;
+}
+
+uint32_t ZArchiveOverlay::GetDirEntryCount(ZArchiveNodeHandle nodeHandle) const
+{
+	if (nodeHandle >= m_nodes.size() || m_nodes[nodeHandle].isFile)
+		return 0;
+	return m_nodes[nodeHandle].subnodeCount;
+}
+
+bool ZArchiveOverlay::GetDirEntry(ZArchiveNodeHandle nodeHandle, uint32_t index, DirEntry& dirEntry) const
+{
+	if (nodeHandle >= m_nodes.size())
+		return false;
+	auto& dir = m_nodes[nodeHandle];
+	if (dir.isFile || index >= dir.subnodeCount)
+		return false;
+	auto& it = m_nodes[dir.firstSubnode + index];
+	dirEntry.name = it.name;
+	dirEntry.nodeHandle = (ZArchiveNodeHandle)(dir.firstSubnode + index);
+	dirEntry.isFile = it.isFile;
+	dirEntry.isDirectory = !it.isFile;
+	dirEntry.size = it.fileSize;
+	return true;
+}
+
+uint64_t ZArchiveOverlay::GetFileSize(ZArchiveNodeHandle nodeHandle) const
+{
+	if (nodeHandle >= m_nodes.size() || !m_nodes[nodeHandle].isFile)
+		return 0;
+	return m_nodes[nodeHandle].fileSize;
+}
+
+uint64_t ZArchiveOverlay::ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint64_t length, void* buffer)
+{
+	if (nodeHandle >= m_nodes.size() || !m_nodes[nodeHandle].isFile)
+		return 0;
+	auto& node = m_nodes[nodeHandle];
+	return m_layers[node.layerIndex]->ReadFromFile(node.layerNodeHandle, offset, length, buffer);
+}
+
+bool ZArchiveOverlay::GetNodeSource(ZArchiveNodeHandle nodeHandle, uint32_t& layerIndex, ZArchiveNodeHandle& layerNodeHandle) const
+{
+	if (nodeHandle >= m_nodes.size())
+		return false;
+	layerIndex = m_nodes[nodeHandle].layerIndex;
+	layerNodeHandle = m_nodes[nodeHandle].layerNodeHandle;
+	return true;
+}
@@ -1,10 +1,59 @@
 #include "zarchive/zarchivereader.h"
 #include "zarchive/zarchivecommon.h"
+#include "zarchive/zarchivesharedcache.h"
 
 #include <fstream>
 
 #include <zstd.h>
 #include <cassert>
+#include <algorithm>
+
+#ifdef ZARCHIVE_ENABLE_STATS
+static uint64_t _getTimestampNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t _getHistogramBucket(uint64_t durationNs)
+{
+	uint64_t durationUs = durationNs / 1000;
+	size_t bucket = 0;
+	while (durationUs > 1 && bucket < (ZArchiveReader::Stats::kHistogramBuckets - 1))
+	{
+		durationUs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// threads are spread over the counter shards round robin in the order they first record something
+static size_t _getStatsShard()
+{
+	static std::atomic<size_t> s_nextShard{ 0 };
+	thread_local size_t shard = s_nextShard.fetch_add(1, std::memory_order_relaxed);
+	return shard;
+}
+
+struct _StatsLatencyScope
+{
+	_StatsLatencyScope(std::atomic<uint64_t>* histogram) : histogram(histogram), startTime(_getTimestampNs()) {};
+	~_StatsLatencyScope()
+	{
+		histogram[_getHistogramBucket(_getTimestampNs() - startTime)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t>* histogram;
+	uint64_t startTime;
+};
+
+#define STATS_TIMESTAMP() _getTimestampNs()
+#define STATS_ADD(counter, value) m_stats[_getStatsShard() % kStatsShards].counter.fetch_add((value), std::memory_order_relaxed)
+#define STATS_LATENCY_SCOPE(histogram) _StatsLatencyScope _latencyScope(m_stats[_getStatsShard() % kStatsShards].histogram)
+#else
+#define STATS_TIMESTAMP() 0
+#define STATS_ADD(counter, value)
+#define STATS_LATENCY_SCOPE(histogram)
+#endif
 
 static uint64_t _ifstream_getFileSize(std::ifstream& file)
 {
@@ -26,24 +75,114 @@ static uint64_t _getValidElementCount(uint64_t size, uint64_t elementSize)
 	return size / elementSize;
 }
 
-ZArchiveReader* ZArchiveReader::OpenFromFile(const std::filesystem::path& path)
+template<typename TRecord>
+static bool _getCompressedBlockRange(const std::vector<TRecord>& offsetRecords, uint64_t blockIndex, uint64_t& offset, uint32_t& compressedSize)
 {
-	std::ifstream file;
-	file.open(path, std::ios_base::in | std::ios_base::binary);
-	if (!file.is_open())
+	uint64_t recordIndex = blockIndex / _ZARCHIVE::ENTRIES_PER_OFFSETRECORD;
+	uint32_t recordSubIndex = (uint32_t)(blockIndex % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD);
+	if (recordIndex >= offsetRecords.size())
+		return false;
+	auto& record = offsetRecords[recordIndex];
+	offset = record.baseOffset;
+	for (uint32_t i = 0; i < recordSubIndex; i++)
+		offset += (uint64_t)record.GetCompressedSize(i);
+	compressedSize = record.GetCompressedSize(recordSubIndex);
+	return true;
+}
+
+// the parts of a split archive named <path>.1, <path>.2, ... The first part is path itself
+// returns the parts of the split archive starting at path. The last part is the first one which ends with a footer whose total size matches the size of all parts up to it
+// this way leftover parts of an earlier archive with the same name are ignored
+std::vector<std::filesystem::path> ZArchiveReader::GetSplitPartPaths(const std::filesystem::path& path)
+{
+	std::vector<std::filesystem::path> partPaths;
+	partPaths.emplace_back(path);
+	uint64_t totalSize = 0;
+	std::error_code ec;
+	while (true)
+	{
+		std::ifstream file(partPaths.back(), std::ios_base::in | std::ios_base::binary);
+		if (!file.is_open())
+			break;
+		uint64_t partSize = _ifstream_getFileSize(file);
+		totalSize += partSize;
+		_ZARCHIVE::Footer footer;
+		if (partSize >= sizeof(_ZARCHIVE::Footer) && _ifstream_readBytes(file, partSize - sizeof(_ZARCHIVE::Footer), &footer, sizeof(_ZARCHIVE::Footer)))
+		{
+			_ZARCHIVE::Footer::Deserialize(&footer, &footer);
+			if (footer.magic == _ZARCHIVE::Footer::kMagic && footer.totalSize == totalSize)
+				return partPaths;
+		}
+		std::filesystem::path partPath = path;
+		partPath += ".";
+		partPath += std::to_string(partPaths.size());
+		if (!std::filesystem::exists(partPath, ec))
+			break;
+		partPaths.emplace_back(std::move(partPath));
+	}
+	return { path }; // incomplete
+}
+
+ZArchiveReader* ZArchiveReader::OpenFromFile(const std::filesystem::path& path, uint64_t cacheSize)
+{
+	ZArchiveReader* reader = OpenFromFiles({ path }, cacheSize);
+	if (reader)
+		return reader;
+	// not a complete archive by itself, try it as the first part of a split archive
+	std::vector<std::filesystem::path> partPaths = GetSplitPartPaths(path);
+	if (partPaths.size() == 1)
+		return nullptr;
+	return OpenFromFiles(partPaths, cacheSize);
+}
+
+ZArchiveReader* ZArchiveReader::OpenFromFiles(const std::vector<std::filesystem::path>& partPaths, uint64_t cacheSize)
+{
+	std::unique_ptr<ZArchiveReader> baseReader;
+	return OpenFromFilesWithBase(partPaths, cacheSize, baseReader);
+}
+
+ZArchiveReader* ZArchiveReader::OpenDelta(const std::filesystem::path& basePath, const std::filesystem::path& deltaPath, uint64_t cacheSize)
+{
+	// the delta reader caches the decompressed blocks of both archives, the base only needs its minimal cache
+	std::unique_ptr<ZArchiveReader> baseReader(OpenFromFile(basePath, 0));
+	if (!baseReader)
 		return nullptr;
-	uint64_t fileSize = _ifstream_getFileSize(file);
+	ZArchiveReader* reader = OpenFromFilesWithBase({ deltaPath }, cacheSize, baseReader);
+	if (reader)
+		return reader;
+	std::vector<std::filesystem::path> partPaths = GetSplitPartPaths(deltaPath);
+	if (partPaths.size() == 1)
+		return nullptr;
+	return OpenFromFilesWithBase(partPaths, cacheSize, baseReader);
+}
+
+// baseReader is only required for delta archives. It is taken over by the returned reader if the archive refers to it
+ZArchiveReader* ZArchiveReader::OpenFromFilesWithBase(const std::vector<std::filesystem::path>& partPaths, uint64_t cacheSize, std::unique_ptr<ZArchiveReader>& baseReader)
+{
+	std::vector<std::unique_ptr<ArchivePart>> parts;
+	uint64_t fileSize = 0;
+	for (auto& it : partPaths)
+	{
+		ArchivePart* part = parts.emplace_back(new ArchivePart()).get();
+		part->path = it;
+		part->file.open(it, std::ios_base::in | std::ios_base::binary);
+		if (!part->file.is_open())
+			return nullptr;
+		part->offset = fileSize;
+		part->size = _ifstream_getFileSize(part->file);
+		fileSize += part->size;
+	}
 	if (fileSize <= sizeof(_ZARCHIVE::Footer))
 		return nullptr;
 	// read footer
 	_ZARCHIVE::Footer footer;
-	if (!_ifstream_readBytes(file, fileSize - sizeof(_ZARCHIVE::Footer), &footer, sizeof(_ZARCHIVE::Footer)))
+	if (!ReadArchiveData(parts, nullptr, fileSize - sizeof(_ZARCHIVE::Footer), &footer, sizeof(_ZARCHIVE::Footer)))
 		return nullptr;
 	_ZARCHIVE::Footer::Deserialize(&footer, &footer);
 	// validate footer
 	if (footer.magic != _ZARCHIVE::Footer::kMagic)
 		return nullptr;
-	if (footer.version != _ZARCHIVE::Footer::kVersion1)
+	if (footer.version != _ZARCHIVE::Footer::kVersion1 && footer.version != _ZARCHIVE::Footer::kVersion2)
 		return nullptr;
 	if (footer.totalSize != fileSize)
 		return nullptr;
@@ -61,20 +200,56 @@ ZArchiveReader* ZArchiveReader::OpenFromFile(const std::filesystem::path& path)
 	if (footer.sectionFileTree.size > (uint64_t)0xFFFFFFFF)
 		return nullptr;
 	// read offset records
+	uint32_t blockSize = _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
 	std::vector<_ZARCHIVE::CompressionOffsetRecord> offsetRecords;
-	offsetRecords.resize(_getValidElementCount(footer.sectionOffsetRecords.size, sizeof(_ZARCHIVE::CompressionOffsetRecord)));
-	if (offsetRecords.empty() || !_ifstream_readBytes(file, footer.sectionOffsetRecords.offset, offsetRecords.data(), (uint32_t)(offsetRecords.size() * sizeof(_ZARCHIVE::CompressionOffsetRecord))))
-		return nullptr;
-	_ZARCHIVE::CompressionOffsetRecord::Deserialize(offsetRecords.data(), offsetRecords.size(), offsetRecords.data());
+	std::vector<_ZARCHIVE::CompressionOffsetRecordV2> offsetRecordsV2;
+	uint64_t blockCountV2 = 0;
+	bool isDelta = false;
+	if (footer.version == _ZARCHIVE::Footer::kVersion1)
+	{
+		offsetRecords.resize(_getValidElementCount(footer.sectionOffsetRecords.size, sizeof(_ZARCHIVE::CompressionOffsetRecord)));
+		if (offsetRecords.empty() || !ReadArchiveData(parts, nullptr, footer.sectionOffsetRecords.offset, offsetRecords.data(), (uint32_t)(offsetRecords.size() * sizeof(_ZARCHIVE::CompressionOffsetRecord))))
+			return nullptr;
+		_ZARCHIVE::CompressionOffsetRecord::Deserialize(offsetRecords.data(), offsetRecords.size(), offsetRecords.data());
+	}
+	else
+	{
+		_ZARCHIVE::OffsetRecordsHeaderV2 header;
+		if (footer.sectionOffsetRecords.size < sizeof(_ZARCHIVE::OffsetRecordsHeaderV2) || !ReadArchiveData(parts, nullptr, footer.sectionOffsetRecords.offset, &header, sizeof(_ZARCHIVE::OffsetRecordsHeaderV2)))
+			return nullptr;
+		_ZARCHIVE::OffsetRecordsHeaderV2::Deserialize(&header, &header);
+		if (!_ZARCHIVE::IsValidBlockSize(header.blockSize) || (header.flags & ~_ZARCHIVE::OffsetRecordsHeaderV2::FLAG_DELTA) != 0)
+			return nullptr;
+		blockSize = header.blockSize;
+		uint64_t recordsOffset = sizeof(_ZARCHIVE::OffsetRecordsHeaderV2);
+		if ((header.flags & _ZARCHIVE::OffsetRecordsHeaderV2::FLAG_DELTA) != 0)
+		{
+			// delta archive, can only be read together with its base
+			_ZARCHIVE::DeltaHeaderV2 deltaHeader;
+			if (footer.sectionOffsetRecords.size < recordsOffset + sizeof(_ZARCHIVE::DeltaHeaderV2) || !ReadArchiveData(parts, nullptr, footer.sectionOffsetRecords.offset + recordsOffset, &deltaHeader, sizeof(_ZARCHIVE::DeltaHeaderV2)))
+				return nullptr;
+			if (!baseReader || baseReader->GetBlockSize() != blockSize || memcmp(deltaHeader.baseIntegrityHash, baseReader->GetIntegrityHash(), 32) != 0)
+				return nullptr;
+			recordsOffset += sizeof(_ZARCHIVE::DeltaHeaderV2);
+			isDelta = true;
+		}
+		offsetRecordsV2.resize(_getValidElementCount(footer.sectionOffsetRecords.size - recordsOffset, sizeof(_ZARCHIVE::CompressionOffsetRecordV2)));
+		if (offsetRecordsV2.empty() || !ReadArchiveData(parts, nullptr, footer.sectionOffsetRecords.offset + recordsOffset, offsetRecordsV2.data(), (uint32_t)(offsetRecordsV2.size() * sizeof(_ZARCHIVE::CompressionOffsetRecordV2))))
+			return nullptr;
+		_ZARCHIVE::CompressionOffsetRecordV2::Deserialize(offsetRecordsV2.data(), offsetRecordsV2.size(), offsetRecordsV2.data());
+		blockCountV2 = header.blockCount;
+		if (blockCountV2 > (uint64_t)offsetRecordsV2.size() * _ZARCHIVE::ENTRIES_PER_OFFSETRECORD)
+			return nullptr;
+	}
 	// read name table
 	std::vector<uint8_t> nameTable;
 	nameTable.resize(footer.sectionNames.size);
-	if (!_ifstream_readBytes(file, footer.sectionNames.offset, nameTable.data(), (uint32_t)(nameTable.size() * sizeof(uint8_t))))
+	if (!ReadArchiveData(parts, nullptr, footer.sectionNames.offset, nameTable.data(), (uint32_t)(nameTable.size() * sizeof(uint8_t))))
 		return nullptr;
 	// read file tree
 	std::vector<_ZARCHIVE::FileDirectoryEntry> fileTree;
 	fileTree.resize(_getValidElementCount(footer.sectionFileTree.size, sizeof(_ZARCHIVE::FileDirectoryEntry)));
-	if (fileTree.empty() || !_ifstream_readBytes(file, footer.sectionFileTree.offset, fileTree.data(), (uint32_t)(fileTree.size() * sizeof(_ZARCHIVE::FileDirectoryEntry))))
+	if (fileTree.empty() || !ReadArchiveData(parts, nullptr, footer.sectionFileTree.offset, fileTree.data(), (uint32_t)(fileTree.size() * sizeof(_ZARCHIVE::FileDirectoryEntry))))
 		return nullptr;
 	_ZARCHIVE::FileDirectoryEntry::Deserialize(fileTree.data(), fileTree.size(), fileTree.data());
 	// verify file tree
@@ -86,30 +261,46 @@ ZArchiveReader* ZArchiveReader::OpenFromFile(const std::filesystem::path& path)
 	// read meta data
 	// todo
 
-	ZArchiveReader* cfs = new ZArchiveReader(std::move(file), std::move(offsetRecords), std::move(nameTable), std::move(fileTree), footer.sectionCompressedData.offset, footer.sectionCompressedData.size);
+	ZArchiveReader* cfs = new ZArchiveReader(std::move(parts), footer, blockSize, std::move(offsetRecords), std::move(offsetRecordsV2), std::move(nameTable), std::move(fileTree), cacheSize);
+	if (!cfs->m_offsetRecordsV2.empty())
+		cfs->m_blockCount = blockCountV2;
+	if (isDelta)
+		cfs->m_baseReader = std::move(baseReader);
 	return cfs;
 }
 
-ZArchiveReader::ZArchiveReader(std::ifstream&& file, std::vector<_ZARCHIVE::CompressionOffsetRecord>&& offsetRecords, std::vector<uint8_t>&& nameTable, std::vector<_ZARCHIVE::FileDirectoryEntry>&& fileTree, uint64_t compressedDataOffset, uint64_t compressedDataSize) :
-	m_file(std::move(file)), m_offsetRecords(std::move(offsetRecords)), m_nameTable(std::move(nameTable)), m_fileTree(std::move(fileTree)),
-	m_compressedDataOffset(compressedDataOffset), m_compressedDataSize(compressedDataSize)
+ZArchiveReader::ZArchiveReader(std::vector<std::unique_ptr<ArchivePart>>&& parts, const _ZARCHIVE::Footer& footer, uint32_t blockSize, std::vector<_ZARCHIVE::CompressionOffsetRecord>&& offsetRecords, std::vector<_ZARCHIVE::CompressionOffsetRecordV2>&& offsetRecordsV2, std::vector<uint8_t>&& nameTable, std::vector<_ZARCHIVE::FileDirectoryEntry>&& fileTree, uint64_t cacheSize) :
+	m_parts(std::move(parts)), m_blockSize(blockSize), m_offsetRecords(std::move(offsetRecords)), m_offsetRecordsV2(std::move(offsetRecordsV2)), m_nameTable(std::move(nameTable)), m_fileTree(std::move(fileTree)),
+	m_compressedDataOffset(footer.sectionCompressedData.offset), m_compressedDataSize(footer.sectionCompressedData.size)
 {
-	m_blockCount = (uint64_t)m_offsetRecords.size() * _ZARCHIVE::ENTRIES_PER_OFFSETRECORD;
-	m_blockDecompressionBuffer.resize(_ZARCHIVE::COMPRESSED_BLOCK_SIZE);
+	memcpy(m_integrityHash, footer.integrityHash, 32);
+	m_blockCount = (uint64_t)(m_offsetRecords.size() + m_offsetRecordsV2.size()) * _ZARCHIVE::ENTRIES_PER_OFFSETRECORD; // version 2 archives store the exact count, it is set after construction
+	if (!m_offsetRecords.empty())
+	{
+		// the unused entries of the last version 1 record do not describe blocks, every real block starts within the compressed data
+		auto& lastRecord = m_offsetRecords.back();
+		uint64_t offset = lastRecord.baseOffset;
+		uint32_t usedEntries = 0;
+		while (usedEntries < _ZARCHIVE::ENTRIES_PER_OFFSETRECORD && offset < m_compressedDataSize)
+			offset += lastRecord.GetCompressedSize(usedEntries++);
+		m_blockCount -= (_ZARCHIVE::ENTRIES_PER_OFFSETRECORD - usedEntries);
+	}
 	// init cache
-	uint64_t cacheSize = 1024 * 1024 * 4; // 4MiB
-	if ((cacheSize % _ZARCHIVE::COMPRESSED_BLOCK_SIZE) != 0)
-		cacheSize += (_ZARCHIVE::COMPRESSED_BLOCK_SIZE - (cacheSize % _ZARCHIVE::COMPRESSED_BLOCK_SIZE));
+	if (cacheSize < m_blockSize)
+		cacheSize = m_blockSize;
+	if ((cacheSize % m_blockSize) != 0)
+		cacheSize += (m_blockSize - (cacheSize % m_blockSize));
 	m_cacheDataBuffer.resize(cacheSize);
 	// create cache blocks and init LRU chain
-	m_cacheBlocks.resize(cacheSize / _ZARCHIVE::COMPRESSED_BLOCK_SIZE);
+	m_cacheBlocks.resize(cacheSize / m_blockSize);
 	m_lruChainFirst = m_cacheBlocks.data() + 0;
 	m_lruChainLast = m_cacheBlocks.data() + m_cacheBlocks.size() - 1;
 	CacheBlock* prevBlock = nullptr;
 	for (size_t i = 0; i < m_cacheBlocks.size(); i++)
 	{
 		m_cacheBlocks[i].blockIndex = 0xFFFFFFFFFFFFFFFF;
-		m_cacheBlocks[i].data = m_cacheDataBuffer.data() + i * _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
+		m_cacheBlocks[i].isLoading = false;
+		m_cacheBlocks[i].data = m_cacheDataBuffer.data() + i * m_blockSize;
 		m_cacheBlocks[i].prev = prevBlock;
 		m_cacheBlocks[i].next = m_cacheBlocks.data() + i + 1;
 		prevBlock = m_cacheBlocks.data() + i;
@@ -119,11 +310,12 @@ ZArchiveReader::ZArchiveReader(std::ifstream&& file, std::vector<_ZARCHIVE::Comp
 
 ZArchiveReader::~ZArchiveReader()
 {
-
+	StopPrefetch();
 }
 
 ZArchiveNodeHandle ZArchiveReader::LookUp(std::string_view path, bool allowFile, bool allowDirectory)
 {
+	STATS_LATENCY_SCOPE(lookUpLatency);
 	std::string_view pathParser = path;
 	uint32_t currentNode = 0;
 	while (true)
@@ -192,6 +384,7 @@ bool ZArchiveReader::GetDirEntry(ZArchiveNodeHandle nodeHandle, uint32_t index,
 	if (index >= dir.directoryRecord.count)
 		return false;
 	auto& it = m_fileTree.at(dir.directoryRecord.nodeStartIndex + index);
+	dirEntry.nodeHandle = (ZArchiveNodeHandle)(dir.directoryRecord.nodeStartIndex + index);
 	dirEntry.isFile = it.IsFile();
 	dirEntry.isDirectory = !dirEntry.isFile;
 	if (dirEntry.isFile)
@@ -214,11 +407,24 @@ uint64_t ZArchiveReader::GetFileSize(ZArchiveNodeHandle nodeHandle)
 	return file.GetFileSize();
 }
 
+uint64_t ZArchiveReader::GetFileDataOffset(ZArchiveNodeHandle nodeHandle) const
+{
+	if (nodeHandle >= m_fileTree.size())
+		return 0;
+	auto& file = m_fileTree.at(nodeHandle);
+	if (!file.IsFile())
+		return 0;
+	return file.GetFileOffset();
+}
+
 uint64_t ZArchiveReader::ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint64_t length, void* buffer)
 {
 	if (nodeHandle >= m_fileTree.size())
 		return 0;
+	STATS_LATENCY_SCOPE(readFromFileLatency);
+	[[maybe_unused]] uint64_t lockStartTime = STATS_TIMESTAMP();
 	std::unique_lock<std::mutex> _lock(m_accessMutex);
+	STATS_ADD(lockWaitTime, STATS_TIMESTAMP() - lockStartTime);
 	auto& file = m_fileTree.at(nodeHandle);
 	if (!file.IsFile())
 		return 0;
@@ -228,18 +434,38 @@ uint64_t ZArchiveReader::ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t of
 		return 0;
 	uint64_t bytesToRead = std::min(length, (fileSize - offset));
 
+	// the blocks of aligned files are not shared with other files, so whole blocks can bypass the cache. Otherwise a neighbouring file or a later read could need them again
+	bool allowCacheBypass = (fileOffset % m_blockSize) == 0;
 	uint64_t rawReadOffset = fileOffset + offset;
 	uint64_t remainingBytes = bytesToRead;
 	uint8_t* bufferU8 = (uint8_t*)buffer;
 	while (remainingBytes > 0)
 	{
-		uint64_t blockIdx = rawReadOffset / _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
-		uint32_t blockOffset = (uint32_t)(rawReadOffset % _ZARCHIVE::COMPRESSED_BLOCK_SIZE);
-		uint32_t stepSize = std::min<uint32_t>(remainingBytes, _ZARCHIVE::COMPRESSED_BLOCK_SIZE - blockOffset);
-		CacheBlock* block = GetCachedBlock(blockIdx);
-		if (!block)
-			return 0;
-		std::memcpy(bufferU8, block->data + blockOffset, stepSize);
+		uint64_t blockIdx = rawReadOffset / m_blockSize;
+		uint32_t blockOffset = (uint32_t)(rawReadOffset % m_blockSize);
+		uint32_t stepSize = (uint32_t)std::min<uint64_t>(remainingBytes, m_blockSize - blockOffset);
+		bool isCached = m_blockLookup.find(blockIdx) != m_blockLookup.end();
+		if (m_trace.isEnabled)
+			AddTraceRecord(nodeHandle, rawReadOffset - fileOffset, stepSize, blockIdx, isCached);
+		if (stepSize == m_blockSize && allowCacheBypass && !isCached)
+		{
+			STATS_ADD(cacheMisses, 1);
+			// the whole block is requested, decompress it straight into the output buffer and bypass the cache
+			// this touches no shared state, so the lock is released and other threads can load blocks in the meantime
+			thread_local std::vector<uint8_t> compressedBuffer;
+			_lock.unlock();
+			bool r = LoadBlockData(nullptr, compressedBuffer, blockIdx, bufferU8);
+			_lock.lock();
+			if (!r)
+				return 0;
+		}
+		else
+		{
+			CacheBlock* block = GetCachedBlock(_lock, blockIdx);
+			if (!block)
+				return 0;
+			std::memcpy(bufferU8, block->data + blockOffset, stepSize);
+		}
 		rawReadOffset += stepSize;
 		remainingBytes -= stepSize;
 		bufferU8 += stepSize;
@@ -247,29 +473,61 @@ uint64_t ZArchiveReader::ReadFromFile(ZArchiveNodeHandle nodeHandle, uint64_t of
 	return bytesToRead;
 }
 
-ZArchiveReader::CacheBlock* ZArchiveReader::GetCachedBlock(uint64_t blockIndex)
+// the block is loaded without holding the access lock, so other threads can copy from cached blocks or load other blocks in the meantime
+// while loading the block is registered but marked as loading. Threads which need it wait for the load to finish
+ZArchiveReader::CacheBlock* ZArchiveReader::GetCachedBlock(std::unique_lock<std::mutex>& lock, uint64_t blockIndex)
 {
-	auto it = m_blockLookup.find(blockIndex);
-	if (it != m_blockLookup.end())
-	{
-		MarkBlockAsMRU(it->second);
-		return it->second;
-	}
-	if (blockIndex >= m_blockCount)
-		return nullptr;
-	// not in cache
-	CacheBlock* newBlock = RecycleLRUBlock(blockIndex);
-	if (!LoadBlock(newBlock))
+	while (true)
 	{
-		UnregisterBlock(newBlock);
-		return nullptr;
+		auto it = m_blockLookup.find(blockIndex);
+		if (it != m_blockLookup.end())
+		{
+			if (it->second->isLoading)
+			{
+				// look the block up again afterwards since the load can fail
+				m_blockLoaded.wait(lock);
+				continue;
+			}
+			STATS_ADD(cacheHits, 1);
+			MarkBlockAsMRU(it->second);
+			return it->second;
+		}
+		if (blockIndex >= m_blockCount)
+			return nullptr;
+		// not in cache
+		CacheBlock* newBlock = RecycleLRUBlock(blockIndex);
+		if (!newBlock)
+		{
+			// every cache block is being loaded by another thread
+			m_blockLoaded.wait(lock);
+			continue;
+		}
+		STATS_ADD(cacheMisses, 1);
+		newBlock->isLoading = true;
+		lock.unlock();
+		bool r = LoadBlock(newBlock);
+		lock.lock();
+		newBlock->isLoading = false;
+		m_blockLoaded.notify_all();
+		if (!r)
+		{
+			UnregisterBlock(newBlock);
+			return nullptr;
+		}
+		return newBlock;
 	}
-	return newBlock;
 }
 
+// returns nullptr if all blocks are currently being loaded
 ZArchiveReader::CacheBlock* ZArchiveReader::RecycleLRUBlock(uint64_t newBlockIndex)
 {
 	CacheBlock* recycledBlock = m_lruChainFirst;
+	while (recycledBlock && recycledBlock->isLoading)
+		recycledBlock = recycledBlock->next;
+	if (!recycledBlock)
+		return nullptr;
+	if (recycledBlock->blockIndex != 0xFFFFFFFFFFFFFFFF)
+		STATS_ADD(cacheEvictions, 1);
 	UnregisterBlock(recycledBlock);
 	RegisterBlock(recycledBlock, newBlockIndex);
 	MarkBlockAsMRU(recycledBlock);
@@ -316,35 +574,456 @@ void ZArchiveReader::UnregisterBlock(CacheBlock* block)
 	block->blockIndex = 0xFFFFFFFFFFFFFFFF;
 }
 
+bool ZArchiveReader::GetCompressedBlockRange(uint64_t blockIndex, uint64_t& offset, uint32_t& compressedSize) const
+{
+	if (!m_offsetRecordsV2.empty())
+		return _getCompressedBlockRange(m_offsetRecordsV2, blockIndex, offset, compressedSize);
+	return _getCompressedBlockRange(m_offsetRecords, blockIndex, offset, compressedSize);
+}
+
+bool ZArchiveReader::GetBaseBlockIndex(uint64_t blockIndex, uint64_t& baseBlockIndex) const
+{
+	if (!m_baseReader)
+		return false;
+	uint64_t recordIndex = blockIndex / _ZARCHIVE::ENTRIES_PER_OFFSETRECORD;
+	uint32_t recordSubIndex = (uint32_t)(blockIndex % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD);
+	if (recordIndex >= m_offsetRecordsV2.size() || !m_offsetRecordsV2[recordIndex].IsBaseBlock(recordSubIndex))
+		return false;
+	baseBlockIndex = m_offsetRecordsV2[recordIndex].size[recordSubIndex] & ~_ZARCHIVE::BASE_BLOCK_FLAG;
+	return true;
+}
+
+// called without holding the access lock
 bool ZArchiveReader::LoadBlock(CacheBlock* block)
 {
-	uint32_t recordIndex = (uint32_t)(block->blockIndex / _ZARCHIVE::ENTRIES_PER_OFFSETRECORD);
-	uint32_t recordSubIndex = (uint32_t)(block->blockIndex % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD);
-	if (recordIndex >= m_offsetRecords.size())
+	thread_local std::vector<uint8_t> compressedBuffer;
+	return LoadBlockData(nullptr, compressedBuffer, block->blockIndex, block->data);
+}
+
+bool ZArchiveReader::ReadStoredBlocks(uint64_t firstBlockIndex, uint32_t blockCount, std::vector<uint8_t>& data, std::vector<uint32_t>& storedSizes) const
+{
+	data.clear();
+	storedSizes.resize(blockCount);
+	// blocks stored in this archive are read in runs, blocks of a delta archive's base are fetched from there in between
+	uint64_t runOffset = 0;
+	uint64_t runEndOffset = 0;
+	auto readRun = [&]() -> bool
+	{
+		if (runEndOffset == runOffset)
+			return true;
+		if (runEndOffset > m_compressedDataSize)
+			return false;
+		size_t dataOffset = data.size();
+		data.resize(dataOffset + (runEndOffset - runOffset));
+		[[maybe_unused]] uint64_t ioStartTime = STATS_TIMESTAMP();
+		if (!ReadArchiveData(m_parts, nullptr, m_compressedDataOffset + runOffset, data.data() + dataOffset, runEndOffset - runOffset))
+			return false;
+		STATS_ADD(ioTime, STATS_TIMESTAMP() - ioStartTime);
+		STATS_ADD(bytesReadFromDisk, runEndOffset - runOffset);
+		runOffset = runEndOffset;
+		return true;
+	};
+	std::vector<uint8_t> baseData;
+	std::vector<uint32_t> baseStoredSizes;
+	for (uint32_t i = 0; i < blockCount; i++)
+	{
+		if (firstBlockIndex + i >= m_blockCount)
+			return false;
+		uint64_t baseBlockIndex;
+		if (GetBaseBlockIndex(firstBlockIndex + i, baseBlockIndex))
+		{
+			if (!readRun() || !m_baseReader->ReadStoredBlocks(baseBlockIndex, 1, baseData, baseStoredSizes))
+				return false;
+			data.insert(data.end(), baseData.begin(), baseData.end());
+			storedSizes[i] = baseStoredSizes[0];
+			continue;
+		}
+		uint64_t offset;
+		uint32_t storedSize;
+		if (!GetCompressedBlockRange(firstBlockIndex + i, offset, storedSize))
+			return false;
+		if (storedSize > m_blockSize)
+			return false;
+		if (storedSize != 0)
+		{
+			if (runEndOffset == runOffset)
+				runOffset = runEndOffset = offset;
+			else if (offset != runEndOffset)
+				return false; // blocks are always stored back to back
+			runEndOffset = offset + storedSize;
+		}
+		storedSizes[i] = storedSize;
+	}
+	return readRun();
+}
+
+bool ZArchiveReader::SetSharedCache(ZArchiveSharedCache* sharedCache)
+{
+	if (sharedCache && sharedCache->GetSlotSize() < m_blockSize)
+		return false;
+	m_sharedCache.store(sharedCache, std::memory_order_relaxed);
+	return true;
+}
+
+// loads a block into output, from the shared cache if one is attached. Only touches the passed buffer and the file handles, so it can run concurrently
+// if privateFiles is set those handles are used instead of the shared per-part handles
+bool ZArchiveReader::LoadBlockData(std::vector<std::ifstream>* privateFiles, std::vector<uint8_t>& compressedBuffer, uint64_t blockIndex, uint8_t* output) const
+{
+	ZArchiveSharedCache* sharedCache = m_sharedCache.load(std::memory_order_relaxed);
+	if (!sharedCache)
+		return ReadAndDecompressBlock(privateFiles, compressedBuffer, blockIndex, output);
+	if (blockIndex >= m_blockCount)
+		return false;
+	if (sharedCache->ReadBlock(m_integrityHash, blockIndex, output, m_blockSize))
+	{
+		STATS_ADD(sharedCacheHits, 1);
+		return true;
+	}
+	if (!ReadAndDecompressBlock(privateFiles, compressedBuffer, blockIndex, output))
+		return false;
+	sharedCache->WriteBlock(m_integrityHash, blockIndex, output, m_blockSize);
+	return true;
+}
+
+bool ZArchiveReader::ReadAndDecompressBlock(std::vector<std::ifstream>* privateFiles, std::vector<uint8_t>& compressedBuffer, uint64_t blockIndex, uint8_t* output) const
+{
+	if (blockIndex >= m_blockCount)
 		return false;
+	uint64_t baseBlockIndex;
+	if (GetBaseBlockIndex(blockIndex, baseBlockIndex))
+		return m_baseReader->LoadBlockData(nullptr, compressedBuffer, baseBlockIndex, output);
 	// determine offset and size of compressed block
-	auto& record = m_offsetRecords[recordIndex];
-	uint64_t offset = record.baseOffset;
-	for (uint32_t i = 0; i < recordSubIndex; i++)
+	uint64_t offset;
+	uint32_t compressedSize;
+	if (!GetCompressedBlockRange(blockIndex, offset, compressedSize))
+		return false;
+	if (compressedSize > m_blockSize)
+		return false;
+	if (compressedSize == 0)
 	{
-		offset += (uint64_t)record.size[i];
-		offset++;
+		// all-zero block without stored data
+		memset(output, 0, m_blockSize);
+		return true;
 	}
-	uint32_t compressedSize = (uint32_t)record.size[recordSubIndex] + 1;
 	// load file data
 	if ((offset + compressedSize) > m_compressedDataSize)
 		return false;
 	offset += m_compressedDataOffset;
-	if (compressedSize == _ZARCHIVE::COMPRESSED_BLOCK_SIZE)
+	[[maybe_unused]] uint64_t ioStartTime = STATS_TIMESTAMP();
+	if (compressedSize == m_blockSize)
 	{
 		// uncompressed block, read directly into cached block
-		return _ifstream_readBytes(m_file, offset, block->data, compressedSize);
+		bool r = ReadArchiveData(m_parts, privateFiles, offset, output, compressedSize);
+		STATS_ADD(ioTime, STATS_TIMESTAMP() - ioStartTime);
+		STATS_ADD(bytesReadFromDisk, compressedSize);
+		return r;
 	}
-	if (!_ifstream_readBytes(m_file, offset, m_blockDecompressionBuffer.data(), compressedSize))
-		return false;
+	if (GetCompressedCacheBlock(blockIndex, compressedBuffer))
+		STATS_ADD(compressedCacheHits, 1);
+	else
+	{
+		if (compressedBuffer.size() < compressedSize)
+			compressedBuffer.resize(compressedSize);
+		if (!ReadArchiveData(m_parts, privateFiles, offset, compressedBuffer.data(), compressedSize))
+			return false;
+		STATS_ADD(ioTime, STATS_TIMESTAMP() - ioStartTime);
+		STATS_ADD(bytesReadFromDisk, compressedSize);
+		StoreCompressedCacheBlock(blockIndex, compressedBuffer.data(), compressedSize);
+	}
+	[[maybe_unused]] uint64_t decompressStartTime = STATS_TIMESTAMP();
 	// decompress
-	size_t outputSize = ZSTD_decompress(block->data, _ZARCHIVE::COMPRESSED_BLOCK_SIZE, m_blockDecompressionBuffer.data(), compressedSize);
-	return outputSize == _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
+	size_t outputSize = ZSTD_decompress(output, m_blockSize, compressedBuffer.data(), compressedSize);
+	STATS_ADD(decompressTime, STATS_TIMESTAMP() - decompressStartTime);
+	STATS_ADD(bytesDecompressed, m_blockSize);
+	return outputSize == m_blockSize;
+}
+
+void ZArchiveReader::SetCompressedCacheSize(uint64_t size)
+{
+	if (m_baseReader)
+		m_baseReader->SetCompressedCacheSize(size);
+	std::unique_lock<std::mutex> _lock(m_compressedCache.mutex);
+	m_compressedCache.capacity.store(size, std::memory_order_relaxed);
+	TrimCompressedCache(size);
+}
+
+// copies the compressed data of a block into compressedBuffer if it is in the compressed cache
+bool ZArchiveReader::GetCompressedCacheBlock(uint64_t blockIndex, std::vector<uint8_t>& compressedBuffer) const
+{
+	if (m_compressedCache.capacity.load(std::memory_order_relaxed) == 0)
+		return false;
+	std::unique_lock<std::mutex> _lock(m_compressedCache.mutex);
+	auto it = m_compressedCache.blockLookup.find(blockIndex);
+	if (it == m_compressedCache.blockLookup.end())
+		return false;
+	m_compressedCache.lruList.splice(m_compressedCache.lruList.begin(), m_compressedCache.lruList, it->second);
+	const std::vector<uint8_t>& data = it->second->data;
+	if (compressedBuffer.size() < data.size())
+		compressedBuffer.resize(data.size());
+	memcpy(compressedBuffer.data(), data.data(), data.size());
+	return true;
+}
+
+void ZArchiveReader::StoreCompressedCacheBlock(uint64_t blockIndex, const uint8_t* data, uint32_t size) const
+{
+	if (m_compressedCache.capacity.load(std::memory_order_relaxed) == 0)
+		return;
+	std::unique_lock<std::mutex> _lock(m_compressedCache.mutex);
+	uint64_t capacity = m_compressedCache.capacity.load(std::memory_order_relaxed);
+	if (size > capacity || m_compressedCache.blockLookup.find(blockIndex) != m_compressedCache.blockLookup.end())
+		return;
+	TrimCompressedCache(capacity - size);
+	m_compressedCache.lruList.push_front({ blockIndex, std::vector<uint8_t>(data, data + size) });
+	m_compressedCache.blockLookup.emplace(blockIndex, m_compressedCache.lruList.begin());
+	m_compressedCache.size += size;
+	m_variableMemoryUsage.fetch_add(size + sizeof(CompressedCacheBlock) + sizeof(uint64_t) + sizeof(void*), std::memory_order_relaxed);
+}
+
+// evicts least recently used blocks until at most capacity bytes are held. Caller holds the compressed cache lock
+void ZArchiveReader::TrimCompressedCache(uint64_t capacity) const
+{
+	while (m_compressedCache.size > capacity)
+	{
+		CompressedCacheBlock& block = m_compressedCache.lruList.back();
+		m_compressedCache.size -= block.data.size();
+		m_variableMemoryUsage.fetch_sub(block.data.size() + sizeof(CompressedCacheBlock) + sizeof(uint64_t) + sizeof(void*), std::memory_order_relaxed);
+		m_compressedCache.blockLookup.erase(block.blockIndex);
+		m_compressedCache.lruList.pop_back();
+	}
+}
+
+bool ZArchiveReader::GetStats(Stats& stats) const
+{
+	memset(&stats, 0, sizeof(Stats));
+#ifdef ZARCHIVE_ENABLE_STATS
+	for (auto& shard : m_stats)
+	{
+		stats.cacheHits += shard.cacheHits.load(std::memory_order_relaxed);
+		stats.cacheMisses += shard.cacheMisses.load(std::memory_order_relaxed);
+		stats.cacheEvictions += shard.cacheEvictions.load(std::memory_order_relaxed);
+		stats.sharedCacheHits += shard.sharedCacheHits.load(std::memory_order_relaxed);
+		stats.compressedCacheHits += shard.compressedCacheHits.load(std::memory_order_relaxed);
+		stats.bytesReadFromDisk += shard.bytesReadFromDisk.load(std::memory_order_relaxed);
+		stats.bytesDecompressed += shard.bytesDecompressed.load(std::memory_order_relaxed);
+		stats.ioTime += shard.ioTime.load(std::memory_order_relaxed);
+		stats.decompressTime += shard.decompressTime.load(std::memory_order_relaxed);
+		stats.lockWaitTime += shard.lockWaitTime.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < Stats::kHistogramBuckets; i++)
+		{
+			stats.readFromFileLatency[i] += shard.readFromFileLatency[i].load(std::memory_order_relaxed);
+			stats.lookUpLatency[i] += shard.lookUpLatency[i].load(std::memory_order_relaxed);
+		}
+	}
+	// the caches and archive tables keep their size once the archive is open. The block lookup is counted as if every cache block was registered
+	stats.memoryUsage = m_cacheDataBuffer.capacity() + m_cacheBlocks.capacity() * (sizeof(CacheBlock) + sizeof(uint64_t) + sizeof(CacheBlock*)) +
+		m_offsetRecords.capacity() * sizeof(_ZARCHIVE::CompressionOffsetRecord) + m_offsetRecordsV2.capacity() * sizeof(_ZARCHIVE::CompressionOffsetRecordV2) +
+		m_nameTable.capacity() + m_fileTree.capacity() * sizeof(_ZARCHIVE::FileDirectoryEntry) +
+		m_variableMemoryUsage.load(std::memory_order_relaxed);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void ZArchiveReader::ResetStats()
+{
+#ifdef ZARCHIVE_ENABLE_STATS
+	for (auto& shard : m_stats)
+	{
+		shard.cacheHits = 0;
+		shard.cacheMisses = 0;
+		shard.cacheEvictions = 0;
+		shard.sharedCacheHits = 0;
+		shard.compressedCacheHits = 0;
+		shard.bytesReadFromDisk = 0;
+		shard.bytesDecompressed = 0;
+		shard.ioTime = 0;
+		shard.decompressTime = 0;
+		shard.lockWaitTime = 0;
+		for (size_t i = 0; i < Stats::kHistogramBuckets; i++)
+		{
+			shard.readFromFileLatency[i] = 0;
+			shard.lookUpLatency[i] = 0;
+		}
+	}
+#endif
+}
+
+void ZArchiveReader::StartTracing(size_t maxRecords)
+{
+	std::unique_lock<std::mutex> _lock(m_accessMutex);
+	m_trace.isEnabled = true;
+	m_trace.maxRecords = maxRecords;
+	m_trace.startTime = std::chrono::steady_clock::now();
+	m_trace.records.clear();
+}
+
+void ZArchiveReader::StopTracing()
+{
+	std::unique_lock<std::mutex> _lock(m_accessMutex);
+	m_trace.isEnabled = false;
+}
+
+void ZArchiveReader::AddTraceRecord(ZArchiveNodeHandle nodeHandle, uint64_t offset, uint32_t length, uint64_t blockIndex, bool isCacheHit)
+{
+	if (m_trace.records.size() >= m_trace.maxRecords)
+		return;
+	size_t prevCapacity = m_trace.records.capacity();
+	_ZARCHIVE::TraceRecord& record = m_trace.records.emplace_back();
+	m_variableMemoryUsage.fetch_add((m_trace.records.capacity() - prevCapacity) * sizeof(_ZARCHIVE::TraceRecord), std::memory_order_relaxed);
+	record.timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_trace.startTime).count();
+	record.offset = offset;
+	record.blockIndexAndHit = blockIndex | (isCacheHit ? 0x8000000000000000ull : 0);
+	record.nodeHandle = nodeHandle;
+	record.length = length;
+}
+
+bool ZArchiveReader::SaveTrace(const std::filesystem::path& path)
+{
+	std::vector<_ZARCHIVE::TraceRecord> records;
+	{
+		std::unique_lock<std::mutex> _lock(m_accessMutex);
+		records = m_trace.records;
+	}
+	std::ofstream file(path, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+	if (!file.is_open())
+		return false;
+	_ZARCHIVE::TraceHeader header;
+	header.magic = _ZARCHIVE::TraceHeader::kMagic;
+	header.version = _ZARCHIVE::TraceHeader::kVersion1;
+	memcpy(header.archiveHash, m_integrityHash, 32);
+	header.recordCount = records.size();
+	_ZARCHIVE::TraceHeader::Serialize(&header, &header);
+	_ZARCHIVE::TraceRecord::Serialize(records.data(), records.size(), records.data()); // in-place
+	file.write((const char*)&header, sizeof(_ZARCHIVE::TraceHeader));
+	file.write((const char*)records.data(), records.size() * sizeof(_ZARCHIVE::TraceRecord));
+	return file.good();
+}
+
+bool ZArchiveReader::PrefetchFromTrace(const std::filesystem::path& path, uint32_t numThreads)
+{
+	std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+	if (!file.is_open())
+		return false;
+	_ZARCHIVE::TraceHeader header;
+	if (!_ifstream_readBytes(file, 0, &header, sizeof(_ZARCHIVE::TraceHeader)))
+		return false;
+	_ZARCHIVE::TraceHeader::Deserialize(&header, &header);
+	if (header.magic != _ZARCHIVE::TraceHeader::kMagic || header.version != _ZARCHIVE::TraceHeader::kVersion1)
+		return false;
+	if (memcmp(header.archiveHash, m_integrityHash, 32) != 0)
+		return false; // trace belongs to a different archive
+	if (header.recordCount > (_ifstream_getFileSize(file) - sizeof(_ZARCHIVE::TraceHeader)) / sizeof(_ZARCHIVE::TraceRecord))
+		return false;
+	std::vector<_ZARCHIVE::TraceRecord> records;
+	records.resize(header.recordCount);
+	file.seekg(sizeof(_ZARCHIVE::TraceHeader), std::ios_base::beg);
+	file.read((char*)records.data(), records.size() * sizeof(_ZARCHIVE::TraceRecord));
+	if ((size_t)file.gcount() != records.size() * sizeof(_ZARCHIVE::TraceRecord))
+		return false;
+	_ZARCHIVE::TraceRecord::Deserialize(records.data(), records.size(), records.data());
+
+	StopPrefetch();
+	// collect blocks in order of first access. Stop once the cache is full since any further blocks would evict earlier ones
+	std::unordered_map<uint64_t, bool> seenBlocks;
+	size_t prevCapacity = m_prefetch.blocks.capacity();
+	m_prefetch.blocks.clear();
+	for (auto& it : records)
+	{
+		uint64_t blockIndex = it.GetBlockIndex();
+		if (blockIndex >= m_blockCount || !seenBlocks.emplace(blockIndex, true).second)
+			continue;
+		m_prefetch.blocks.emplace_back(blockIndex);
+		if (m_prefetch.blocks.size() >= m_cacheBlocks.size())
+			break;
+	}
+	m_variableMemoryUsage.fetch_add((m_prefetch.blocks.capacity() - prevCapacity) * sizeof(uint64_t), std::memory_order_relaxed);
+	m_prefetch.nextIndex = 0;
+	m_prefetch.stop = false;
+	numThreads = std::clamp<uint32_t>(numThreads, 1, 16);
+	for (uint32_t i = 0; i < numThreads; i++)
+		m_prefetch.threads.emplace_back(&ZArchiveReader::PrefetchWorker, this);
+	return true;
+}
+
+void ZArchiveReader::PrefetchWorker()
+{
+	// each worker uses its own file handles so that loads can overlap with each other and with ReadFromFile
+	std::vector<std::ifstream> files(m_parts.size());
+	std::vector<uint8_t> compressedBuffer;
+	std::vector<uint8_t> blockData(m_blockSize);
+	while (!m_prefetch.stop)
+	{
+		size_t index = m_prefetch.nextIndex.fetch_add(1);
+		if (index >= m_prefetch.blocks.size())
+			break;
+		uint64_t blockIndex = m_prefetch.blocks[index];
+		{
+			std::unique_lock<std::mutex> _lock(m_accessMutex);
+			if (m_blockLookup.find(blockIndex) != m_blockLookup.end())
+				continue;
+		}
+		if (!LoadBlockData(&files, compressedBuffer, blockIndex, blockData.data()))
+			continue;
+		[[maybe_unused]] uint64_t lockStartTime = STATS_TIMESTAMP();
+		std::unique_lock<std::mutex> _lock(m_accessMutex);
+		STATS_ADD(lockWaitTime, STATS_TIMESTAMP() - lockStartTime);
+		if (m_blockLookup.find(blockIndex) != m_blockLookup.end())
+			continue; // loaded by someone else in the meantime
+		CacheBlock* block = RecycleLRUBlock(blockIndex);
+		if (block)
+			memcpy(block->data, blockData.data(), m_blockSize);
+	}
+}
+
+void ZArchiveReader::StopPrefetch()
+{
+	m_prefetch.stop = true;
+	for (auto& it : m_prefetch.threads)
+		it.join();
+	m_prefetch.threads.clear();
+}
+
+// reads a range of the archive, which can span multiple parts
+bool ZArchiveReader::ReadArchiveData(const std::vector<std::unique_ptr<ArchivePart>>& parts, std::vector<std::ifstream>* privateFiles, uint64_t offset, void* buffer, uint64_t size)
+{
+	auto it = std::upper_bound(parts.begin(), parts.end(), offset, [](uint64_t offset, const std::unique_ptr<ArchivePart>& part) { return offset < part->offset; });
+	if (it == parts.begin())
+		return false;
+	size_t partIndex = (size_t)(it - parts.begin()) - 1;
+	uint8_t* output = (uint8_t*)buffer;
+	while (size > 0)
+	{
+		if (partIndex >= parts.size())
+			return false;
+		ArchivePart& part = *parts[partIndex];
+		uint64_t partOffset = offset - part.offset;
+		uint32_t bytesToRead = (uint32_t)std::min<uint64_t>({ size, part.size - partOffset, 0x40000000 });
+		if (bytesToRead == 0)
+		{
+			partIndex++;
+			continue;
+		}
+		bool r;
+		if (privateFiles)
+		{
+			std::ifstream& file = (*privateFiles)[partIndex];
+			if (!file.is_open())
+				file.open(part.path, std::ios_base::in | std::ios_base::binary);
+			r = _ifstream_readBytes(file, partOffset, output, bytesToRead);
+		}
+		else
+		{
+			std::unique_lock<std::mutex> _lock(part.fileMutex);
+			r = _ifstream_readBytes(part.file, partOffset, output, bytesToRead);
+		}
+		if (!r)
+			return false;
+		offset += bytesToRead;
+		output += bytesToRead;
+		size -= bytesToRead;
+	}
+	return true;
 }
 
 // returns empty view on failure
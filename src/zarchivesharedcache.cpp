@@ -0,0 +1,345 @@
+#include "zarchive/zarchivesharedcache.h"
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <mutex>
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ZARCHIVE_HAS_SHM
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#endif
+
+// the segment is shared between processes, so only address-free atomics can be used
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+struct ZArchiveSharedCache::SegmentHeader
+{
+	static inline uint32_t kMagic = 0x7a617363;
+	static inline uint32_t kVersion3 = 3; // version 1 had no slot owners, version 2 identified them by pid
+	static inline uint32_t kStateReady = 1;
+
+	std::atomic<uint32_t> state; // set to kStateReady once the creator has filled in the header
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slotSize;
+	uint32_t ways;
+	uint32_t _reserved;
+	uint64_t setCount;
+	std::atomic<uint64_t> useClock; // source of the last use timestamps. They start at 1, empty slots count as 0
+};
+
+struct ZArchiveSharedCache::SlotHeader
+{
+	std::atomic<uint64_t> sequence; // odd while the slot is written
+	std::atomic<uint64_t> lastUse;
+	std::atomic<uint64_t> key[3]; // first 16 bytes of the archive integrity hash and block index + 1. Zero if the slot is empty
+	std::atomic<uint32_t> dataSize;
+	std::atomic<uint64_t> claim; // token of the writing process in the upper 32 bits and the claim time in seconds in the lower 32 bits, 0 if none
+};
+
+static constexpr uint32_t SHARED_CACHE_WAYS = 8;
+static constexpr uint64_t SHARED_CACHE_DATA_ALIGNMENT = 4096;
+static constexpr uint32_t SHARED_CACHE_CLAIM_TIMEOUT = 3; // in seconds. Writing a slot takes microseconds, so older claims were abandoned
+static constexpr uint32_t SHARED_CACHE_COPY_CHUNK = 4096; // writers check that they still own the slot before copying each chunk
+
+static uint64_t _alignUp(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static uint32_t _getClockSeconds()
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t _mixToken(uint64_t value)
+{
+	value ^= value >> 30;
+	value *= 0xBF58476D1CE4E5B9ull;
+	value ^= value >> 27;
+	value *= 0x94D049BB133111EBull;
+	value ^= value >> 31;
+	return (uint32_t)value | 1; // never 0, which marks an unclaimed slot
+}
+
+static std::atomic<uint32_t> s_processToken{ 0 };
+
+// random token which identifies the writers of this process in slot claims
+static uint32_t _getProcessToken()
+{
+	static std::once_flag s_tokenInit;
+	std::call_once(s_tokenInit, []()
+		{
+			std::random_device randomDevice;
+			s_processToken.store(_mixToken(((uint64_t)randomDevice() << 32) ^ randomDevice() ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count()), std::memory_order_relaxed);
+#ifdef ZARCHIVE_HAS_SHM
+			// a forked child must not write with the token of its parent
+			pthread_atfork(nullptr, nullptr, []()
+				{
+					s_processToken.store(_mixToken(s_processToken.load(std::memory_order_relaxed) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count()), std::memory_order_relaxed);
+				});
+#endif
+		});
+	return s_processToken.load(std::memory_order_relaxed);
+}
+
+// a process which died or stalled while writing a slot leaves it claimed, such claims can be taken over once they time out
+static bool _isClaimActive(uint64_t claim, uint32_t now)
+{
+	return claim != 0 && (int32_t)(now - (uint32_t)claim) < (int32_t)SHARED_CACHE_CLAIM_TIMEOUT;
+}
+
+static void _getArchiveId(const uint8_t* archiveHash, uint64_t& id0, uint64_t& id1)
+{
+	memcpy(&id0, archiveHash, sizeof(uint64_t));
+	memcpy(&id1, archiveHash + 8, sizeof(uint64_t));
+}
+
+ZArchiveSharedCache* ZArchiveSharedCache::Open(const char* name, uint64_t size, uint32_t slotSize)
+{
+#ifdef ZARCHIVE_HAS_SHM
+	if (slotSize == 0)
+		return nullptr;
+	std::string shmName = name;
+	if (shmName.empty() || shmName.front() != '/')
+		shmName.insert(shmName.begin(), '/');
+	bool isCreator = true;
+	int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		isCreator = false;
+		fd = shm_open(shmName.c_str(), O_RDWR, 0600);
+	}
+	if (fd < 0)
+		return nullptr;
+	uint64_t mappingSize;
+	uint64_t setCount = std::max<uint64_t>(size / (slotSize + sizeof(SlotHeader)) / SHARED_CACHE_WAYS, 1);
+	if (isCreator)
+	{
+		uint64_t dataOffset = _alignUp(sizeof(SegmentHeader) + setCount * SHARED_CACHE_WAYS * sizeof(SlotHeader), SHARED_CACHE_DATA_ALIGNMENT);
+		mappingSize = dataOffset + setCount * SHARED_CACHE_WAYS * slotSize;
+		if (ftruncate(fd, (off_t)mappingSize) != 0)
+		{
+			close(fd);
+			shm_unlink(shmName.c_str());
+			return nullptr;
+		}
+	}
+	else
+	{
+		// wait until the creator has sized the segment
+		struct stat st;
+		for (int i = 0; i < 1000; i++)
+		{
+			if (fstat(fd, &st) != 0 || st.st_size >= (off_t)sizeof(SegmentHeader))
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SegmentHeader))
+		{
+			close(fd);
+			return nullptr;
+		}
+		mappingSize = (uint64_t)st.st_size;
+	}
+	void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return nullptr;
+	SegmentHeader* header = (SegmentHeader*)mapping;
+	if (isCreator)
+		InitSegment(header, slotSize, setCount);
+	else
+	{
+		for (int i = 0; i < 1000 && header->state.load(std::memory_order_acquire) != SegmentHeader::kStateReady; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		bool isValid = header->state.load(std::memory_order_acquire) == SegmentHeader::kStateReady &&
+			header->magic == SegmentHeader::kMagic && header->version == SegmentHeader::kVersion3 &&
+			header->slotSize == slotSize && header->ways != 0 && header->setCount != 0 &&
+			_alignUp(sizeof(SegmentHeader) + header->setCount * header->ways * sizeof(SlotHeader), SHARED_CACHE_DATA_ALIGNMENT) + header->setCount * header->ways * slotSize <= mappingSize;
+		if (!isValid)
+		{
+			munmap(mapping, mappingSize);
+			return nullptr;
+		}
+	}
+	return new ZArchiveSharedCache(mapping, mappingSize, false);
+#else
+	return nullptr;
+#endif
+}
+
+ZArchiveSharedCache* ZArchiveSharedCache::CreatePrivate(uint64_t size, uint32_t slotSize)
+{
+	if (slotSize == 0)
+		return nullptr;
+	uint64_t setCount = std::max<uint64_t>(size / (slotSize + sizeof(SlotHeader)) / SHARED_CACHE_WAYS, 1);
+	uint64_t dataOffset = _alignUp(sizeof(SegmentHeader) + setCount * SHARED_CACHE_WAYS * sizeof(SlotHeader), SHARED_CACHE_DATA_ALIGNMENT);
+	uint64_t mappingSize = dataOffset + setCount * SHARED_CACHE_WAYS * slotSize;
+	void* mapping = ::operator new((size_t)mappingSize, std::align_val_t(SHARED_CACHE_DATA_ALIGNMENT), std::nothrow);
+	if (!mapping)
+		return nullptr;
+	memset(mapping, 0, (size_t)mappingSize);
+	InitSegment((SegmentHeader*)mapping, slotSize, setCount);
+	return new ZArchiveSharedCache(mapping, mappingSize, true);
+}
+
+// the segment has to be zero-filled, which marks every slot as empty
+void ZArchiveSharedCache::InitSegment(SegmentHeader* header, uint32_t slotSize, uint64_t setCount)
+{
+	header->magic = SegmentHeader::kMagic;
+	header->version = SegmentHeader::kVersion3;
+	header->slotSize = slotSize;
+	header->ways = SHARED_CACHE_WAYS;
+	header->setCount = setCount;
+	header->state.store(SegmentHeader::kStateReady, std::memory_order_release);
+}
+
+bool ZArchiveSharedCache::Remove(const char* name)
+{
+#ifdef ZARCHIVE_HAS_SHM
+	std::string shmName = name;
+	if (shmName.empty() || shmName.front() != '/')
+		shmName.insert(shmName.begin(), '/');
+	return shm_unlink(shmName.c_str()) == 0;
+#else
+	return false;
+#endif
+}
+
+ZArchiveSharedCache::ZArchiveSharedCache(void* mapping, uint64_t mappingSize, bool isPrivate) : m_mapping(mapping), m_mappingSize(mappingSize), m_isPrivate(isPrivate)
+{
+	m_header = (SegmentHeader*)mapping;
+	m_slotSize = m_header->slotSize;
+	m_ways = m_header->ways;
+	m_setCount = m_header->setCount;
+	m_dataOffset = _alignUp(sizeof(SegmentHeader) + m_setCount * m_ways * sizeof(SlotHeader), SHARED_CACHE_DATA_ALIGNMENT);
+}
+
+ZArchiveSharedCache::~ZArchiveSharedCache()
+{
+	if (m_isPrivate)
+	{
+		::operator delete(m_mapping, std::align_val_t(SHARED_CACHE_DATA_ALIGNMENT));
+		return;
+	}
+#ifdef ZARCHIVE_HAS_SHM
+	munmap(m_mapping, m_mappingSize);
+#endif
+}
+
+uint64_t ZArchiveSharedCache::GetSetIndex(uint64_t archiveId0, uint64_t blockIndex) const
+{
+	// archiveId0 is part of a sha256 hash and already well distributed, mix in the block index
+	uint64_t h = archiveId0 ^ (blockIndex * 0x9E3779B97F4A7C15ull);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 32;
+	return h % m_setCount;
+}
+
+ZArchiveSharedCache::SlotHeader* ZArchiveSharedCache::GetSlotHeader(uint64_t slotIndex) const
+{
+	return (SlotHeader*)((uint8_t*)m_mapping + sizeof(SegmentHeader)) + slotIndex;
+}
+
+uint8_t* ZArchiveSharedCache::GetSlotData(uint64_t slotIndex) const
+{
+	return (uint8_t*)m_mapping + m_dataOffset + slotIndex * m_slotSize;
+}
+
+bool ZArchiveSharedCache::ReadBlock(const uint8_t* archiveHash, uint64_t blockIndex, uint8_t* output, uint32_t blockSize)
+{
+	if (blockSize > m_slotSize)
+		return false;
+	uint64_t id0, id1;
+	_getArchiveId(archiveHash, id0, id1);
+	uint64_t firstSlot = GetSetIndex(id0, blockIndex) * m_ways;
+	for (uint32_t i = 0; i < m_ways; i++)
+	{
+		SlotHeader* slot = GetSlotHeader(firstSlot + i);
+		uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+		if ((sequence & 1) != 0)
+			continue; // being written
+		if (slot->key[0].load(std::memory_order_relaxed) != id0 || slot->key[1].load(std::memory_order_relaxed) != id1 ||
+			slot->key[2].load(std::memory_order_relaxed) != blockIndex + 1 || slot->dataSize.load(std::memory_order_relaxed) != blockSize)
+			continue;
+		memcpy(output, GetSlotData(firstSlot + i), blockSize);
+		// the copy is only valid if no writer touched the slot in the meantime
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->sequence.load(std::memory_order_relaxed) != sequence)
+			return false;
+		slot->lastUse.store(m_header->useClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void ZArchiveSharedCache::WriteBlock(const uint8_t* archiveHash, uint64_t blockIndex, const uint8_t* data, uint32_t blockSize)
+{
+	if (blockSize > m_slotSize)
+		return;
+	uint64_t id0, id1;
+	_getArchiveId(archiveHash, id0, id1);
+	uint64_t firstSlot = GetSetIndex(id0, blockIndex) * m_ways;
+	// replace the least recently used slot of the set, unless another process already stored the block
+	// slots which are being written are skipped, unless their claim timed out
+	uint32_t token = _getProcessToken();
+	uint32_t now = _getClockSeconds();
+	SlotHeader* victim = nullptr;
+	uint64_t victimSlot = 0;
+	uint64_t victimLastUse = UINT64_MAX;
+	uint64_t victimClaim = 0;
+	for (uint32_t i = 0; i < m_ways; i++)
+	{
+		SlotHeader* slot = GetSlotHeader(firstSlot + i);
+		uint64_t claim = slot->claim.load(std::memory_order_relaxed);
+		if (claim != 0 && ((claim >> 32) == token || _isClaimActive(claim, now)))
+			continue;
+		if ((slot->sequence.load(std::memory_order_relaxed) & 1) == 0 &&
+			slot->key[0].load(std::memory_order_relaxed) == id0 && slot->key[1].load(std::memory_order_relaxed) == id1 && slot->key[2].load(std::memory_order_relaxed) == blockIndex + 1)
+			return;
+		uint64_t lastUse = slot->key[2].load(std::memory_order_relaxed) == 0 ? 0 : slot->lastUse.load(std::memory_order_relaxed);
+		if (lastUse < victimLastUse)
+		{
+			victim = slot;
+			victimSlot = firstSlot + i;
+			victimLastUse = lastUse;
+			victimClaim = claim;
+		}
+	}
+	uint64_t claim = ((uint64_t)token << 32) | now;
+	if (!victim || !victim->claim.compare_exchange_strong(victimClaim, claim, std::memory_order_acquire))
+		return; // another writer is using the slot, skip caching rather than waiting
+	// the sequence is still odd if the previous owner abandoned the slot while writing. It moves on to a new odd value either way, so a stalled owner can no longer publish its write
+	uint64_t sequence = victim->sequence.load(std::memory_order_relaxed);
+	sequence += 1 + (sequence & 1);
+	victim->sequence.store(sequence, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	victim->key[0].store(id0, std::memory_order_relaxed);
+	victim->key[1].store(id1, std::memory_order_relaxed);
+	victim->key[2].store(blockIndex + 1, std::memory_order_relaxed);
+	victim->dataSize.store(blockSize, std::memory_order_relaxed);
+	uint8_t* slotData = GetSlotData(victimSlot);
+	for (uint32_t offset = 0; offset < blockSize; offset += SHARED_CACHE_COPY_CHUNK)
+	{
+		if (victim->claim.load(std::memory_order_relaxed) != claim)
+			return; // taken over after this writer stalled for longer than the timeout
+		memcpy(slotData + offset, data + offset, std::min(blockSize - offset, SHARED_CACHE_COPY_CHUNK));
+	}
+	victim->lastUse.store(m_header->useClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (!victim->sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_release, std::memory_order_relaxed))
+		return;
+	victim->claim.compare_exchange_strong(claim, 0, std::memory_order_release, std::memory_order_relaxed);
+}
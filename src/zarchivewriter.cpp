@@ -1,4 +1,5 @@
 #include "zarchive/zarchivewriter.h"
+#include "zarchive/zarchivereader.h"
 #include "zarchive/zarchivecommon.h"
 
 #include <string>
@@ -11,22 +12,287 @@
 
 #include <cassert>
 #include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+static uint64_t _getTimestampNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 ZArchiveWriter::ZArchiveWriter(CB_NewOutputFile cbNewOutputFile, CB_WriteOutputData cbWriteOutputData, void* ctx) : m_cbCtx(ctx), m_cbNewOutputFile(cbNewOutputFile), m_cbWriteOutputData(cbWriteOutputData)
 {
 	cbNewOutputFile(-1, ctx);
 	m_mainShaCtx = (struct Sha_256*)malloc(sizeof(struct Sha_256));
 	sha_256_init(m_mainShaCtx, m_integritySha);
+	m_zstdCCtx = ZSTD_createCCtx();
+	m_creationTime = _getTimestampNs();
+	m_formatVersion = _ZARCHIVE::Footer::kVersion1;
+	m_blockSize = _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
+	// root node
+	m_nodeChunks.emplace_back(new PathNode[NODES_PER_CHUNK]);
+	m_nodeCount = 1;
 };
 
 ZArchiveWriter::~ZArchiveWriter()
 {
+	StopAsyncOutput();
 	free(m_mainShaCtx);
+	ZSTD_freeCCtx(m_zstdCCtx);
+	for (auto& it : m_zstdCCtxPool)
+		ZSTD_freeCCtx(it);
+	for (auto& it : m_pendingFiles)
+		delete it;
+}
+
+bool ZArchiveWriter::SetBlockSize(uint32_t blockSize)
+{
+	if (!_ZARCHIVE::IsValidBlockSize(blockSize))
+		return false;
+	if (m_currentInputOffset != 0)
+		return false; // cannot be changed once data was written
+	if (m_delta.isEnabled && blockSize != m_blockSize)
+		return false; // must match the base archive
+	m_blockSize = blockSize;
+	UpdateFormatVersion();
+	return true;
+}
+
+bool ZArchiveWriter::SetZeroBlockElision(bool enable)
+{
+	if (m_currentInputOffset != 0)
+		return false;
+	m_elideZeroBlocks = enable;
+	UpdateFormatVersion();
+	return true;
+}
+
+bool ZArchiveWriter::SetDeltaBase(ZArchiveReader* baseReader)
+{
+	if (m_currentInputOffset != 0 || baseReader->GetBlockSize() != m_blockSize)
+		return false;
+	// index the content of every block in the base. Only the first 2^31 blocks can be referenced
+	uint64_t blockCount = std::min<uint64_t>(baseReader->GetBlockCount(), _ZARCHIVE::BASE_BLOCK_FLAG);
+	std::vector<uint8_t> storedData;
+	std::vector<uint32_t> storedSizes;
+	std::vector<uint8_t> blockData(m_blockSize);
+	ZSTD_DCtx* zstdDCtx = ZSTD_createDCtx();
+	std::unordered_map<std::array<uint8_t, 32>, uint32_t, ContentHashFunc> blockLookup;
+	bool isSuccess = true;
+	for (uint64_t blockIndex = 0; blockIndex < blockCount; blockIndex++)
+	{
+		if (!baseReader->ReadStoredBlocks(blockIndex, 1, storedData, storedSizes))
+		{
+			isSuccess = false;
+			break;
+		}
+		uint32_t storedSize = storedSizes[0];
+		if (storedSize == 0)
+			memset(blockData.data(), 0, m_blockSize);
+		else if (storedSize == m_blockSize)
+			memcpy(blockData.data(), storedData.data(), m_blockSize);
+		else if (ZSTD_decompressDCtx(zstdDCtx, blockData.data(), m_blockSize, storedData.data(), storedSize) != m_blockSize)
+		{
+			isSuccess = false;
+			break;
+		}
+		std::array<uint8_t, 32> blockHash;
+		calc_sha_256(blockHash.data(), blockData.data(), m_blockSize);
+		blockLookup.try_emplace(blockHash, (uint32_t)blockIndex);
+	}
+	ZSTD_freeDCtx(zstdDCtx);
+	if (!isSuccess)
+		return false;
+	m_delta.isEnabled = true;
+	memcpy(m_delta.baseIntegrityHash, baseReader->GetIntegrityHash(), 32);
+	m_delta.blockLookup = std::move(blockLookup);
+	UpdateFormatVersion();
+	return true;
+}
+
+static uint8_t* _allocateAlignedBuffer(std::vector<uint8_t>& storage, size_t size, size_t alignment)
+{
+	storage.resize(size + alignment - 1);
+	return storage.data() + ((alignment - ((uintptr_t)storage.data() % alignment)) % alignment);
+}
+
+bool ZArchiveWriter::SetOutputBufferSize(size_t size)
+{
+	if ((size % OUTPUT_BUFFER_ALIGNMENT) != 0)
+		return false;
+	std::unique_lock _l(m_mutex);
+	if (m_asyncOutput.isEnabled)
+		return false;
+	FlushOutputBuffer();
+	m_outputBufferSize = size;
+	if (size == 0)
+	{
+		m_outputBufferStorage = std::vector<uint8_t>();
+		m_outputBuffer = nullptr;
+		return true;
+	}
+	m_outputBuffer = _allocateAlignedBuffer(m_outputBufferStorage, size, OUTPUT_BUFFER_ALIGNMENT);
+	return true;
+}
+
+bool ZArchiveWriter::EnableAsyncOutput(uint32_t bufferCount)
+{
+	std::unique_lock _l(m_mutex);
+	if (m_asyncOutput.isEnabled || m_outputBufferSize == 0 || bufferCount < 2)
+		return false;
+	FlushOutputBuffer();
+	m_asyncOutput.storage.resize(bufferCount);
+	for (auto& it : m_asyncOutput.storage)
+		m_asyncOutput.freeBuffers.emplace_back(_allocateAlignedBuffer(it, m_outputBufferSize, OUTPUT_BUFFER_ALIGNMENT));
+	m_outputBuffer = m_asyncOutput.freeBuffers.back();
+	m_asyncOutput.freeBuffers.pop_back();
+	m_outputBufferStorage = std::vector<uint8_t>();
+	m_asyncOutput.isEnabled = true;
+	m_asyncOutput.thread = std::thread(&ZArchiveWriter::AsyncOutputWorker, this);
+	return true;
+}
+
+bool ZArchiveWriter::SetSplitSize(uint64_t partSize)
+{
+	std::unique_lock _l(m_mutex);
+	if (m_currentCompressedWriteIndex != 0)
+		return false;
+	m_split.partSize = partSize;
+	return true;
+}
+
+// passes data to the output callback and starts a new part whenever the current one is full
+void ZArchiveWriter::WriteOutputParts(const uint8_t* data, size_t length)
+{
+	uint64_t outputStartTime = _getTimestampNs();
+	size_t totalLength = length;
+	if (m_split.partSize == 0)
+		m_cbWriteOutputData(data, length, m_cbCtx);
+	while (m_split.partSize != 0 && length > 0)
+	{
+		if (m_split.partOffset == m_split.partSize)
+		{
+			// new parts are only created once there is data for them
+			m_split.partIndex++;
+			m_cbNewOutputFile(m_split.partIndex, m_cbCtx);
+			m_split.partOffset = 0;
+		}
+		size_t bytesToWrite = (size_t)std::min<uint64_t>(length, m_split.partSize - m_split.partOffset);
+		m_cbWriteOutputData(data, bytesToWrite, m_cbCtx);
+		m_split.partOffset += bytesToWrite;
+		data += bytesToWrite;
+		length -= bytesToWrite;
+	}
+	if (m_adaptiveCompression.isEnabled && totalLength != 0)
+		UpdateSinkCost(totalLength, _getTimestampNs() - outputStartTime);
+}
+
+// keeps a moving average of the time the output callback needs per byte. Writes can be delayed by buffering and happen on the output thread, so the adaptive level compares against this instead of the time spent writing within a window
+void ZArchiveWriter::UpdateSinkCost(size_t length, uint64_t outputTime)
+{
+	const double averagingSize = 4.0 * 1024 * 1024;
+	double sample = (double)outputTime / (double)length;
+	double average = m_adaptiveCompression.sinkNsPerByte.load(std::memory_order_relaxed);
+	if (average < 0.0)
+		average = sample;
+	else
+		average += (sample - average) * std::min(1.0, (double)length / averagingSize);
+	m_adaptiveCompression.sinkNsPerByte.store(average, std::memory_order_relaxed);
+}
+
+void ZArchiveWriter::AsyncOutputWorker()
+{
+	std::unique_lock _l(m_asyncOutput.mutex);
+	while (true)
+	{
+		m_asyncOutput.bufferQueued.wait(_l, [this]() { return !m_asyncOutput.queuedBuffers.empty() || m_asyncOutput.stop; });
+		if (m_asyncOutput.queuedBuffers.empty())
+			break;
+		auto [buffer, size] = m_asyncOutput.queuedBuffers.front();
+		m_asyncOutput.queuedBuffers.pop_front();
+		_l.unlock();
+		WriteOutputParts(buffer, size);
+		_l.lock();
+		m_asyncOutput.freeBuffers.emplace_back(buffer);
+		m_asyncOutput.bufferReleased.notify_all();
+	}
+}
+
+// writes all queued chunks and ends the output thread
+void ZArchiveWriter::StopAsyncOutput()
+{
+	if (!m_asyncOutput.isEnabled)
+		return;
+	{
+		std::unique_lock _l(m_asyncOutput.mutex);
+		m_asyncOutput.stop = true;
+	}
+	m_asyncOutput.bufferQueued.notify_all();
+	m_asyncOutput.thread.join();
+	m_asyncOutput.isEnabled = false;
+}
+
+void ZArchiveWriter::SetDeduplication(bool enable, uint64_t maxFileSize)
+{
+	m_dedup.isEnabled = enable;
+	m_dedup.maxFileSize = maxFileSize;
+}
+
+ZArchiveWriter::Stats ZArchiveWriter::GetStats() const
+{
+	Stats stats = m_stats;
+	stats.uncompressedBytes = m_currentInputOffset;
+	stats.compressedBytes = m_currentCompressedWriteIndex;
+	stats.blockCount = m_numWrittenOffsetRecords;
+	stats.elapsedTime = _getTimestampNs() - m_creationTime;
+	stats.compressionLevel = m_compressionLevel;
+	return stats;
+}
+
+void ZArchiveWriter::SetProgressCallback(CB_Progress cbProgress, void* ctx, uint64_t interval)
+{
+	m_cbProgress = cbProgress;
+	m_cbProgressCtx = ctx;
+	m_progressInterval = std::max<uint64_t>(interval, 1);
+	m_nextProgressReport = m_currentInputOffset + m_progressInterval;
+}
+
+void ZArchiveWriter::ReportProgress()
+{
+	if (!m_cbProgress)
+		return;
+	m_nextProgressReport = m_currentInputOffset + m_progressInterval;
+	m_cbProgress(GetStats(), m_cbProgressCtx);
+}
+
+void ZArchiveWriter::UpdateFormatVersion()
+{
+	// only use version 2 if any of its features are used, so that the output stays readable by version 1 readers otherwise
+	if (m_blockSize != _ZARCHIVE::COMPRESSED_BLOCK_SIZE || m_elideZeroBlocks || m_delta.isEnabled)
+		m_formatVersion = _ZARCHIVE::Footer::kVersion2;
+	else
+		m_formatVersion = _ZARCHIVE::Footer::kVersion1;
+}
+
+void ZArchiveWriter::SetCompressionLevel(int level)
+{
+	m_compressionLevel = std::clamp(level, ZSTD_minCLevel(), ZSTD_maxCLevel());
+	m_adaptiveCompression.isEnabled = false;
+}
+
+void ZArchiveWriter::EnableAdaptiveCompression(int minLevel, int maxLevel)
+{
+	minLevel = std::clamp(minLevel, 1, ZSTD_maxCLevel());
+	maxLevel = std::clamp(maxLevel, minLevel, ZSTD_maxCLevel());
+	m_adaptiveCompression.isEnabled = true;
+	m_adaptiveCompression.minLevel = minLevel;
+	m_adaptiveCompression.maxLevel = maxLevel;
+	m_compressionLevel = std::clamp(m_compressionLevel, minLevel, maxLevel);
 }
 
 ZArchiveWriter::PathNode* ZArchiveWriter::GetNodeByPath(ZArchiveWriter::PathNode* root, std::string_view path)
 {
-	PathNode* currentNode = &m_rootNode;
+	PathNode* currentNode = root;
 
 	std::string_view pathParser = path;
 	while (true)
@@ -44,35 +310,100 @@ ZArchiveWriter::PathNode* ZArchiveWriter::GetNodeByPath(ZArchiveWriter::PathNode
 
 ZArchiveWriter::PathNode* ZArchiveWriter::FindSubnodeByName(ZArchiveWriter::PathNode* parent, std::string_view nodeName)
 {
-	for (auto& it : parent->subnodes)
+	if (parent->subnodeLookupIndex != INVALID_NODE_INDEX)
 	{
-		std::string_view itName = m_nodeNames[it->nameIndex];
-		if (_ZARCHIVE::CompareNodeNameBool(itName, nodeName))
-			return it;
+		SubnodeLookup& lookup = *m_subnodeLookups[parent->subnodeLookupIndex];
+		auto it = lookup.find(nodeName);
+		return it != lookup.end() ? &GetNode(it->second) : nullptr;
+	}
+	for (uint32_t nodeIndex = parent->firstSubnode; nodeIndex != INVALID_NODE_INDEX;)
+	{
+		PathNode& node = GetNode(nodeIndex);
+		if (_ZARCHIVE::CompareNodeNameBool(m_nodeNames[node.nameIndex], nodeName))
+			return &node;
+		nodeIndex = node.nextSibling;
 	}
 	return nullptr;
 }
 
-bool ZArchiveWriter::StartNewFile(const char* path)
+ZArchiveWriter::PathNode* ZArchiveWriter::AddSubnode(ZArchiveWriter::PathNode* parent, bool isFile, std::string_view name)
 {
-	m_currentFileNode = nullptr;
+	if ((m_nodeCount % NODES_PER_CHUNK) == 0)
+		m_nodeChunks.emplace_back(new PathNode[NODES_PER_CHUNK]);
+	uint32_t nodeIndex = m_nodeCount++;
+	PathNode& node = GetNode(nodeIndex);
+	node = PathNode(isFile, CreateNameEntry(name));
+	node.nextSibling = parent->firstSubnode;
+	parent->firstSubnode = nodeIndex;
+	parent->subnodeCount++;
+	if (parent->subnodeLookupIndex != INVALID_NODE_INDEX)
+	{
+		m_subnodeLookups[parent->subnodeLookupIndex]->emplace(m_nodeNames[node.nameIndex], nodeIndex);
+	}
+	else if (parent->subnodeCount > SUBNODE_LOOKUP_THRESHOLD)
+	{
+		// directory became too large for linear search, index all of its entries
+		parent->subnodeLookupIndex = (uint32_t)m_subnodeLookups.size();
+		SubnodeLookup& lookup = *m_subnodeLookups.emplace_back(new SubnodeLookup());
+		for (uint32_t it = parent->firstSubnode; it != INVALID_NODE_INDEX; it = GetNode(it).nextSibling)
+			lookup.emplace(m_nodeNames[GetNode(it).nameIndex], it);
+	}
+	return &node;
+}
+
+bool ZArchiveWriter::StartNewFile(const char* path, bool blockAligned)
+{
+	std::unique_lock _l(m_mutex);
+	CloseCurrentFile();
 	std::string_view pathParser = path;
 	std::string_view filename;
 	_ZARCHIVE::SplitFilenameFromPath(pathParser, filename);
-	PathNode* dir = GetNodeByPath(&m_rootNode, pathParser);
+	PathNode* dir = GetNodeByPath(&GetNode(0), pathParser);
 	if (!dir)
 		return false;
 	if (FindSubnodeByName(dir, filename))
 		return false;
+	if (blockAligned)
+		PadToBlockBoundary();
 	// add new entry and make it the currently active file for append operations
-	PathNode*& r = dir->subnodes.emplace_back(new PathNode(true, CreateNameEntry(filename)));
-	m_currentFileNode = r;
-	r->fileOffset = m_currentInputOffset;
+	m_currentFileNode = AddSubnode(dir, true, filename);
+	m_currentFileNode->fileOffset = m_currentInputOffset;
+	m_dedup.isBuffering = m_dedup.isEnabled;
 	return true;
 }
 
+void ZArchiveWriter::CloseCurrentFile()
+{
+	if (m_currentFileNode && m_dedup.isBuffering)
+	{
+		m_dedup.isBuffering = false;
+		if (!m_dedup.pendingData.empty())
+		{
+			std::array<uint8_t, 32> contentHash;
+			uint64_t hashStartTime = _getTimestampNs();
+			calc_sha_256(contentHash.data(), m_dedup.pendingData.data(), m_dedup.pendingData.size());
+			m_stats.hashTime += (_getTimestampNs() - hashStartTime);
+			auto it = m_dedup.contentLookup.find(contentHash);
+			if (it != m_dedup.contentLookup.end() && it->second->fileSize == m_currentFileNode->fileSize)
+			{
+				// duplicate, drop the pending data and reference the existing range instead
+				m_currentFileNode->fileOffset = it->second->fileOffset;
+			}
+			else
+			{
+				m_dedup.contentLookup.emplace(contentHash, m_currentFileNode);
+				WriteStreamData(m_dedup.pendingData.data(), m_dedup.pendingData.size());
+			}
+			m_dedup.pendingData.clear();
+		}
+	}
+	m_currentFileNode = nullptr;
+	CommitPendingFiles();
+}
+
 bool ZArchiveWriter::MakeDir(const char* path, bool recursive)
 {
+	std::unique_lock _l(m_mutex);
 	std::string_view pathParser = path;
 	while (!pathParser.empty() && (pathParser.back() == '/' || pathParser.back() == '\\'))
 		pathParser.remove_suffix(1);
@@ -80,53 +411,127 @@ bool ZArchiveWriter::MakeDir(const char* path, bool recursive)
 	{
 		std::string_view dirName;
 		_ZARCHIVE::SplitFilenameFromPath(pathParser, dirName);
-		PathNode* dir = GetNodeByPath(&m_rootNode, pathParser);
+		PathNode* dir = GetNodeByPath(&GetNode(0), pathParser);
 		if (!dir)
 			return false;
 		if (FindSubnodeByName(dir, dirName))
 			return false;
-		dir->subnodes.emplace_back(new PathNode(false, CreateNameEntry(dirName)));
+		AddSubnode(dir, false, dirName);
 	}
 	else
 	{
-		PathNode* currentNode = &m_rootNode;
-		while (true)
-		{
-			std::string_view nodeName;
-			if (!_ZARCHIVE::GetNextPathNode(pathParser, nodeName))
-				break;
-			PathNode* nextSubnode = FindSubnodeByName(currentNode, nodeName);
-			if (nextSubnode && nextSubnode->isFile)
-				return false;
-			if (!nextSubnode)
-			{
-				PathNode*& r = currentNode->subnodes.emplace_back(new PathNode(false, CreateNameEntry(nodeName)));
-				nextSubnode = r;
-			}
-			currentNode = nextSubnode;
-		}
+		if (!MakeDirRecursive(pathParser))
+			return false;
 	}
 	return true;
 }
 
+// returns the directory at path, creating any missing directories along the way
+ZArchiveWriter::PathNode* ZArchiveWriter::MakeDirRecursive(std::string_view path)
+{
+	PathNode* currentNode = &GetNode(0);
+	while (true)
+	{
+		std::string_view nodeName;
+		if (!_ZARCHIVE::GetNextPathNode(path, nodeName))
+			break;
+		PathNode* nextSubnode = FindSubnodeByName(currentNode, nodeName);
+		if (nextSubnode && nextSubnode->isFile)
+			return nullptr;
+		if (!nextSubnode)
+			nextSubnode = AddSubnode(currentNode, false, nodeName);
+		currentNode = nextSubnode;
+	}
+	return currentNode;
+}
+
 uint32_t ZArchiveWriter::CreateNameEntry(std::string_view name)
 {
-	auto it = m_nodeNameLookup.find(std::string(name));
-	if (it != m_nodeNameLookup.end())
-		return it->second;
+	if ((m_nodeNames.size() + 1) * 2 > m_nodeNameTable.size())
+		GrowNameTable();
+	size_t slotMask = m_nodeNameTable.size() - 1;
+	size_t slot = std::hash<std::string_view>()(name) & slotMask;
+	while (m_nodeNameTable[slot] != INVALID_NODE_INDEX)
+	{
+		if (m_nodeNames[m_nodeNameTable[slot]] == name)
+			return m_nodeNameTable[slot];
+		slot = (slot + 1) & slotMask;
+	}
+	// copy the name into the name arena. Names which don't fit into the current chunk start a new one, oversized names get a chunk of their own
+	if (m_nameChunkUsed + name.size() > NAME_CHUNK_SIZE)
+	{
+		m_nameChunks.emplace_back(new char[std::max(name.size(), NAME_CHUNK_SIZE)]);
+		m_nameChunkUsed = 0;
+	}
+	char* nameData = m_nameChunks.back().get() + m_nameChunkUsed;
+	memcpy(nameData, name.data(), name.size());
+	m_nameChunkUsed += name.size();
 	uint32_t nameIndex = (uint32_t)m_nodeNames.size();
-	m_nodeNames.emplace_back(name);
-	m_nodeNameLookup.emplace(name, nameIndex);
+	m_nodeNames.emplace_back(nameData, name.size());
+	m_nodeNameTable[slot] = nameIndex;
 	return nameIndex;
 }
 
+void ZArchiveWriter::GrowNameTable()
+{
+	m_nodeNameTable.assign(std::max<size_t>(m_nodeNameTable.size() * 2, 1024), INVALID_NODE_INDEX);
+	size_t slotMask = m_nodeNameTable.size() - 1;
+	for (uint32_t i = 0; i < (uint32_t)m_nodeNames.size(); i++)
+	{
+		size_t slot = std::hash<std::string_view>()(m_nodeNames[i]) & slotMask;
+		while (m_nodeNameTable[slot] != INVALID_NODE_INDEX)
+			slot = (slot + 1) & slotMask;
+		m_nodeNameTable[slot] = i;
+	}
+}
+
 void ZArchiveWriter::OutputData(const void* data, size_t length)
 {
-	m_cbWriteOutputData(data, length, m_cbCtx);
-	m_currentCompressedWriteIndex += length;
 	// hash the data
+	uint64_t hashStartTime = _getTimestampNs();
 	if (m_mainShaCtx)
 		sha_256_write(m_mainShaCtx, data, length);
+	m_stats.hashTime += (_getTimestampNs() - hashStartTime);
+	m_currentCompressedWriteIndex += length;
+	if (m_outputBufferSize == 0)
+	{
+		uint64_t outputStartTime = _getTimestampNs();
+		WriteOutputParts((const uint8_t*)data, length);
+		m_stats.outputTime += (_getTimestampNs() - outputStartTime);
+		return;
+	}
+	const uint8_t* input = (const uint8_t*)data;
+	while (length > 0)
+	{
+		size_t bytesToCopy = std::min(m_outputBufferSize - m_outputBufferUsed, length);
+		memcpy(m_outputBuffer + m_outputBufferUsed, input, bytesToCopy);
+		m_outputBufferUsed += bytesToCopy;
+		input += bytesToCopy;
+		length -= bytesToCopy;
+		if (m_outputBufferUsed == m_outputBufferSize)
+			FlushOutputBuffer();
+	}
+}
+
+void ZArchiveWriter::FlushOutputBuffer()
+{
+	if (m_outputBufferUsed == 0)
+		return;
+	uint64_t outputStartTime = _getTimestampNs();
+	if (m_asyncOutput.isEnabled)
+	{
+		// hand the chunk to the output thread and continue with a free buffer. If there is none, the output is the bottleneck and we have to wait
+		std::unique_lock _l(m_asyncOutput.mutex);
+		m_asyncOutput.queuedBuffers.emplace_back(m_outputBuffer, m_outputBufferUsed);
+		m_asyncOutput.bufferQueued.notify_one();
+		m_asyncOutput.bufferReleased.wait(_l, [this]() { return !m_asyncOutput.freeBuffers.empty(); });
+		m_outputBuffer = m_asyncOutput.freeBuffers.back();
+		m_asyncOutput.freeBuffers.pop_back();
+	}
+	else
+		WriteOutputParts(m_outputBuffer, m_outputBufferUsed);
+	m_stats.outputTime += (_getTimestampNs() - outputStartTime);
+	m_outputBufferUsed = 0;
 }
 
 uint64_t ZArchiveWriter::GetCurrentOutputOffset() const
@@ -136,38 +541,706 @@ uint64_t ZArchiveWriter::GetCurrentOutputOffset() const
 
 void ZArchiveWriter::StoreBlock(const uint8_t* uncompressedData)
 {
-	// compress and store
 	uint64_t compressedWriteOffset = GetCurrentOutputOffset();
-	m_compressionBuffer.resize(ZSTD_compressBound(_ZARCHIVE::COMPRESSED_BLOCK_SIZE));
-	size_t outputSize = ZSTD_compress(m_compressionBuffer.data(), m_compressionBuffer.size(), uncompressedData, _ZARCHIVE::COMPRESSED_BLOCK_SIZE, 6);
-	assert(outputSize >= 0);
-	if (outputSize >= _ZARCHIVE::COMPRESSED_BLOCK_SIZE)
+	uint64_t compressTime = 0;
+	m_compressionBuffer.clear();
+	uint32_t storedSize = EncodeBlock(m_zstdCCtx, m_compressionLevel, uncompressedData, m_compressionBuffer, compressTime);
+	m_stats.compressTime += compressTime;
+	if (_ZARCHIVE::GetStoredDataSize(storedSize) == 0)
+	{
+		AddOffsetRecordEntry(compressedWriteOffset, storedSize);
+		return;
+	}
+	if (storedSize == m_blockSize)
+		OutputData(uncompressedData, m_blockSize);
+	else
+		OutputData(m_compressionBuffer.data(), storedSize);
+	if (m_adaptiveCompression.isEnabled)
+	{
+		m_adaptiveCompression.windowCompressTime += compressTime;
+		m_adaptiveCompression.windowInputSize += m_blockSize;
+		m_adaptiveCompression.windowOutputSize += storedSize;
+		UpdateAdaptiveCompression();
+	}
+	AddOffsetRecordEntry(compressedWriteOffset, storedSize);
+}
+
+// returns the size the block is stored with: 0 for an elided all-zero block, a base block reference for delta archives, the block size if it is stored uncompressed (output is left untouched)
+// or the compressed size, in which case the compressed data is appended to output
+uint32_t ZArchiveWriter::EncodeBlock(ZSTD_CCtx_s* zstdCCtx, int compressionLevel, const uint8_t* uncompressedData, std::vector<uint8_t>& output, uint64_t& compressTime) const
+{
+	if (m_elideZeroBlocks && _ZARCHIVE::IsZeroData(uncompressedData, m_blockSize))
+		return 0;
+	if (m_delta.isEnabled)
+	{
+		uint64_t hashStartTime = _getTimestampNs();
+		std::array<uint8_t, 32> blockHash;
+		calc_sha_256(blockHash.data(), uncompressedData, m_blockSize);
+		compressTime += (_getTimestampNs() - hashStartTime);
+		auto it = m_delta.blockLookup.find(blockHash);
+		if (it != m_delta.blockLookup.end())
+			return _ZARCHIVE::BASE_BLOCK_FLAG | it->second;
+	}
+	size_t outputOffset = output.size();
+	output.resize(outputOffset + ZSTD_compressBound(m_blockSize));
+	uint64_t compressStartTime = _getTimestampNs();
+	size_t outputSize = ZSTD_compressCCtx(zstdCCtx, output.data() + outputOffset, output.size() - outputOffset, uncompressedData, m_blockSize, compressionLevel);
+	compressTime += (_getTimestampNs() - compressStartTime);
+	if (ZSTD_isError(outputSize) || outputSize >= m_blockSize)
 	{
 		// store block uncompressed if it is equal or larger than the input after compression
-		outputSize = _ZARCHIVE::COMPRESSED_BLOCK_SIZE;
-		OutputData(uncompressedData, _ZARCHIVE::COMPRESSED_BLOCK_SIZE);
+		output.resize(outputOffset);
+		return m_blockSize;
+	}
+	output.resize(outputOffset + outputSize);
+	return (uint32_t)outputSize;
+}
+
+ZArchiveWriter::FileWriter* ZArchiveWriter::OpenFile(const char* path)
+{
+	std::unique_lock _l(m_mutex);
+	std::string_view pathParser = path;
+	std::string_view filename;
+	_ZARCHIVE::SplitFilenameFromPath(pathParser, filename);
+	PathNode* dir = GetNodeByPath(&GetNode(0), pathParser);
+	if (!dir)
+		return nullptr;
+	if (FindSubnodeByName(dir, filename))
+		return nullptr;
+	// the node is added right away so that conflicting paths are rejected, its data range is assigned when the file is committed
+	PathNode* fileNode = AddSubnode(dir, true, filename);
+	ZSTD_CCtx_s* zstdCCtx;
+	if (!m_zstdCCtxPool.empty())
+	{
+		zstdCCtx = m_zstdCCtxPool.back();
+		m_zstdCCtxPool.pop_back();
 	}
 	else
+		zstdCCtx = ZSTD_createCCtx();
+	FileWriter* fileWriter = new FileWriter(this, fileNode, zstdCCtx, m_compressionLevel);
+	if (m_dedup.isEnabled)
+	{
+		fileWriter->m_shaCtx = (struct Sha_256*)malloc(sizeof(struct Sha_256));
+		sha_256_init(fileWriter->m_shaCtx, fileWriter->m_contentHash.data());
+	}
+	return fileWriter;
+}
+
+void ZArchiveWriter::CloseFile(FileWriter* fileWriter)
+{
+	// compress the tail outside of the lock
+	if (!fileWriter->m_currentBlock.empty())
+	{
+		fileWriter->m_currentBlock.resize(m_blockSize, 0);
+		fileWriter->EncodeCurrentBlock();
+	}
+	if (fileWriter->m_shaCtx)
+	{
+		uint64_t hashStartTime = _getTimestampNs();
+		sha_256_close(fileWriter->m_shaCtx);
+		fileWriter->m_hashTime += (_getTimestampNs() - hashStartTime);
+	}
+	std::unique_lock _l(m_mutex);
+	m_zstdCCtxPool.emplace_back(fileWriter->m_zstdCCtx);
+	fileWriter->m_zstdCCtx = nullptr;
+	if (m_currentFileNode)
+	{
+		// the data of the active file must stay contiguous, commit once it is closed
+		m_pendingFiles.emplace_back(fileWriter);
+		return;
+	}
+	CommitFile(fileWriter);
+}
+
+void ZArchiveWriter::CommitPendingFiles()
+{
+	for (auto& it : m_pendingFiles)
+		CommitFile(it);
+	m_pendingFiles.clear();
+}
+
+void ZArchiveWriter::CommitFile(FileWriter* fileWriter)
+{
+	PathNode* fileNode = fileWriter->m_fileNode;
+	m_stats.inputCopyTime += fileWriter->m_inputCopyTime;
+	m_stats.compressTime += fileWriter->m_compressTime;
+	m_stats.hashTime += fileWriter->m_hashTime;
+	if (fileWriter->m_shaCtx && fileNode->fileSize != 0)
+	{
+		auto it = m_dedup.contentLookup.find(fileWriter->m_contentHash);
+		if (it != m_dedup.contentLookup.end() && it->second->fileSize == fileNode->fileSize)
+		{
+			fileNode->fileOffset = it->second->fileOffset;
+			delete fileWriter;
+			return;
+		}
+		m_dedup.contentLookup.emplace(fileWriter->m_contentHash, fileNode);
+	}
+	PadToBlockBoundary();
+	fileNode->fileOffset = m_currentInputOffset;
+	uint64_t compressedWriteOffset = GetCurrentOutputOffset();
+	for (uint32_t storedSize : fileWriter->m_encodedSizes)
+	{
+		AddOffsetRecordEntry(compressedWriteOffset, storedSize);
+		compressedWriteOffset += _ZARCHIVE::GetStoredDataSize(storedSize);
+	}
+	OutputData(fileWriter->m_encodedData.data(), fileWriter->m_encodedData.size());
+	m_currentInputOffset += (uint64_t)fileWriter->m_encodedSizes.size() * m_blockSize;
+	delete fileWriter;
+	if (m_cbProgress && m_currentInputOffset >= m_nextProgressReport)
+		ReportProgress();
+}
+
+struct ZArchiveWriter::ArchiveMergeState
+{
+	using Range = std::pair<uint64_t, uint64_t>; // begin and end offset in the uncompressed data stream
+
+	struct BlockRun
+	{
+		uint64_t firstBlockIndex;
+		uint64_t blockCount;
+		uint64_t newOffset; // offset of the first block in this archive
+	};
+
+	ZArchiveReader* reader;
+	CB_SelectNode cbSelectNode;
+	void* ctx;
+	std::unordered_set<uint32_t> selectedNodes; // selected files and directories which contain selected nodes
+	std::vector<Range> selectedRanges;
+	std::vector<Range> scrubRanges; // data of unselected files which must not be copied
+	std::vector<BlockRun> blockRuns;
+
+	uint64_t GetNewOffset(uint64_t offset, uint32_t blockSize) const
+	{
+		uint64_t blockIndex = offset / blockSize;
+		auto it = std::upper_bound(blockRuns.begin(), blockRuns.end(), blockIndex, [](uint64_t blockIndex, const BlockRun& run) { return blockIndex < run.firstBlockIndex; });
+		if (it == blockRuns.begin())
+			return 0;
+		--it;
+		return it->newOffset + (offset - it->firstBlockIndex * blockSize);
+	}
+};
+
+// sorts ranges and merges overlapping ones
+static void _mergeRanges(std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+	std::sort(ranges.begin(), ranges.end());
+	size_t count = 0;
+	for (auto& it : ranges)
+	{
+		if (count > 0 && it.first <= ranges[count - 1].second)
+			ranges[count - 1].second = std::max(ranges[count - 1].second, it.second);
+		else
+			ranges[count++] = it;
+	}
+	ranges.resize(count);
+}
+
+// removes the parts of ranges covered by subtract. Both have to be sorted and merged
+static void _subtractRanges(std::vector<std::pair<uint64_t, uint64_t>>& ranges, const std::vector<std::pair<uint64_t, uint64_t>>& subtract)
+{
+	std::vector<std::pair<uint64_t, uint64_t>> result;
+	size_t subtractIndex = 0;
+	for (auto range : ranges)
+	{
+		while (subtractIndex < subtract.size() && subtract[subtractIndex].second <= range.first)
+			subtractIndex++;
+		for (size_t i = subtractIndex; i < subtract.size() && subtract[i].first < range.second; i++)
+		{
+			if (subtract[i].first > range.first)
+				result.emplace_back(range.first, subtract[i].first);
+			range.first = std::max(range.first, subtract[i].second);
+		}
+		if (range.first < range.second)
+			result.emplace_back(range);
+	}
+	ranges = std::move(result);
+}
+
+bool ZArchiveWriter::AppendArchive(ZArchiveReader* reader, const char* path, CB_SelectNode cbSelectNode, void* ctx)
+{
+	std::unique_lock _l(m_mutex);
+	if (reader->GetBlockSize() != m_blockSize)
+		return false;
+	ZArchiveNodeHandle rootHandle = reader->LookUp("", false, true);
+	if (rootHandle == ZARCHIVE_INVALID_NODE)
+		return false;
+	// the tree is only modified once everything has been checked and copied, so a failed append leaves it as it was
+	// if the target directory does not exist yet nothing in it can conflict
+	PathNode* targetDir = &GetNode(0);
+	std::string_view pathParser = path;
+	std::string_view nodeName;
+	while (targetDir && _ZARCHIVE::GetNextPathNode(pathParser, nodeName))
+	{
+		targetDir = FindSubnodeByName(targetDir, nodeName);
+		if (targetDir && targetDir->isFile)
+			return false;
+	}
+	// determine the selected nodes and their data, and check for conflicts
+	ArchiveMergeState state;
+	state.reader = reader;
+	state.cbSelectNode = cbSelectNode;
+	state.ctx = ctx;
+	std::string sourcePath;
+	bool hasSelectedNodes = false;
+	if (!CollectArchiveNodes(state, rootHandle, targetDir, sourcePath, cbSelectNode == nullptr, hasSelectedNodes))
+		return false;
+	_mergeRanges(state.selectedRanges);
+	_mergeRanges(state.scrubRanges);
+	_subtractRanges(state.scrubRanges, state.selectedRanges);
+	// the selected data expanded to whole blocks, adjacent runs are combined
+	for (auto& it : state.selectedRanges)
+	{
+		uint64_t firstBlockIndex = it.first / m_blockSize;
+		uint64_t endBlockIndex = (it.second + m_blockSize - 1) / m_blockSize;
+		if (!state.blockRuns.empty() && firstBlockIndex <= state.blockRuns.back().firstBlockIndex + state.blockRuns.back().blockCount)
+		{
+			auto& run = state.blockRuns.back();
+			run.blockCount = std::max(run.blockCount, endBlockIndex - run.firstBlockIndex);
+		}
+		else
+			state.blockRuns.push_back({ firstBlockIndex, endBlockIndex - firstBlockIndex, 0 });
+	}
+	CloseCurrentFile();
+	PadToBlockBoundary();
+	// if copying fails midway the blocks stay unreferenced, the archive remains valid
+	for (auto& it : state.blockRuns)
+	{
+		it.newOffset = m_currentInputOffset;
+		if (!CopyStoredBlocks(state, it.firstBlockIndex, it.blockCount))
+			return false;
+	}
+	AddArchiveNodes(state, rootHandle, MakeDirRecursive(path));
+	return true;
+}
+
+// walks the tree of another archive, records the selected nodes and the data ranges of selected and unselected files
+// dir is the matching directory in this archive or null if there is none yet
+bool ZArchiveWriter::CollectArchiveNodes(ArchiveMergeState& state, uint32_t dirHandle, PathNode* dir, std::string& path, bool isSelected, bool& hasSelectedNodes)
+{
+	ZArchiveReader* reader = state.reader;
+	uint32_t numEntries = reader->GetDirEntryCount(dirHandle);
+	for (uint32_t i = 0; i < numEntries; i++)
+	{
+		ZArchiveReader::DirEntry dirEntry;
+		if (!reader->GetDirEntry(dirHandle, i, dirEntry))
+			return false;
+		size_t parentPathLength = path.size();
+		if (!path.empty())
+			path.push_back('/');
+		path.append(dirEntry.name);
+		bool isEntrySelected = isSelected || state.cbSelectNode(path, dirEntry.isDirectory, state.ctx);
+		PathNode* existingNode = dir ? FindSubnodeByName(dir, dirEntry.name) : nullptr;
+		if (dirEntry.isFile)
+		{
+			uint64_t fileOffset = reader->GetFileDataOffset(dirEntry.nodeHandle);
+			if (isEntrySelected)
+			{
+				if (existingNode)
+					return false;
+				state.selectedNodes.emplace(dirEntry.nodeHandle);
+				hasSelectedNodes = true;
+				if (dirEntry.size != 0)
+					state.selectedRanges.emplace_back(fileOffset, fileOffset + dirEntry.size);
+			}
+			else if (dirEntry.size != 0)
+				state.scrubRanges.emplace_back(fileOffset, fileOffset + dirEntry.size);
+		}
+		else
+		{
+			bool hasSelectedSubnodes = false;
+			if (!CollectArchiveNodes(state, dirEntry.nodeHandle, (existingNode && !existingNode->isFile) ? existingNode : nullptr, path, isEntrySelected, hasSelectedSubnodes))
+				return false;
+			if (isEntrySelected || hasSelectedSubnodes)
+			{
+				if (existingNode && existingNode->isFile)
+					return false;
+				state.selectedNodes.emplace(dirEntry.nodeHandle);
+				hasSelectedNodes = true;
+			}
+		}
+		path.resize(parentPathLength);
+	}
+	return true;
+}
+
+void ZArchiveWriter::AddArchiveNodes(ArchiveMergeState& state, uint32_t dirHandle, PathNode* dir)
+{
+	ZArchiveReader* reader = state.reader;
+	uint32_t numEntries = reader->GetDirEntryCount(dirHandle);
+	for (uint32_t i = 0; i < numEntries; i++)
+	{
+		ZArchiveReader::DirEntry dirEntry;
+		if (!reader->GetDirEntry(dirHandle, i, dirEntry) || state.selectedNodes.find(dirEntry.nodeHandle) == state.selectedNodes.end())
+			continue;
+		if (dirEntry.isFile)
+		{
+			PathNode* fileNode = AddSubnode(dir, true, dirEntry.name);
+			fileNode->fileOffset = dirEntry.size != 0 ? state.GetNewOffset(reader->GetFileDataOffset(dirEntry.nodeHandle), m_blockSize) : 0;
+			fileNode->fileSize = dirEntry.size;
+		}
+		else
+		{
+			PathNode* subdir = FindSubnodeByName(dir, dirEntry.name);
+			if (!subdir)
+				subdir = AddSubnode(dir, false, dirEntry.name);
+			AddArchiveNodes(state, dirEntry.nodeHandle, subdir);
+		}
+	}
+}
+
+bool ZArchiveWriter::CopyStoredBlocks(ArchiveMergeState& state, uint64_t firstBlockIndex, uint64_t blockCount)
+{
+	const uint32_t blocksPerRead = 256;
+	std::vector<uint8_t> storedData;
+	std::vector<uint32_t> storedSizes;
+	std::vector<uint8_t> blockData;
+	auto scrubIt = std::upper_bound(state.scrubRanges.begin(), state.scrubRanges.end(), firstBlockIndex * m_blockSize, [](uint64_t offset, const ArchiveMergeState::Range& range) { return offset < range.second; });
+	for (uint64_t blockIndex = firstBlockIndex; blockIndex < firstBlockIndex + blockCount;)
+	{
+		uint32_t count = (uint32_t)std::min<uint64_t>(firstBlockIndex + blockCount - blockIndex, blocksPerRead);
+		if (!state.reader->ReadStoredBlocks(blockIndex, count, storedData, storedSizes))
+			return false;
+		const uint8_t* data = storedData.data();
+		for (uint32_t storedSize : storedSizes)
+		{
+			uint64_t blockBegin = blockIndex * m_blockSize;
+			uint64_t blockEnd = blockBegin + m_blockSize;
+			while (scrubIt != state.scrubRanges.end() && scrubIt->second <= blockBegin)
+				++scrubIt;
+			bool needsScrub = scrubIt != state.scrubRanges.end() && scrubIt->first < blockEnd;
+			if (needsScrub || (storedSize == 0 && !m_elideZeroBlocks))
+			{
+				// decompress the block, zero the data of unselected files and store it again
+				blockData.resize(m_blockSize);
+				if (storedSize == 0)
+					memset(blockData.data(), 0, m_blockSize);
+				else if (storedSize == m_blockSize)
+					memcpy(blockData.data(), data, m_blockSize);
+				else if (ZSTD_decompress(blockData.data(), m_blockSize, data, storedSize) != m_blockSize)
+					return false;
+				for (auto it = scrubIt; it != state.scrubRanges.end() && it->first < blockEnd; ++it)
+				{
+					uint64_t scrubBegin = std::max(it->first, blockBegin);
+					uint64_t scrubEnd = std::min(it->second, blockEnd);
+					memset(blockData.data() + (scrubBegin - blockBegin), 0, scrubEnd - scrubBegin);
+				}
+				StoreBlock(blockData.data());
+			}
+			else
+			{
+				AddOffsetRecordEntry(GetCurrentOutputOffset(), storedSize);
+				OutputData(data, storedSize);
+			}
+			data += storedSize;
+			m_currentInputOffset += m_blockSize;
+			blockIndex++;
+		}
+		if (m_cbProgress && m_currentInputOffset >= m_nextProgressReport)
+			ReportProgress();
+	}
+	return true;
+}
+
+struct ZArchiveWriter::TranscodeBatch
+{
+	std::vector<uint8_t> encodedData; // stored data of all blocks in the batch
+	std::vector<uint32_t> encodedSizes;
+	uint64_t compressTime{};
+	bool isDone{};
+	bool hasError{};
+};
+
+// decompresses the source data in [beginOffset, endOffset) and encodes it into blocks of this writer. Data past dataEnd is not referenced by any file and is zeroed
+bool ZArchiveWriter::TranscodeBatchData(ZArchiveReader* reader, ZSTD_CCtx_s* zstdCCtx, ZSTD_DCtx_s* zstdDCtx, uint64_t beginOffset, uint64_t endOffset, uint64_t dataEnd, TranscodeBatch& batch) const
+{
+	uint32_t sourceBlockSize = reader->GetBlockSize();
+	std::vector<uint8_t> storedData;
+	std::vector<uint32_t> storedSizes;
+	std::vector<uint8_t> uncompressedData(endOffset - beginOffset, 0);
+	uint64_t firstSourceBlock = beginOffset / sourceBlockSize;
+	uint64_t endSourceBlock = (std::min(endOffset, dataEnd) + sourceBlockSize - 1) / sourceBlockSize;
+	if (endSourceBlock > firstSourceBlock)
+	{
+		if (!reader->ReadStoredBlocks(firstSourceBlock, (uint32_t)(endSourceBlock - firstSourceBlock), storedData, storedSizes))
+			return false;
+		const uint8_t* data = storedData.data();
+		uint64_t sourceOffset = firstSourceBlock * sourceBlockSize;
+		for (uint32_t storedSize : storedSizes)
+		{
+			// with a smaller target block size a source block can start before the batch, otherwise blocks are always fully contained
+			uint64_t skip = beginOffset > sourceOffset ? beginOffset - sourceOffset : 0;
+			uint64_t copySize = std::min<uint64_t>(sourceBlockSize - skip, endOffset - (sourceOffset + skip));
+			uint8_t* output = uncompressedData.data() + (sourceOffset + skip - beginOffset);
+			if (storedSize == sourceBlockSize)
+				memcpy(output, data + skip, copySize);
+			else if (storedSize != 0)
+			{
+				if (skip == 0 && copySize == sourceBlockSize)
+				{
+					if (ZSTD_decompressDCtx(zstdDCtx, output, sourceBlockSize, data, storedSize) != sourceBlockSize)
+						return false;
+				}
+				else
+				{
+					std::vector<uint8_t> blockData(sourceBlockSize);
+					if (ZSTD_decompressDCtx(zstdDCtx, blockData.data(), sourceBlockSize, data, storedSize) != sourceBlockSize)
+						return false;
+					memcpy(output, blockData.data() + skip, copySize);
+				}
+			}
+			data += storedSize;
+			sourceOffset += sourceBlockSize;
+		}
+	}
+	for (uint64_t offset = 0; offset < uncompressedData.size(); offset += m_blockSize)
+	{
+		const uint8_t* blockData = uncompressedData.data() + offset;
+		uint32_t storedSize = EncodeBlock(zstdCCtx, m_compressionLevel, blockData, batch.encodedData, batch.compressTime);
+		if (storedSize == m_blockSize)
+			batch.encodedData.insert(batch.encodedData.end(), blockData, blockData + m_blockSize);
+		batch.encodedSizes.emplace_back(storedSize);
+	}
+	return true;
+}
+
+bool ZArchiveWriter::TranscodeArchive(ZArchiveReader* reader, uint32_t numThreads)
+{
+	std::unique_lock _l(m_mutex);
+	if (m_currentInputOffset != 0 || !m_currentWriteBuffer.empty() || GetNode(0).subnodeCount != 0)
+		return false;
+	ZArchiveNodeHandle rootHandle = reader->LookUp("", false, true);
+	if (rootHandle == ZARCHIVE_INVALID_NODE)
+		return false;
+	ArchiveMergeState state;
+	state.reader = reader;
+	state.cbSelectNode = nullptr;
+	state.ctx = nullptr;
+	std::string sourcePath;
+	bool hasSelectedNodes = false;
+	if (!CollectArchiveNodes(state, rootHandle, &GetNode(0), sourcePath, true, hasSelectedNodes))
+		return false;
+	uint64_t dataEnd = 0;
+	for (auto& it : state.selectedRanges)
+		dataEnd = std::max(dataEnd, it.second);
+	uint64_t blockCount = (dataEnd + m_blockSize - 1) / m_blockSize;
+	// the data is split into batches of whole source and target blocks. Both block sizes are powers of two
+	const uint64_t batchSize = std::max<uint64_t>(std::max(reader->GetBlockSize(), m_blockSize), 4 * 1024 * 1024);
+	const uint64_t batchCount = (blockCount * m_blockSize + batchSize - 1) / batchSize;
+	if (numThreads == 0)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	numThreads = (uint32_t)std::min<uint64_t>(numThreads, std::max<uint64_t>(batchCount, 1));
+	// batches are encoded by the worker threads and written in order by this thread. At most maxBatchesInFlight are held in memory
+	const size_t maxBatchesInFlight = numThreads * 2;
+	std::vector<TranscodeBatch> batches(maxBatchesInFlight);
+	std::mutex batchMutex;
+	std::condition_variable batchDone;
+	std::condition_variable batchReleased;
+	uint64_t nextBatchIndex = 0;
+	uint64_t writtenBatchCount = 0;
+	bool hasError = false;
+	auto transcodeWorker = [&]()
+	{
+		ZSTD_CCtx_s* zstdCCtx = ZSTD_createCCtx();
+		ZSTD_DCtx_s* zstdDCtx = ZSTD_createDCtx();
+		std::unique_lock _lb(batchMutex);
+		while (true)
+		{
+			batchReleased.wait(_lb, [&]() { return hasError || nextBatchIndex >= batchCount || nextBatchIndex < writtenBatchCount + maxBatchesInFlight; });
+			if (hasError || nextBatchIndex >= batchCount)
+				break;
+			uint64_t batchIndex = nextBatchIndex++;
+			TranscodeBatch& batch = batches[batchIndex % maxBatchesInFlight];
+			_lb.unlock();
+			batch.encodedData.clear();
+			batch.encodedSizes.clear();
+			batch.compressTime = 0;
+			uint64_t beginOffset = batchIndex * batchSize;
+			uint64_t endOffset = std::min(beginOffset + batchSize, blockCount * m_blockSize);
+			bool isSuccess = TranscodeBatchData(reader, zstdCCtx, zstdDCtx, beginOffset, endOffset, dataEnd, batch);
+			_lb.lock();
+			batch.hasError = !isSuccess;
+			batch.isDone = true;
+			batchDone.notify_all();
+		}
+		_lb.unlock();
+		ZSTD_freeDCtx(zstdDCtx);
+		ZSTD_freeCCtx(zstdCCtx);
+	};
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < numThreads; i++)
+		threads.emplace_back(transcodeWorker);
+	for (uint64_t batchIndex = 0; batchIndex < batchCount; batchIndex++)
+	{
+		TranscodeBatch& batch = batches[batchIndex % maxBatchesInFlight];
+		{
+			std::unique_lock _lb(batchMutex);
+			batchDone.wait(_lb, [&]() { return batch.isDone; });
+			if (batch.hasError)
+			{
+				hasError = true;
+				batchReleased.notify_all();
+				break;
+			}
+		}
+		const uint8_t* data = batch.encodedData.data();
+		for (uint32_t storedSize : batch.encodedSizes)
+		{
+			AddOffsetRecordEntry(GetCurrentOutputOffset(), storedSize);
+			OutputData(data, _ZARCHIVE::GetStoredDataSize(storedSize));
+			data += _ZARCHIVE::GetStoredDataSize(storedSize);
+			m_currentInputOffset += m_blockSize;
+		}
+		m_stats.compressTime += batch.compressTime;
+		{
+			std::unique_lock _lb(batchMutex);
+			batch.isDone = false;
+			writtenBatchCount++;
+		}
+		batchReleased.notify_all();
+		if (m_cbProgress && m_currentInputOffset >= m_nextProgressReport)
+			ReportProgress();
+	}
+	for (auto& it : threads)
+		it.join();
+	if (hasError)
+		return false;
+	// blocks start at offset 0 in both archives so file offsets stay the same
+	state.blockRuns.push_back({ 0, blockCount, 0 });
+	AddArchiveNodes(state, rootHandle, &GetNode(0));
+	return true;
+}
+
+ZArchiveWriter::FileWriter::FileWriter(ZArchiveWriter* writer, PathNode* fileNode, ZSTD_CCtx_s* zstdCCtx, int compressionLevel) : m_writer(writer), m_fileNode(fileNode), m_zstdCCtx(zstdCCtx), m_compressionLevel(compressionLevel)
+{
+	m_currentBlock.reserve(writer->m_blockSize);
+}
+
+ZArchiveWriter::FileWriter::~FileWriter()
+{
+	free(m_shaCtx);
+}
+
+void ZArchiveWriter::FileWriter::AppendData(const void* data, size_t size)
+{
+	m_fileNode->fileSize += size;
+	if (m_shaCtx)
+	{
+		uint64_t hashStartTime = _getTimestampNs();
+		sha_256_write(m_shaCtx, data, size);
+		m_hashTime += (_getTimestampNs() - hashStartTime);
+	}
+	const uint32_t blockSize = m_writer->m_blockSize;
+	const uint8_t* input = (const uint8_t*)data;
+	while (size > 0)
 	{
-		OutputData(m_compressionBuffer.data(), outputSize);
+		if (m_currentBlock.empty() && size >= blockSize)
+		{
+			// encode full blocks straight from the input
+			m_encodedSizes.emplace_back(m_writer->EncodeBlock(m_zstdCCtx, m_compressionLevel, input, m_encodedData, m_compressTime));
+			if (m_encodedSizes.back() == blockSize)
+				m_encodedData.insert(m_encodedData.end(), input, input + blockSize);
+			input += blockSize;
+			size -= blockSize;
+			continue;
+		}
+		size_t bytesToCopy = std::min<size_t>(blockSize - m_currentBlock.size(), size);
+		uint64_t copyStartTime = _getTimestampNs();
+		m_currentBlock.insert(m_currentBlock.end(), input, input + bytesToCopy);
+		m_inputCopyTime += (_getTimestampNs() - copyStartTime);
+		input += bytesToCopy;
+		size -= bytesToCopy;
+		if (m_currentBlock.size() == blockSize)
+			EncodeCurrentBlock();
 	}
+}
+
+void ZArchiveWriter::FileWriter::EncodeCurrentBlock()
+{
+	uint32_t storedSize = m_writer->EncodeBlock(m_zstdCCtx, m_compressionLevel, m_currentBlock.data(), m_encodedData, m_compressTime);
+	if (storedSize == m_writer->m_blockSize)
+		m_encodedData.insert(m_encodedData.end(), m_currentBlock.begin(), m_currentBlock.end());
+	m_encodedSizes.emplace_back(storedSize);
+	m_currentBlock.clear();
+}
+
+void ZArchiveWriter::AddOffsetRecordEntry(uint64_t compressedOffset, uint32_t compressedSize)
+{
 	// add offset translation record
-	if ((m_numWrittenOffsetRecords % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD) == 0)
-		m_compressionOffsetRecord.emplace_back().baseOffset = compressedWriteOffset;
-	m_compressionOffsetRecord.back().size[m_numWrittenOffsetRecords % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD] = (uint16_t)outputSize - 1;
+	size_t subIndex = m_numWrittenOffsetRecords % _ZARCHIVE::ENTRIES_PER_OFFSETRECORD;
+	if (m_formatVersion == _ZARCHIVE::Footer::kVersion1)
+	{
+		if (subIndex == 0)
+			m_compressionOffsetRecord.emplace_back().baseOffset = compressedOffset;
+		m_compressionOffsetRecord.back().size[subIndex] = (uint16_t)(compressedSize - 1);
+	}
+	else
+	{
+		if (subIndex == 0)
+			m_compressionOffsetRecordV2.emplace_back().baseOffset = compressedOffset;
+		m_compressionOffsetRecordV2.back().size[subIndex] = compressedSize;
+	}
 	m_numWrittenOffsetRecords++;
 }
 
+void ZArchiveWriter::UpdateAdaptiveCompression()
+{
+	// re-evaluate the compression level after every few MiB of input
+	// if the output sink is the bottleneck then compressing harder shrinks the amount of data it has to handle
+	// if compression is the bottleneck then lowering the level gets the sink fed sooner
+	const uint64_t windowSize = 4 * 1024 * 1024;
+	// the output time is estimated from the data produced in the window, the level is kept until the sink has been measured once
+	if (m_adaptiveCompression.windowInputSize < windowSize)
+		return;
+	double sinkNsPerByte = m_adaptiveCompression.sinkNsPerByte.load(std::memory_order_relaxed);
+	if (sinkNsPerByte >= 0.0)
+	{
+		uint64_t compressTime = m_adaptiveCompression.windowCompressTime;
+		uint64_t outputTime = (uint64_t)(sinkNsPerByte * (double)m_adaptiveCompression.windowOutputSize);
+		if (outputTime > compressTime + compressTime / 4)
+			m_compressionLevel = std::min(m_compressionLevel + 1, m_adaptiveCompression.maxLevel);
+		else if (compressTime > outputTime + outputTime / 4)
+			m_compressionLevel = std::max(m_compressionLevel - 1, m_adaptiveCompression.minLevel);
+	}
+	m_adaptiveCompression.windowInputSize = 0;
+	m_adaptiveCompression.windowCompressTime = 0;
+	m_adaptiveCompression.windowOutputSize = 0;
+}
+
 void ZArchiveWriter::AppendData(const void* data, size_t size)
+{
+	std::unique_lock _l(m_mutex);
+	if (m_currentFileNode)
+	{
+		m_currentFileNode->fileSize += size;
+		if (m_dedup.isBuffering)
+		{
+			if (m_dedup.pendingData.size() + size <= m_dedup.maxFileSize)
+			{
+				uint64_t copyStartTime = _getTimestampNs();
+				m_dedup.pendingData.insert(m_dedup.pendingData.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+				m_stats.inputCopyTime += (_getTimestampNs() - copyStartTime);
+				return;
+			}
+			// file is too large to be deduplicated, flush the data held back so far and continue normally
+			m_dedup.isBuffering = false;
+			WriteStreamData(m_dedup.pendingData.data(), m_dedup.pendingData.size());
+			m_dedup.pendingData.clear();
+		}
+	}
+	WriteStreamData(data, size);
+}
+
+void ZArchiveWriter::WriteStreamData(const void* data, size_t size)
 {
 	size_t dataSize = size;
 	const uint8_t* input = (const uint8_t*)data;
 	while (size > 0)
 	{
-		size_t bytesToCopy = _ZARCHIVE::COMPRESSED_BLOCK_SIZE - m_currentWriteBuffer.size();
+		size_t bytesToCopy = m_blockSize - m_currentWriteBuffer.size();
 		if (bytesToCopy > size)
 			bytesToCopy = size;
-		if (bytesToCopy == _ZARCHIVE::COMPRESSED_BLOCK_SIZE)
+		if (bytesToCopy == m_blockSize)
 		{
 			// if incoming data is block-aligned we can store it directly without memcpy to temporary buffer
 			StoreBlock(input);
@@ -175,30 +1248,37 @@ void ZArchiveWriter::AppendData(const void* data, size_t size)
 			size -= bytesToCopy;
 			continue;
 		}
+		uint64_t copyStartTime = _getTimestampNs();
 		m_currentWriteBuffer.insert(m_currentWriteBuffer.end(), input, input + bytesToCopy);
+		m_stats.inputCopyTime += (_getTimestampNs() - copyStartTime);
 		input += bytesToCopy;
 		size -= bytesToCopy;
-		if (m_currentWriteBuffer.size() == _ZARCHIVE::COMPRESSED_BLOCK_SIZE)
+		if (m_currentWriteBuffer.size() == m_blockSize)
 		{
 			StoreBlock(m_currentWriteBuffer.data());
 			m_currentWriteBuffer.clear();
 		}
 	}
-	if (m_currentFileNode)
-		m_currentFileNode->fileSize += dataSize;
 	m_currentInputOffset += dataSize;
+	if (m_cbProgress && m_currentInputOffset >= m_nextProgressReport)
+		ReportProgress();
+}
+
+void ZArchiveWriter::PadToBlockBoundary()
+{
+	if (m_currentWriteBuffer.empty())
+		return;
+	std::vector<uint8_t> padBuffer;
+	padBuffer.resize(m_blockSize - m_currentWriteBuffer.size());
+	WriteStreamData(padBuffer.data(), padBuffer.size());
 }
 
 void ZArchiveWriter::Finalize()
 {
-	m_currentFileNode = nullptr; // make sure the padding added below doesn't modify the active file
+	std::unique_lock _l(m_mutex);
+	CloseCurrentFile();
 	// flush write buffer by padding it to the length of a full block
-	if (!m_currentWriteBuffer.empty())
-	{
-		std::vector<uint8_t> padBuffer;
-		padBuffer.resize(_ZARCHIVE::COMPRESSED_BLOCK_SIZE - m_currentWriteBuffer.size());
-		AppendData(padBuffer.data(), padBuffer.size());
-	}
+	PadToBlockBoundary();
 	m_footer.sectionCompressedData.offset = 0;
 	m_footer.sectionCompressedData.size = GetCurrentOutputOffset();
 	// pad to 8 byte
@@ -212,13 +1292,36 @@ void ZArchiveWriter::Finalize()
 	WriteFileTree();
 	WriteMetaData();
 	WriteFooter();
+	FlushOutputBuffer();
+	StopAsyncOutput();
+	ReportProgress();
 }
 
 void ZArchiveWriter::WriteOffsetRecords()
 {
 	m_footer.sectionOffsetRecords.offset = GetCurrentOutputOffset();
-	_ZARCHIVE::CompressionOffsetRecord::Serialize(m_compressionOffsetRecord.data(), m_compressionOffsetRecord.size(), m_compressionOffsetRecord.data()); // in-place
-	OutputData(m_compressionOffsetRecord.data(), m_compressionOffsetRecord.size() * sizeof(_ZARCHIVE::CompressionOffsetRecord));
+	if (m_formatVersion == _ZARCHIVE::Footer::kVersion1)
+	{
+		_ZARCHIVE::CompressionOffsetRecord::Serialize(m_compressionOffsetRecord.data(), m_compressionOffsetRecord.size(), m_compressionOffsetRecord.data()); // in-place
+		OutputData(m_compressionOffsetRecord.data(), m_compressionOffsetRecord.size() * sizeof(_ZARCHIVE::CompressionOffsetRecord));
+	}
+	else
+	{
+		_ZARCHIVE::OffsetRecordsHeaderV2 header;
+		header.blockSize = m_blockSize;
+		header.flags = m_delta.isEnabled ? _ZARCHIVE::OffsetRecordsHeaderV2::FLAG_DELTA : 0;
+		header.blockCount = m_numWrittenOffsetRecords;
+		_ZARCHIVE::OffsetRecordsHeaderV2::Serialize(&header, &header);
+		OutputData(&header, sizeof(_ZARCHIVE::OffsetRecordsHeaderV2));
+		if (m_delta.isEnabled)
+		{
+			_ZARCHIVE::DeltaHeaderV2 deltaHeader;
+			memcpy(deltaHeader.baseIntegrityHash, m_delta.baseIntegrityHash, 32);
+			OutputData(&deltaHeader, sizeof(_ZARCHIVE::DeltaHeaderV2));
+		}
+		_ZARCHIVE::CompressionOffsetRecordV2::Serialize(m_compressionOffsetRecordV2.data(), m_compressionOffsetRecordV2.size(), m_compressionOffsetRecordV2.data()); // in-place
+		OutputData(m_compressionOffsetRecordV2.data(), m_compressionOffsetRecordV2.size() * sizeof(_ZARCHIVE::CompressionOffsetRecordV2));
+	}
 	m_footer.sectionOffsetRecords.size = GetCurrentOutputOffset() - m_footer.sectionOffsetRecords.offset;
 }
 
@@ -258,13 +1361,14 @@ void ZArchiveWriter::WriteNameTable()
 
 void ZArchiveWriter::WriteFileTree()
 {
-	std::queue<PathNode*> nodeQueue;
+	std::queue<uint32_t> nodeQueue;
+	std::vector<uint32_t> sortedSubnodes;
 	// first pass - assign a node range to all directories
-	nodeQueue.push(&m_rootNode);
+	nodeQueue.push(0);
 	uint32_t currentIndex = 1; // root node is at index 0
 	while (!nodeQueue.empty())
 	{
-		PathNode* node = nodeQueue.front();
+		PathNode* node = &GetNode(nodeQueue.front());
 		nodeQueue.pop();
 		if (node->isFile)
 		{
@@ -272,27 +1376,39 @@ void ZArchiveWriter::WriteFileTree()
 			continue;
 		}
 		// order entries lexicographically so we can use binary search in the reader
-		std::sort(node->subnodes.begin(), node->subnodes.end(),
-			[&](ZArchiveWriter::PathNode*& a, ZArchiveWriter::PathNode*& b) -> int
+		sortedSubnodes.clear();
+		for (uint32_t nodeIndex = node->firstSubnode; nodeIndex != INVALID_NODE_INDEX; nodeIndex = GetNode(nodeIndex).nextSibling)
+			sortedSubnodes.emplace_back(nodeIndex);
+		std::sort(sortedSubnodes.begin(), sortedSubnodes.end(),
+			[&](uint32_t a, uint32_t b) -> int
 			{
-				return _ZARCHIVE::CompareNodeName(m_nodeNames[a->nameIndex], m_nodeNames[b->nameIndex]) > 0;
+				return _ZARCHIVE::CompareNodeName(m_nodeNames[GetNode(a).nameIndex], m_nodeNames[GetNode(b).nameIndex]) > 0;
 			});
+		// relink in sorted order
+		uint32_t nextIndex = INVALID_NODE_INDEX;
+		for (size_t i = sortedSubnodes.size(); i > 0; i--)
+		{
+			GetNode(sortedSubnodes[i - 1]).nextSibling = nextIndex;
+			nextIndex = sortedSubnodes[i - 1];
+		}
+		node->firstSubnode = nextIndex;
 
 		node->nodeStartIndex = currentIndex;
-		currentIndex += (uint32_t)node->subnodes.size();
-		for (auto& it : node->subnodes)
+		currentIndex += node->subnodeCount;
+		for (uint32_t it : sortedSubnodes)
 			nodeQueue.push(it);
 	}
 	// second pass - serialize to file
 	m_footer.sectionFileTree.offset = GetCurrentOutputOffset();
-	nodeQueue.push(&m_rootNode);
+	nodeQueue.push(0);
 	while (!nodeQueue.empty())
 	{
-		PathNode* node = nodeQueue.front();
+		uint32_t nodeIndex = nodeQueue.front();
+		PathNode* node = &GetNode(nodeIndex);
 		nodeQueue.pop();
 
 		_ZARCHIVE::FileDirectoryEntry tmp;
-		if(node == &m_rootNode)
+		if(nodeIndex == 0)
 			tmp.SetTypeAndNameOffset(node->isFile, 0x7FFFFFFF);
 		else
 			tmp.SetTypeAndNameOffset(node->isFile, m_nodeNameOffsets[node->nameIndex]);
@@ -303,13 +1419,13 @@ void ZArchiveWriter::WriteFileTree()
 		}
 		else
 		{
-			tmp.directoryRecord.count = (uint32_t)node->subnodes.size();
+			tmp.directoryRecord.count = node->subnodeCount;
 			tmp.directoryRecord.nodeStartIndex = node->nodeStartIndex;
 			tmp.directoryRecord._reserved = 0;
 		}
 		_ZARCHIVE::FileDirectoryEntry::Serialize(&tmp, 1, &tmp);
 		OutputData(&tmp, sizeof(_ZARCHIVE::FileDirectoryEntry));
-		for (auto& it : node->subnodes)
+		for (uint32_t it = node->firstSubnode; it != INVALID_NODE_INDEX; it = GetNode(it).nextSibling)
 			nodeQueue.push(it);
 	}
 	m_footer.sectionFileTree.size = GetCurrentOutputOffset() - m_footer.sectionFileTree.offset;
@@ -327,7 +1443,7 @@ void ZArchiveWriter::WriteMetaData()
 void ZArchiveWriter::WriteFooter()
 {
 	m_footer.magic = _ZARCHIVE::Footer::kMagic;
-	m_footer.version = _ZARCHIVE::Footer::kVersion1;
+	m_footer.version = m_formatVersion;
 	m_footer.totalSize = GetCurrentOutputOffset() + sizeof(_ZARCHIVE::Footer);
 
 	_ZARCHIVE::Footer tmp;
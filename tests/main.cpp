@@ -0,0 +1,47 @@
+#include "testutil.h"
+
+#include <map>
+
+namespace fs = std::filesystem;
+
+std::map<std::string, TestFunction>& GetTestRegistry();
+extern fs::path g_testWorkDirectory;
+extern fs::path g_toolPath;
+
+// usage: zarchive_tests test_name [path_to_zarchive_tool]
+// without arguments all tests are listed
+int main(int argc, char* argv[])
+{
+	auto& registry = GetTestRegistry();
+	if (argc < 2)
+	{
+		for (auto& it : registry)
+			puts(it.first.c_str());
+		return 0;
+	}
+	auto it = registry.find(argv[1]);
+	if (it == registry.end())
+	{
+		printf("Unknown test %s\n", argv[1]);
+		return 1;
+	}
+	if (argc >= 3)
+		g_toolPath = fs::absolute(argv[2]);
+	// every test starts with an empty work directory
+	std::error_code ec;
+	g_testWorkDirectory = fs::absolute("zarchive_test_" + it->first);
+	fs::remove_all(g_testWorkDirectory, ec);
+	fs::create_directories(g_testWorkDirectory, ec);
+	if (ec)
+	{
+		printf("Failed to create work directory %s\n", g_testWorkDirectory.string().c_str());
+		return 1;
+	}
+	if (!it->second())
+	{
+		printf("Test %s failed\n", it->first.c_str());
+		return 1;
+	}
+	fs::remove_all(g_testWorkDirectory, ec);
+	return 0;
+}
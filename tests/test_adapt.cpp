@@ -0,0 +1,77 @@
+#include "testutil.h"
+
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+struct AdaptSink
+{
+	std::vector<uint8_t> data;
+	uint32_t writeDelayNsPerByte{ 0 }; // simulates the throughput of a slow device
+};
+
+static void _adapt_NewOutputFile([[maybe_unused]] const int32_t partIndex, [[maybe_unused]] void* ctx)
+{
+}
+
+static void _adapt_WriteOutputData(const void* data, size_t length, void* ctx)
+{
+	AdaptSink* sink = (AdaptSink*)ctx;
+	if (sink->writeDelayNsPerByte != 0)
+		std::this_thread::sleep_for(std::chrono::nanoseconds((uint64_t)length * sink->writeDelayNsPerByte));
+	sink->data.insert(sink->data.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+}
+
+// writes the files with adaptive compression into the sink and returns the level the writer settled on
+static int _adapt_WriteArchive(AdaptSink& sink, const std::vector<TestFile>& files, size_t outputBufferSize, uint32_t asyncBufferCount)
+{
+	ZArchiveWriter writer(_adapt_NewOutputFile, _adapt_WriteOutputData, &sink);
+	if (!writer.SetOutputBufferSize(outputBufferSize))
+		return -1;
+	if (asyncBufferCount != 0 && !writer.EnableAsyncOutput(asyncBufferCount))
+		return -1;
+	writer.EnableAdaptiveCompression(1, 19);
+	for (auto& it : files)
+	{
+		if (!writer.StartNewFile(it.path.c_str()))
+			return -1;
+		writer.AppendData(it.data.data(), it.data.size());
+	}
+	writer.Finalize();
+	return writer.GetCompressionLevel();
+}
+
+ZARCHIVE_TEST(adaptive_compression)
+{
+	// several 4MiB decision windows
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(9 * 1024 * 1024, 1, true) },
+		{ "b.txt", GenerateData(4 * 1024 * 1024, 2, true) },
+	};
+	// unbuffered, buffered and asynchronous output. With buffering the writes happen in bursts which do not line up with the decision windows
+	const std::pair<size_t, uint32_t> outputModes[] = { { 0, 0 }, { 1024 * 1024, 0 }, { 256 * 1024, 2 } };
+	for (auto [outputBufferSize, asyncBufferCount] : outputModes)
+	{
+		// output is practically free, compression is the bottleneck and the level goes down from the default of 6
+		AdaptSink fastSink;
+		int fastLevel = _adapt_WriteArchive(fastSink, files, outputBufferSize, asyncBufferCount);
+		CHECK(fastLevel >= 1 && fastLevel < 6);
+		// output at a few MB/s is slower than compression, spend the idle time on a better ratio
+		AdaptSink slowSink;
+		slowSink.writeDelayNsPerByte = 400;
+		int slowLevel = _adapt_WriteArchive(slowSink, files, outputBufferSize, asyncBufferCount);
+		CHECK(slowLevel > 6 && slowLevel <= 19);
+		// the level may change between blocks, the archive has to stay readable regardless
+		for (AdaptSink* sink : { &fastSink, &slowSink })
+		{
+			std::filesystem::path path = TestPath(sink == &fastSink ? "fast.zar" : "slow.zar");
+			std::ofstream(path, std::ios::binary).write((const char*)sink->data.data(), sink->data.size());
+			std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(path));
+			CHECK(reader);
+			if (!VerifyTestArchive(reader.get(), files))
+				return false;
+		}
+	}
+	return true;
+}
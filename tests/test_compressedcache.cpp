@@ -0,0 +1,61 @@
+#include "testutil.h"
+
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cstring>
+
+ZARCHIVE_TEST(compressed_cache)
+{
+	// blocks stored uncompressed bypass the compressed tier, so all data is compressible
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(2000000, 95, true) },
+		{ "b.txt", GenerateData(300000, 96, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	// the decompressed cache holds a single block, the compressed tier the whole archive
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar"), 0));
+	CHECK(reader);
+	reader->SetCompressedCacheSize(8 * 1024 * 1024);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	reader->ResetStats();
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	ZArchiveReader::Stats stats;
+	if (reader->GetStats(stats))
+	{
+		CHECK(stats.compressedCacheHits > 0);
+		CHECK(stats.bytesReadFromDisk == 0);
+	}
+	// concurrent readers while the tier is resized and disabled
+	std::atomic<uint32_t> numMismatches{ 0 };
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&, t]()
+			{
+				const TestFile& file = files[t % files.size()];
+				ZArchiveNodeHandle nodeHandle = reader->LookUp(file.path);
+				std::vector<uint8_t> buffer(30000);
+				for (uint64_t offset = t * 1000; offset < file.data.size(); offset += 20000)
+				{
+					uint64_t length = std::min<uint64_t>(buffer.size(), file.data.size() - offset);
+					if (reader->ReadFromFile(nodeHandle, offset, length, buffer.data()) != length || memcmp(buffer.data(), file.data.data() + offset, length) != 0)
+						numMismatches++;
+				}
+			});
+	}
+	reader->SetCompressedCacheSize(64 * 1024);
+	reader->SetCompressedCacheSize(0);
+	for (auto& it : threads)
+		it.join();
+	CHECK(numMismatches == 0);
+	// once disabled every block comes from disk again
+	reader->ResetStats();
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	if (reader->GetStats(stats))
+		CHECK(stats.compressedCacheHits == 0);
+	return true;
+}
@@ -0,0 +1,53 @@
+#include "testutil.h"
+
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cstring>
+
+// many threads read random ranges through a cache much smaller than the archive, so blocks are loaded and evicted concurrently
+ZARCHIVE_TEST(concurrent_readers)
+{
+	std::vector<TestFile> files;
+	for (uint32_t i = 0; i < 6; i++)
+		files.push_back({ "file" + std::to_string(i) + ".bin", GenerateData(150000 + i * 70000, 30 + i, (i % 2) == 0) });
+	CHECK(WriteTestArchive(TestPath("stress.zar"), files, [](ZArchiveWriter& writer) { return writer.SetBlockSize(16 * 1024); }));
+	// a cache of only a few blocks, smaller than the number of threads
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("stress.zar"), 4 * 16 * 1024));
+	CHECK(reader);
+	std::vector<ZArchiveNodeHandle> handles;
+	for (auto& it : files)
+	{
+		handles.emplace_back(reader->LookUp(it.path));
+		CHECK(handles.back() != ZARCHIVE_INVALID_NODE);
+	}
+	const uint32_t numThreads = 8;
+	std::atomic<uint32_t> numMismatches{ 0 };
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		threads.emplace_back([&, t]()
+			{
+				uint64_t state = 0x9E3779B97F4A7C15ull * (t + 1);
+				std::vector<uint8_t> buffer;
+				for (uint32_t i = 0; i < 400; i++)
+				{
+					state = state * 6364136223846793005ull + 1442695040888963407ull;
+					size_t fileIndex = (size_t)(state >> 33) % files.size();
+					const std::vector<uint8_t>& expected = files[fileIndex].data;
+					uint64_t offset = (state >> 17) % expected.size();
+					uint64_t length = std::min<uint64_t>(1 + (state >> 40) % 50000, expected.size() - offset);
+					buffer.resize(length);
+					if (reader->ReadFromFile(handles[fileIndex], offset, length, buffer.data()) != length || memcmp(buffer.data(), expected.data() + offset, length) != 0)
+						numMismatches++;
+					// look-ups run alongside the reads
+					if ((i % 16) == 0 && reader->LookUp(files[fileIndex].path) != handles[fileIndex])
+						numMismatches++;
+				}
+			});
+	}
+	for (auto& it : threads)
+		it.join();
+	CHECK(numMismatches == 0);
+	return VerifyTestArchive(reader.get(), files);
+}
@@ -0,0 +1,33 @@
+#include "testutil.h"
+
+#include <memory>
+
+ZARCHIVE_TEST(deduplication)
+{
+	std::vector<uint8_t> shared = GenerateData(300000, 14, false);
+	std::vector<TestFile> files = {
+		{ "a.bin", shared },
+		{ "copy/a.bin", shared },
+		{ "other.bin", GenerateData(300000, 15, false) },
+		{ "copy/b.bin", shared },
+		{ "empty1.txt", {} },
+		{ "empty2.txt", {} },
+	};
+	CHECK(WriteTestArchive(TestPath("dedup.zar"), files, [](ZArchiveWriter& writer) { writer.SetDeduplication(true); return true; }));
+	CHECK(WriteTestArchive(TestPath("plain.zar"), files));
+	// random data does not compress, so the sizes tell whether the copies were stored
+	uint64_t dedupSize = std::filesystem::file_size(TestPath("dedup.zar"));
+	uint64_t plainSize = std::filesystem::file_size(TestPath("plain.zar"));
+	CHECK(plainSize > 4 * 300000);
+	CHECK(dedupSize < 2 * 300000 + 64 * 1024 * 2);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("dedup.zar")));
+	CHECK(reader);
+	CHECK(reader->GetFileDataOffset(reader->LookUp("a.bin")) == reader->GetFileDataOffset(reader->LookUp("copy/b.bin")));
+	CHECK(VerifyTestArchive(reader.get(), files));
+	// files above the size limit are stored normally
+	CHECK(WriteTestArchive(TestPath("limit.zar"), files, [](ZArchiveWriter& writer) { writer.SetDeduplication(true, 100000); return true; }));
+	CHECK(std::filesystem::file_size(TestPath("limit.zar")) > 4 * 300000);
+	std::unique_ptr<ZArchiveReader> limitReader(ZArchiveReader::OpenFromFile(TestPath("limit.zar")));
+	CHECK(limitReader);
+	return VerifyTestArchive(limitReader.get(), files);
+}
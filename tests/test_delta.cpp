@@ -0,0 +1,72 @@
+#include "testutil.h"
+
+#include <memory>
+
+namespace fs = std::filesystem;
+
+ZARCHIVE_TEST(delta_archive)
+{
+	std::vector<TestFile> baseFiles = {
+		{ "a.bin", GenerateData(600000, 70, false) },
+		{ "b.txt", GenerateData(200000, 71, true) },
+	};
+	// the update changes a few bytes within a.bin and adds a file
+	std::vector<TestFile> files = baseFiles;
+	for (size_t i = 0; i < 100; i++)
+		files[0].data[300000 + i] ^= 0x5A;
+	files.push_back({ "c.bin", GenerateData(50000, 72, false) });
+	CHECK(WriteTestArchive(TestPath("base.zar"), baseFiles));
+	CHECK(WriteTestArchive(TestPath("full.zar"), files));
+	std::unique_ptr<ZArchiveReader> baseReader(ZArchiveReader::OpenFromFile(TestPath("base.zar")));
+	CHECK(baseReader);
+	CHECK(WriteTestArchive(TestPath("delta.zar"), files, [&](ZArchiveWriter& writer) { return writer.SetDeltaBase(baseReader.get()); }));
+	baseReader.reset();
+	// only the changed block and the new file are stored
+	CHECK(fs::file_size(TestPath("delta.zar")) < fs::file_size(TestPath("full.zar")) / 4);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("delta.zar")));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	reader.reset();
+	// without its base, or against a different one, the delta cannot be opened
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFile(TestPath("delta.zar"))));
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenDelta(TestPath("missing.zar"), TestPath("delta.zar"))));
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenDelta(TestPath("full.zar"), TestPath("delta.zar"))));
+	// a base with the same name but different content is detected as well
+	std::vector<TestFile> otherFiles = baseFiles;
+	otherFiles[1].data[0] ^= 1;
+	CHECK(WriteTestArchive(TestPath("base.zar"), otherFiles));
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("delta.zar"))));
+	// a mismatching block size is rejected when writing
+	std::unique_ptr<ZArchiveReader> otherReader(ZArchiveReader::OpenFromFile(TestPath("full.zar")));
+	CHECK(otherReader);
+	return WriteArchiveWith(TestPath("invalid.zar"), [&](ZArchiveWriter& writer)
+		{
+			CHECK(writer.SetBlockSize(16 * 1024));
+			CHECK(!writer.SetDeltaBase(otherReader.get()));
+			return true;
+		});
+}
+
+// blocks are matched at fixed positions only: data shifted by whole blocks is found in the base, data shifted by a single byte is not
+ZARCHIVE_TEST(delta_shifted_data)
+{
+	const uint32_t blockSize = 64 * 1024;
+	std::vector<uint8_t> data = GenerateData(16 * blockSize, 73, false);
+	CHECK(WriteTestArchive(TestPath("base.zar"), { { "a.bin", data } }));
+	std::unique_ptr<ZArchiveReader> baseReader(ZArchiveReader::OpenFromFile(TestPath("base.zar")));
+	CHECK(baseReader);
+	std::vector<TestFile> blockShifted = { { "head.bin", GenerateData(blockSize, 74, false) }, { "a.bin", data } };
+	std::vector<TestFile> byteShifted = { { "head.bin", GenerateData(1, 74, false) }, { "a.bin", data } };
+	CHECK(WriteTestArchive(TestPath("block.zar"), blockShifted, [&](ZArchiveWriter& writer) { return writer.SetDeltaBase(baseReader.get()); }));
+	CHECK(WriteTestArchive(TestPath("byte.zar"), byteShifted, [&](ZArchiveWriter& writer) { return writer.SetDeltaBase(baseReader.get()); }));
+	CHECK(fs::file_size(TestPath("block.zar")) < 3 * blockSize);
+	CHECK(fs::file_size(TestPath("byte.zar")) > data.size());
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("block.zar")));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), blockShifted))
+		return false;
+	reader.reset(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("byte.zar")));
+	CHECK(reader);
+	return VerifyTestArchive(reader.get(), byteShifted);
+}
@@ -0,0 +1,115 @@
+#include "testutil.h"
+
+#include <memory>
+#include <fstream>
+
+// archive created by the zarchive tool before format version 2 existed
+ZARCHIVE_TEST(format_v1_baseline_archive)
+{
+	std::string readme;
+	for (int i = 0; i < 1000; i++)
+		readme += "hello zarchive\n";
+	std::vector<uint8_t> data(200000);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (uint8_t)(i % 251);
+	std::vector<TestFile> files = {
+		{ "readme.txt", std::vector<uint8_t>(readme.begin(), readme.end()) },
+		{ "dir/data.bin", data },
+		{ "dir/empty.txt", {} },
+	};
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(ZARCHIVE_TEST_DATA_DIR "/v1_baseline.zar"));
+	CHECK(reader);
+	CHECK(reader->GetBlockSize() == 64 * 1024);
+	CHECK(reader->GetBlockCount() == (GetDataStreamSize(files) + 0xFFFF) / 0x10000);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("dir")) == 2);
+	CHECK(reader->LookUp("DIR/DATA.BIN") == reader->LookUp("dir/data.bin"));
+	CHECK(reader->LookUp("missing.txt") == ZARCHIVE_INVALID_NODE);
+	return VerifyTestArchive(reader.get(), files);
+}
+
+// the writer only emits version 2 when a feature requires it
+ZARCHIVE_TEST(format_v1_roundtrip)
+{
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(300000, 1, true) },
+		{ "random.bin", GenerateData(150000, 2, false) },
+		{ "sub/dir/deep.txt", GenerateData(65536, 3, true) },
+		{ "sub/empty.bin", {} },
+	};
+	CHECK(WriteTestArchive(TestPath("v1.zar"), files));
+	CHECK(ReadFooterVersion(TestPath("v1.zar")) == _ZARCHIVE::Footer::kVersion1);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("v1.zar")));
+	CHECK(reader);
+	CHECK(reader->GetBlockSize() == 64 * 1024);
+	CHECK(reader->GetBlockCount() == (GetDataStreamSize(files) + 0xFFFF) / 0x10000);
+	return VerifyTestArchive(reader.get(), files);
+}
+
+ZARCHIVE_TEST(format_v2_block_sizes)
+{
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(700000, 4, true) },
+		{ "b.bin", GenerateData(90000, 5, false) },
+		{ "c.txt", GenerateData(1000, 6, true) },
+	};
+	for (uint32_t blockSize : { 4u * 1024, 16u * 1024, 256u * 1024, 1024u * 1024 })
+	{
+		CHECK(WriteTestArchive(TestPath("v2.zar"), files, [&](ZArchiveWriter& writer) { return writer.SetBlockSize(blockSize); }));
+		CHECK(ReadFooterVersion(TestPath("v2.zar")) == _ZARCHIVE::Footer::kVersion2);
+		std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("v2.zar")));
+		CHECK(reader);
+		CHECK(reader->GetBlockSize() == blockSize);
+		// the block count is exact even if the last offset record is only partially used
+		CHECK(reader->GetBlockCount() == (GetDataStreamSize(files) + blockSize - 1) / blockSize);
+		if (!VerifyTestArchive(reader.get(), files))
+			return false;
+	}
+	return true;
+}
+
+ZARCHIVE_TEST(format_invalid_block_size)
+{
+	return WriteArchiveWith(TestPath("invalid.zar"), [](ZArchiveWriter& writer)
+		{
+			CHECK(!writer.SetBlockSize(3000));
+			CHECK(!writer.SetBlockSize(2 * 1024));
+			CHECK(!writer.SetBlockSize(8 * 1024 * 1024));
+			CHECK(writer.SetBlockSize(8 * 1024));
+			return writer.StartNewFile("a.txt");
+		});
+}
+
+ZARCHIVE_TEST(format_block_aligned_files)
+{
+	std::vector<TestFile> files = {
+		{ "small.txt", GenerateData(1000, 7, true) },
+		{ "aligned.bin", GenerateData(200000, 8, false), true },
+		{ "after.txt", GenerateData(5000, 9, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("aligned.zar"), files));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("aligned.zar")));
+	CHECK(reader);
+	CHECK(reader->GetFileDataOffset(reader->LookUp("aligned.bin")) % reader->GetBlockSize() == 0);
+	return VerifyTestArchive(reader.get(), files);
+}
+
+ZARCHIVE_TEST(format_corrupt_archive)
+{
+	std::vector<TestFile> files = { { "a.txt", GenerateData(100000, 10, true) } };
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	std::vector<uint8_t> data = ReadWholeFile(TestPath("a.zar"));
+	// truncated archives and a damaged footer are rejected when opening
+	{
+		std::ofstream file(TestPath("truncated.zar"), std::ios::binary);
+		file.write((const char*)data.data(), data.size() - 1);
+	}
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFile(TestPath("truncated.zar"))));
+	data[data.size() - 1] ^= 0xFF;
+	{
+		std::ofstream file(TestPath("damaged.zar"), std::ios::binary);
+		file.write((const char*)data.data(), data.size());
+	}
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFile(TestPath("damaged.zar"))));
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFile(TestPath("missing.zar"))));
+	return true;
+}
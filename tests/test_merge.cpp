@@ -0,0 +1,82 @@
+#include "testutil.h"
+
+#include <memory>
+
+namespace fs = std::filesystem;
+
+ZARCHIVE_TEST(merge_archives)
+{
+	std::vector<TestFile> filesA = {
+		{ "a.txt", GenerateData(200000, 40, true) },
+		{ "shared/x.bin", GenerateData(70000, 41, false) },
+	};
+	std::vector<TestFile> filesB = {
+		{ "b.bin", GenerateData(130000, 42, false) },
+		{ "shared/y.txt", GenerateData(3000, 43, true) },
+		{ "shared/deep/z.txt", {} },
+	};
+	CHECK(WriteTestArchive(TestPath("a.zar"), filesA));
+	CHECK(WriteTestArchive(TestPath("b.zar"), filesB));
+	CHECK(WriteTestArchive(TestPath("b16k.zar"), filesB, [](ZArchiveWriter& writer) { return writer.SetBlockSize(16 * 1024); }));
+	std::unique_ptr<ZArchiveReader> readerA(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	std::unique_ptr<ZArchiveReader> readerB(ZArchiveReader::OpenFromFile(TestPath("b.zar")));
+	std::unique_ptr<ZArchiveReader> readerB16k(ZArchiveReader::OpenFromFile(TestPath("b16k.zar")));
+	CHECK(readerA && readerB && readerB16k);
+	TestFile ownFile = { "own.txt", GenerateData(5000, 44, true) };
+	CHECK(WriteArchiveWith(TestPath("merged.zar"), [&](ZArchiveWriter& writer)
+		{
+			// the current file is closed and the copied blocks start at a block boundary
+			CHECK(writer.StartNewFile(ownFile.path.c_str()));
+			writer.AppendData(ownFile.data.data(), ownFile.data.size());
+			CHECK(writer.AppendArchive(readerA.get()));
+			// the shared directory is merged
+			CHECK(writer.AppendArchive(readerB.get()));
+			CHECK(writer.AppendArchive(readerB.get(), "sub/copy"));
+			// existing files and mismatching block sizes are rejected
+			CHECK(!writer.AppendArchive(readerA.get()));
+			CHECK(!writer.AppendArchive(readerB16k.get(), "other"));
+			return true;
+		}));
+	std::vector<TestFile> files = filesA;
+	files.insert(files.end(), filesB.begin(), filesB.end());
+	for (auto& it : filesB)
+		files.push_back({ "sub/copy/" + it.path, it.data });
+	files.push_back(ownFile);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("merged.zar")));
+	CHECK(reader);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("shared")) == 3);
+	CHECK(reader->LookUp("other") == ZARCHIVE_INVALID_NODE);
+	return VerifyTestArchive(reader.get(), files);
+}
+
+// a failed append must not leave directories or files behind, and delta archives can be merged through their base
+ZARCHIVE_TEST(merge_failure_and_delta)
+{
+	std::vector<TestFile> filesA = { { "a.bin", GenerateData(300000, 45, false) } };
+	std::vector<TestFile> filesB = { { "b.bin", GenerateData(300000, 46, false) } };
+	std::vector<TestFile> filesDelta = filesA;
+	filesDelta[0].path = "d.bin";
+	filesDelta[0].data[1000] ^= 1;
+	CHECK(WriteTestArchive(TestPath("a.zar"), filesA));
+	CHECK(WriteTestArchive(TestPath("b.zar"), filesB));
+	std::unique_ptr<ZArchiveReader> readerA(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	std::unique_ptr<ZArchiveReader> readerB(ZArchiveReader::OpenFromFile(TestPath("b.zar")));
+	CHECK(readerA && readerB);
+	CHECK(WriteTestArchive(TestPath("delta.zar"), filesDelta, [&](ZArchiveWriter& writer) { return writer.SetDeltaBase(readerA.get()); }));
+	std::unique_ptr<ZArchiveReader> readerDelta(ZArchiveReader::OpenDelta(TestPath("a.zar"), TestPath("delta.zar")));
+	CHECK(readerDelta);
+	// the tree of b.zar is already loaded, its data can no longer be read
+	fs::resize_file(TestPath("b.zar"), 1000);
+	CHECK(WriteArchiveWith(TestPath("merged.zar"), [&](ZArchiveWriter& writer)
+		{
+			CHECK(writer.AppendArchive(readerA.get()));
+			CHECK(!writer.AppendArchive(readerB.get(), "new/dir"));
+			CHECK(writer.AppendArchive(readerDelta.get(), "delta"));
+			return true;
+		}));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("merged.zar")));
+	CHECK(reader);
+	CHECK(reader->LookUp("new") == ZARCHIVE_INVALID_NODE);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("")) == 2);
+	return VerifyTestArchive(reader.get(), { filesA[0], { "delta/d.bin", filesDelta[0].data } });
+}
@@ -0,0 +1,61 @@
+#include "testutil.h"
+
+#include <memory>
+#include <thread>
+#include <algorithm>
+
+// several threads write files through their own handles while the main thread adds files the regular way
+ZARCHIVE_TEST(multi_producer_writes)
+{
+	const uint32_t numThreads = 8;
+	const uint32_t filesPerThread = 6;
+	std::vector<TestFile> files;
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		for (uint32_t i = 0; i < filesPerThread; i++)
+			files.push_back({ "thread" + std::to_string(t) + "/file" + std::to_string(i) + ".bin", GenerateData(1000 + (t * 7919 + i * 104729) % 300000, t * 100 + i, (i % 2) == 0) });
+	}
+	std::vector<TestFile> mainFiles = {
+		{ "main/a.txt", GenerateData(200000, 900, true) },
+		{ "main/b.txt", GenerateData(1234, 901, true) },
+	};
+	CHECK(WriteArchiveWith(TestPath("mp.zar"), [&](ZArchiveWriter& writer)
+		{
+			for (uint32_t t = 0; t < numThreads; t++)
+				CHECK(writer.MakeDir(("thread" + std::to_string(t)).c_str()));
+			CHECK(writer.MakeDir("main"));
+			std::vector<std::thread> threads;
+			for (uint32_t t = 0; t < numThreads; t++)
+			{
+				threads.emplace_back([&, t]()
+					{
+						for (uint32_t i = 0; i < filesPerThread; i++)
+						{
+							const TestFile& file = files[t * filesPerThread + i];
+							ZArchiveWriter::FileWriter* fileWriter = writer.OpenFile(file.path.c_str());
+							if (!fileWriter)
+								continue;
+							// uneven pieces, some smaller and some larger than a block
+							size_t pieceSize = 777 + i * 40000;
+							for (size_t offset = 0; offset < file.data.size(); offset += pieceSize)
+								fileWriter->AppendData(file.data.data() + offset, std::min(pieceSize, file.data.size() - offset));
+							writer.CloseFile(fileWriter);
+						}
+					});
+			}
+			for (auto& it : mainFiles)
+			{
+				CHECK(writer.StartNewFile(it.path.c_str()));
+				writer.AppendData(it.data.data(), it.data.size());
+			}
+			for (auto& it : threads)
+				it.join();
+			// names which are already taken are rejected
+			CHECK(writer.OpenFile("main/a.txt") == nullptr);
+			return true;
+		}));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("mp.zar")));
+	CHECK(reader);
+	files.insert(files.end(), mainFiles.begin(), mainFiles.end());
+	return VerifyTestArchive(reader.get(), files);
+}
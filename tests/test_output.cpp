@@ -0,0 +1,99 @@
+#include "testutil.h"
+
+#include <cstring>
+#include <thread>
+
+struct RecordingSink
+{
+	std::vector<uint8_t> data;
+	std::vector<size_t> writeSizes;
+	bool isAligned{ true };
+	std::thread::id mainThread{ std::this_thread::get_id() };
+	bool calledFromOtherThread{ false };
+};
+
+static void _output_NewOutputFile([[maybe_unused]] const int32_t partIndex, [[maybe_unused]] void* ctx)
+{
+}
+
+static void _output_WriteOutputData(const void* data, size_t length, void* ctx)
+{
+	RecordingSink* sink = (RecordingSink*)ctx;
+	if (((uintptr_t)data % 4096) != 0)
+		sink->isAligned = false;
+	if (std::this_thread::get_id() != sink->mainThread)
+		sink->calledFromOtherThread = true;
+	sink->writeSizes.emplace_back(length);
+	sink->data.insert(sink->data.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+}
+
+static bool _output_WriteArchive(RecordingSink& sink, const std::vector<TestFile>& files, size_t outputBufferSize, uint32_t asyncBufferCount = 0)
+{
+	ZArchiveWriter writer(_output_NewOutputFile, _output_WriteOutputData, &sink);
+	if (!writer.SetOutputBufferSize(outputBufferSize))
+		return false;
+	if (asyncBufferCount != 0 && !writer.EnableAsyncOutput(asyncBufferCount))
+		return false;
+	for (auto& it : files)
+	{
+		if (!writer.StartNewFile(it.path.c_str()))
+			return false;
+		writer.AppendData(it.data.data(), it.data.size());
+	}
+	writer.Finalize();
+	return true;
+}
+
+// buffering only changes how the output is split into callbacks, never the output itself
+ZARCHIVE_TEST(output_buffering)
+{
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(900000, 60, true) },
+		{ "b.bin", GenerateData(300000, 61, false) },
+	};
+	for (uint32_t i = 0; i < 200; i++)
+		files.push_back({ "file" + std::to_string(i), GenerateData(i, 62 + i, true) });
+	RecordingSink unbuffered;
+	CHECK(_output_WriteArchive(unbuffered, files, 0));
+	// without a buffer every fragment is passed through, including the small ones of the name table
+	CHECK(unbuffered.writeSizes.size() > 200);
+	const size_t bufferSize = 64 * 1024;
+	RecordingSink buffered;
+	CHECK(_output_WriteArchive(buffered, files, bufferSize));
+	CHECK(buffered.data == unbuffered.data);
+	CHECK(buffered.isAligned);
+	CHECK(buffered.writeSizes.size() == (buffered.data.size() + bufferSize - 1) / bufferSize);
+	for (size_t i = 0; i + 1 < buffered.writeSizes.size(); i++)
+		CHECK(buffered.writeSizes[i] == bufferSize);
+	// sizes which are not a multiple of 4KiB are rejected
+	RecordingSink invalid;
+	CHECK(!_output_WriteArchive(invalid, files, 1000));
+	return true;
+}
+
+// the output thread has to deliver the chunks in order and the writer has to drain it when finalizing
+ZARCHIVE_TEST(async_output)
+{
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(2000000, 70, true) },
+		{ "b.bin", GenerateData(700000, 71, false) },
+		{ "c.txt", GenerateData(5000, 72, true) },
+	};
+	const size_t bufferSize = 16 * 1024;
+	RecordingSink sync;
+	CHECK(_output_WriteArchive(sync, files, bufferSize));
+	CHECK(!sync.calledFromOtherThread);
+	for (uint32_t bufferCount : { 2u, 5u })
+	{
+		RecordingSink async;
+		CHECK(_output_WriteArchive(async, files, bufferSize, bufferCount));
+		CHECK(async.calledFromOtherThread);
+		CHECK(async.isAligned);
+		CHECK(async.data == sync.data);
+	}
+	// an output buffer and at least two chunks are required
+	RecordingSink invalid;
+	CHECK(!_output_WriteArchive(invalid, files, 0, 4));
+	CHECK(!_output_WriteArchive(invalid, files, bufferSize, 1));
+	return true;
+}
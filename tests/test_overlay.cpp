@@ -0,0 +1,114 @@
+#include "testutil.h"
+
+#include <memory>
+#include <cstring>
+
+#include "zarchive/zarchiveoverlay.h"
+
+static bool _overlay_VerifyFile(ZArchiveOverlay* overlay, std::string_view path, const std::vector<uint8_t>& expectedData)
+{
+	ZArchiveNodeHandle nodeHandle = overlay->LookUp(path);
+	CHECK(nodeHandle != ZARCHIVE_INVALID_NODE);
+	CHECK(overlay->IsFile(nodeHandle));
+	CHECK(overlay->GetFileSize(nodeHandle) == expectedData.size());
+	std::vector<uint8_t> data(expectedData.size() + 16);
+	CHECK(overlay->ReadFromFile(nodeHandle, 0, data.size(), data.data()) == expectedData.size());
+	CHECK(memcmp(data.data(), expectedData.data(), expectedData.size()) == 0);
+	return true;
+}
+
+ZARCHIVE_TEST(overlay_shadowing)
+{
+	std::vector<TestFile> layer0 = {
+		{ "data/a.txt", GenerateData(100000, 80, true) },
+		{ "data/b.bin", GenerateData(200000, 81, false) },
+		{ "config/settings.ini", GenerateData(500, 82, true) },
+		{ "old.bin", GenerateData(3000, 83, false) },
+	};
+	std::vector<TestFile> layer1 = {
+		{ "DATA/A.TXT", GenerateData(5000, 84, true) }, // names are compared case-insensitively
+		{ "data/new.txt", GenerateData(7000, 85, true) },
+		{ "config", GenerateData(100, 86, true) }, // a file shadows a directory
+	};
+	std::vector<TestFile> layer2 = {
+		{ "old.bin/inner.txt", GenerateData(2000, 87, true) }, // and a directory shadows a file
+		{ "data/new.txt", GenerateData(9000, 88, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("layer0.zar"), layer0));
+	CHECK(WriteTestArchive(TestPath("layer1.zar"), layer1));
+	CHECK(WriteTestArchive(TestPath("layer2.zar"), layer2));
+	// a small cache is divided between the layers
+	std::unique_ptr<ZArchiveOverlay> overlay(ZArchiveOverlay::OpenFromFiles({ TestPath("layer0.zar"), TestPath("layer1.zar"), TestPath("layer2.zar") }, 256 * 1024));
+	CHECK(overlay);
+	CHECK(overlay->GetLayerCount() == 3);
+	if (!_overlay_VerifyFile(overlay.get(), "data/a.txt", layer1[0].data) ||
+		!_overlay_VerifyFile(overlay.get(), "data/b.bin", layer0[1].data) ||
+		!_overlay_VerifyFile(overlay.get(), "Data/New.txt", layer2[1].data) ||
+		!_overlay_VerifyFile(overlay.get(), "config", layer1[2].data) ||
+		!_overlay_VerifyFile(overlay.get(), "old.bin/inner.txt", layer2[0].data))
+		return false;
+	CHECK(overlay->LookUp("config/settings.ini") == ZARCHIVE_INVALID_NODE);
+	CHECK(overlay->LookUp("old.bin", true, false) == ZARCHIVE_INVALID_NODE);
+	CHECK(overlay->IsDirectory(overlay->LookUp("old.bin")));
+	// the merged directory lists each name once, sorted, using the name of the highest layer
+	ZArchiveNodeHandle dataHandle = overlay->LookUp("data", false, true);
+	CHECK(dataHandle != ZARCHIVE_INVALID_NODE);
+	CHECK(overlay->GetDirEntryCount(dataHandle) == 3);
+	const char* expectedNames[] = { "A.TXT", "b.bin", "new.txt" };
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		ZArchiveOverlay::DirEntry dirEntry;
+		CHECK(overlay->GetDirEntry(dataHandle, i, dirEntry));
+		CHECK(dirEntry.name == expectedNames[i]);
+		CHECK(dirEntry.isFile);
+	}
+	CHECK(overlay->GetDirEntryCount(overlay->LookUp("")) == 3);
+	// the source layer of each node
+	uint32_t layerIndex;
+	ZArchiveNodeHandle layerNodeHandle;
+	CHECK(overlay->GetNodeSource(overlay->LookUp("data/b.bin"), layerIndex, layerNodeHandle));
+	CHECK(layerIndex == 0 && layerNodeHandle == overlay->GetLayer(0)->LookUp("data/b.bin"));
+	CHECK(overlay->GetNodeSource(overlay->LookUp("data/a.txt"), layerIndex, layerNodeHandle));
+	CHECK(layerIndex == 1);
+	CHECK(overlay->GetNodeSource(overlay->LookUp("data"), layerIndex, layerNodeHandle));
+	CHECK(layerIndex == 2);
+	CHECK(!overlay->GetNodeSource(ZARCHIVE_INVALID_NODE, layerIndex, layerNodeHandle));
+	// a missing layer fails the whole overlay
+	CHECK(!std::unique_ptr<ZArchiveOverlay>(ZArchiveOverlay::OpenFromFiles({ TestPath("layer0.zar"), TestPath("missing.zar") })));
+	return true;
+}
+
+// the layers share one cache, so a small layer which is read often is not pushed out by reads from a much larger one
+ZARCHIVE_TEST(overlay_shared_cache)
+{
+	std::vector<TestFile> layer0 = {
+		{ "large.bin", GenerateData(8 * 1024 * 1024, 89, false) },
+	};
+	std::vector<TestFile> layer1 = {
+		{ "small.txt", GenerateData(200000, 90, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("layer0.zar"), layer0));
+	CHECK(WriteTestArchive(TestPath("layer1.zar"), layer1));
+	std::unique_ptr<ZArchiveOverlay> overlay(ZArchiveOverlay::OpenFromFiles({ TestPath("layer0.zar"), TestPath("layer1.zar") }, 2 * 1024 * 1024));
+	CHECK(overlay);
+	ZArchiveNodeHandle largeHandle = overlay->LookUp("large.bin");
+	std::vector<uint8_t> buffer(256 * 1024);
+	for (uint32_t round = 0; round < 24; round++)
+	{
+		// the large layer streams through new data every round
+		uint64_t offset = round * buffer.size();
+		CHECK(overlay->ReadFromFile(largeHandle, offset, buffer.size(), buffer.data()) == buffer.size());
+		CHECK(memcmp(buffer.data(), layer0[0].data.data() + offset, buffer.size()) == 0);
+		if (!_overlay_VerifyFile(overlay.get(), "small.txt", layer1[0].data))
+			return false;
+		if (round == 3)
+			overlay->GetLayer(1)->ResetStats();
+	}
+	ZArchiveReader::Stats stats;
+	if (overlay->GetLayer(1)->GetStats(stats))
+	{
+		CHECK(stats.bytesReadFromDisk == 0);
+		CHECK(stats.sharedCacheHits > 0);
+	}
+	return true;
+}
@@ -0,0 +1,184 @@
+#include "testutil.h"
+
+#include <memory>
+#include <cstring>
+#include <thread>
+#include <atomic>
+
+#include "zarchive/zarchivesharedcache.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+// reads random ranges and returns the number of mismatches
+static uint32_t _sharedCache_ReadRandomRanges(ZArchiveReader* reader, const std::vector<TestFile>& files, uint64_t seed, uint32_t count)
+{
+	uint32_t numMismatches = 0;
+	uint64_t state = 0x9E3779B97F4A7C15ull * (seed + 1);
+	std::vector<uint8_t> buffer;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		const TestFile& file = files[(size_t)(state >> 33) % files.size()];
+		uint64_t offset = (state >> 17) % file.data.size();
+		uint64_t length = std::min<uint64_t>(1 + (state >> 40) % 100000, file.data.size() - offset);
+		buffer.resize(length);
+		if (reader->ReadFromFile(reader->LookUp(file.path), offset, length, buffer.data()) != length || memcmp(buffer.data(), file.data.data() + offset, length) != 0)
+			numMismatches++;
+	}
+	return numMismatches;
+}
+
+ZARCHIVE_TEST(shared_cache)
+{
+	std::string cacheName = "zarchive_test_" + std::to_string(std::hash<std::string>()(TestPath("").string()) & 0xFFFFFFFF);
+	ZArchiveSharedCache::Remove(cacheName.c_str());
+	std::unique_ptr<ZArchiveSharedCache> cache(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 1024 * 1024));
+	if (!cache)
+	{
+		puts("Shared memory is unavailable, skipped");
+		return true;
+	}
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(1500000, 90, true) },
+		{ "b.bin", GenerateData(700000, 91, false) },
+	};
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	CHECK(WriteTestArchive(TestPath("large.zar"), files, [](ZArchiveWriter& writer) { return writer.SetBlockSize(256 * 1024); }));
+	// a second handle to the same segment must agree on the slot size
+	CHECK(!std::unique_ptr<ZArchiveSharedCache>(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 1024 * 1024, 32 * 1024)));
+	std::unique_ptr<ZArchiveSharedCache> cache2(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 1024 * 1024));
+	CHECK(cache2 && cache2->GetSlotCount() == cache->GetSlotCount());
+	// blocks larger than a slot cannot be shared
+	std::unique_ptr<ZArchiveReader> largeReader(ZArchiveReader::OpenFromFile(TestPath("large.zar")));
+	CHECK(largeReader);
+	CHECK(!largeReader->SetSharedCache(cache.get()));
+	// the first reader fills the shared cache, the second one finds the blocks there
+	std::unique_ptr<ZArchiveReader> reader1(ZArchiveReader::OpenFromFile(TestPath("a.zar"), 0));
+	std::unique_ptr<ZArchiveReader> reader2(ZArchiveReader::OpenFromFile(TestPath("a.zar"), 0));
+	CHECK(reader1 && reader2);
+	CHECK(reader1->SetSharedCache(cache.get()));
+	CHECK(reader2->SetSharedCache(cache2.get()));
+	if (!VerifyTestArchive(reader1.get(), files))
+		return false;
+	reader2->ResetStats();
+	if (!VerifyTestArchive(reader2.get(), files))
+		return false;
+	ZArchiveReader::Stats stats;
+	if (reader2->GetStats(stats))
+	{
+		CHECK(stats.sharedCacheHits > 0);
+		CHECK(stats.bytesReadFromDisk < 700000);
+	}
+	// threads of one process and several processes read through the cache at the same time
+#if defined(__unix__) || defined(__APPLE__)
+	std::vector<pid_t> children;
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			// the child uses its own handles to the segment and the archive
+			std::unique_ptr<ZArchiveSharedCache> childCache(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 1024 * 1024));
+			std::unique_ptr<ZArchiveReader> childReader(ZArchiveReader::OpenFromFile(TestPath("a.zar"), 64 * 1024));
+			if (!childCache || !childReader || !childReader->SetSharedCache(childCache.get()))
+				_exit(2);
+			_exit(_sharedCache_ReadRandomRanges(childReader.get(), files, 100 + i, 300) == 0 ? 0 : 1);
+		}
+		CHECK(pid > 0);
+		children.push_back(pid);
+	}
+#endif
+	std::atomic<uint32_t> numMismatches{ 0 };
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < 4; t++)
+		threads.emplace_back([&, t]() { numMismatches += _sharedCache_ReadRandomRanges(reader1.get(), files, t, 300); });
+	for (auto& it : threads)
+		it.join();
+	CHECK(numMismatches == 0);
+#if defined(__unix__) || defined(__APPLE__)
+	for (pid_t pid : children)
+	{
+		int status = 0;
+		CHECK(waitpid(pid, &status, 0) == pid);
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+#endif
+	reader1.reset();
+	reader2.reset();
+	cache.reset();
+	cache2.reset();
+	CHECK(ZArchiveSharedCache::Remove(cacheName.c_str()));
+	return true;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// writes distinct blocks into a cache of a single set and returns how many of them can be read back
+static uint32_t _sharedCache_CountWritableSlots(ZArchiveSharedCache* cache, const uint8_t* archiveHash, uint64_t firstBlockIndex, const std::vector<uint8_t>& data)
+{
+	for (uint64_t i = 0; i < cache->GetSlotCount(); i++)
+		cache->WriteBlock(archiveHash, firstBlockIndex + i, data.data(), (uint32_t)data.size());
+	std::vector<uint8_t> buffer(data.size());
+	uint32_t numReadable = 0;
+	for (uint64_t i = 0; i < cache->GetSlotCount(); i++)
+	{
+		if (cache->ReadBlock(archiveHash, firstBlockIndex + i, buffer.data(), (uint32_t)buffer.size()) && buffer == data)
+			numReadable++;
+	}
+	return numReadable;
+}
+#endif
+
+// slots claimed by writers which were killed while writing are taken over once the claim times out
+ZARCHIVE_TEST(shared_cache_abandoned_claims)
+{
+#if defined(__unix__) || defined(__APPLE__)
+	std::string cacheName = "zarchive_test_claims_" + std::to_string(std::hash<std::string>()(TestPath("").string()) & 0xFFFFFFFF);
+	ZArchiveSharedCache::Remove(cacheName.c_str());
+	std::unique_ptr<ZArchiveSharedCache> cache(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 64 * 1024));
+	if (!cache)
+	{
+		puts("Shared memory is unavailable, skipped");
+		return true;
+	}
+	CHECK(cache->GetSlotCount() == 8); // a single set
+	uint8_t archiveHash[32] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+	std::vector<uint8_t> data = GenerateData(64 * 1024, 95, false);
+	uint64_t nextBlockIndex = 0;
+	CHECK(_sharedCache_CountWritableSlots(cache.get(), archiveHash, nextBlockIndex, data) == 8);
+	nextBlockIndex += 8;
+	// kill writers until one of them leaves a slot claimed
+	bool hasAbandonedClaim = false;
+	for (uint32_t round = 0; round < 100 && !hasAbandonedClaim; round++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			std::unique_ptr<ZArchiveSharedCache> childCache(ZArchiveSharedCache::Open(cacheName.c_str(), 8 * 64 * 1024));
+			if (!childCache)
+				_exit(2);
+			for (uint64_t blockIndex = 1000000 * (round + 1);; blockIndex++)
+				childCache->WriteBlock(archiveHash, blockIndex, data.data(), (uint32_t)data.size());
+		}
+		CHECK(pid > 0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		kill(pid, SIGKILL);
+		int status = 0;
+		CHECK(waitpid(pid, &status, 0) == pid);
+		CHECK(WIFSIGNALED(status));
+		hasAbandonedClaim = _sharedCache_CountWritableSlots(cache.get(), archiveHash, nextBlockIndex, data) < 8;
+		nextBlockIndex += 8;
+	}
+	if (!hasAbandonedClaim)
+		puts("No writer was killed while holding a claim");
+	// the claims of the killed writers expire after a few seconds
+	std::this_thread::sleep_for(std::chrono::seconds(4));
+	CHECK(_sharedCache_CountWritableSlots(cache.get(), archiveHash, nextBlockIndex, data) == 8);
+	cache.reset();
+	CHECK(ZArchiveSharedCache::Remove(cacheName.c_str()));
+#endif
+	return true;
+}
@@ -0,0 +1,71 @@
+#include "testutil.h"
+
+#include <memory>
+
+namespace fs = std::filesystem;
+
+static fs::path _split_PartPath(const char* name, size_t partIndex)
+{
+	std::string partName = name;
+	partName += ".";
+	partName += std::to_string(partIndex);
+	return TestPath(partName);
+}
+
+static std::vector<TestFile> _split_TestFiles()
+{
+	// random data does not compress, so the archive spans many parts
+	return {
+		{ "a.bin", GenerateData(400000, 20, false) },
+		{ "dir/b.txt", GenerateData(300000, 21, true) },
+		{ "dir/c.bin", GenerateData(150000, 22, false) },
+	};
+}
+
+ZARCHIVE_TEST(split_archive)
+{
+	const uint64_t partSize = 64 * 1024;
+	std::vector<TestFile> files = _split_TestFiles();
+	CHECK(WriteTestArchive(TestPath("split.zar"), files, [&](ZArchiveWriter& writer) { return writer.SetSplitSize(partSize); }));
+	std::vector<fs::path> partPaths = { TestPath("split.zar") };
+	while (fs::exists(_split_PartPath("split.zar", partPaths.size())))
+		partPaths.emplace_back(_split_PartPath("split.zar", partPaths.size()));
+	CHECK(partPaths.size() >= 8);
+	// every part except the last one is full
+	for (size_t i = 0; i < partPaths.size() - 1; i++)
+		CHECK(fs::file_size(partPaths[i]) == partSize);
+	CHECK(fs::file_size(partPaths.back()) <= partSize);
+	// the first part alone is not a complete archive, the remaining parts are found by name
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFiles({ partPaths[0] })));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("split.zar")));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	reader.reset(ZArchiveReader::OpenFromFiles(partPaths));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	reader.reset();
+	// a missing part is detected
+	fs::remove(partPaths.back());
+	CHECK(!std::unique_ptr<ZArchiveReader>(ZArchiveReader::OpenFromFile(TestPath("split.zar"))));
+	return true;
+}
+
+// parts left over from an older and larger archive of the same name are not picked up
+ZARCHIVE_TEST(split_stale_parts)
+{
+	std::vector<TestFile> largeFiles = _split_TestFiles();
+	CHECK(WriteTestArchive(TestPath("split.zar"), largeFiles, [](ZArchiveWriter& writer) { return writer.SetSplitSize(64 * 1024); }));
+	CHECK(fs::exists(_split_PartPath("split.zar", 8)));
+	std::vector<TestFile> files = {
+		{ "small.bin", GenerateData(150000, 23, false) },
+	};
+	CHECK(WriteTestArchive(TestPath("split.zar"), files, [](ZArchiveWriter& writer) { return writer.SetSplitSize(64 * 1024); }));
+	CHECK(fs::exists(_split_PartPath("split.zar", 2)));
+	CHECK(fs::exists(_split_PartPath("split.zar", 8)));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("split.zar")));
+	CHECK(reader);
+	CHECK(reader->LookUp("a.bin") == ZARCHIVE_INVALID_NODE);
+	return VerifyTestArchive(reader.get(), files);
+}
@@ -0,0 +1,166 @@
+#include "testutil.h"
+
+#include <memory>
+#include <thread>
+#include <atomic>
+
+ZARCHIVE_TEST(reader_stats)
+{
+	const uint32_t blockSize = 64 * 1024;
+	std::vector<TestFile> files = { { "a.txt", GenerateData(4 * blockSize, 40, true) } };
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	ZArchiveReader::Stats stats;
+	if (!reader->GetStats(stats))
+	{
+		puts("Stats are compiled out (ZARCHIVE_ENABLE_STATS=OFF)");
+		return true;
+	}
+	CHECK(stats.cacheHits == 0 && stats.cacheMisses == 0 && stats.bytesDecompressed == 0);
+	ZArchiveNodeHandle fileHandle = reader->LookUp("a.txt");
+	CHECK(fileHandle != ZARCHIVE_INVALID_NODE);
+	// small reads go through the cache, so every block is decompressed exactly once
+	std::vector<uint8_t> buffer(1000);
+	uint32_t numReads = 0;
+	uint32_t numBlockAccesses = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (uint64_t offset = 0; offset < files[0].data.size(); offset += buffer.size())
+		{
+			CHECK(reader->ReadFromFile(fileHandle, offset, buffer.size(), buffer.data()) != 0);
+			numReads++;
+			uint64_t lastByte = std::min<uint64_t>(offset + buffer.size(), files[0].data.size()) - 1;
+			numBlockAccesses += (uint32_t)(lastByte / blockSize - offset / blockSize) + 1;
+		}
+	}
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.cacheMisses == 4);
+	CHECK(stats.cacheHits == numBlockAccesses - 4);
+	CHECK(stats.cacheEvictions == 0);
+	CHECK(stats.bytesDecompressed == 4 * blockSize);
+	CHECK(stats.bytesReadFromDisk > 0 && stats.bytesReadFromDisk < 4 * blockSize);
+	uint64_t numLatencySamples = 0;
+	for (size_t i = 0; i < ZArchiveReader::Stats::kHistogramBuckets; i++)
+		numLatencySamples += stats.readFromFileLatency[i];
+	CHECK(numLatencySamples == numReads);
+	numLatencySamples = 0;
+	for (size_t i = 0; i < ZArchiveReader::Stats::kHistogramBuckets; i++)
+		numLatencySamples += stats.lookUpLatency[i];
+	CHECK(numLatencySamples == 1);
+	CHECK(stats.memoryUsage >= 4 * 1024 * 1024);
+	return true;
+}
+
+// whole blocks of block-aligned files bypass the cache, blocks of other files are cached since they can be shared with neighbours
+ZARCHIVE_TEST(reader_stats_cache_bypass)
+{
+	const uint32_t blockSize = 64 * 1024;
+	std::vector<TestFile> files = {
+		{ "head.txt", GenerateData(1000, 41, true) },
+		{ "unaligned.txt", GenerateData(8 * blockSize + 500, 42, true) },
+		{ "aligned.txt", GenerateData(8 * blockSize, 43, true), true },
+	};
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	ZArchiveReader::Stats stats;
+	if (!reader->GetStats(stats))
+	{
+		puts("Stats are compiled out (ZARCHIVE_ENABLE_STATS=OFF)");
+		return true;
+	}
+	std::vector<uint8_t> buffer(9 * blockSize);
+	// the unaligned file touches 9 blocks, each of them is decompressed once and then read from the cache
+	for (int pass = 0; pass < 2; pass++)
+		CHECK(reader->ReadFromFile(reader->LookUp("unaligned.txt"), 0, buffer.size(), buffer.data()) == files[1].data.size());
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.bytesDecompressed == 9 * blockSize);
+	CHECK(stats.cacheMisses == 9 && stats.cacheHits == 9);
+	// the first block is shared with the preceding file
+	CHECK(reader->ReadFromFile(reader->LookUp("head.txt"), 0, buffer.size(), buffer.data()) == files[0].data.size());
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.bytesDecompressed == 9 * blockSize && stats.cacheHits == 10);
+	// the aligned file is decompressed straight into the output buffer on every read
+	reader->ResetStats();
+	for (int pass = 0; pass < 2; pass++)
+		CHECK(reader->ReadFromFile(reader->LookUp("aligned.txt"), 0, buffer.size(), buffer.data()) == files[2].data.size());
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.bytesDecompressed == 16 * blockSize);
+	CHECK(stats.cacheMisses == 16 && stats.cacheHits == 0);
+	return VerifyTestArchive(reader.get(), files);
+}
+
+// counters of all threads add up while another thread polls them, and growing buffers are accounted for in the memory usage
+ZARCHIVE_TEST(reader_stats_concurrent)
+{
+	const uint32_t blockSize = 64 * 1024;
+	std::vector<TestFile> files = { { "a.txt", GenerateData(4 * blockSize, 44, true) } };
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	ZArchiveReader::Stats stats;
+	if (!reader->GetStats(stats))
+	{
+		puts("Stats are compiled out (ZARCHIVE_ENABLE_STATS=OFF)");
+		return true;
+	}
+	uint64_t initialMemoryUsage = stats.memoryUsage;
+	reader->StartTracing();
+	reader->SetCompressedCacheSize(1024 * 1024);
+	ZArchiveNodeHandle fileHandle = reader->LookUp("a.txt");
+	const uint32_t numThreads = 8;
+	const uint32_t readSize = 3000;
+	std::atomic<bool> stopPolling{ false };
+	std::atomic<uint32_t> numErrors{ 0 };
+	std::thread poller([&]()
+		{
+			uint64_t prevAccesses = 0;
+			while (!stopPolling)
+			{
+				ZArchiveReader::Stats pollStats;
+				if (!reader->GetStats(pollStats) || pollStats.cacheHits + pollStats.cacheMisses < prevAccesses)
+					numErrors++;
+				prevAccesses = pollStats.cacheHits + pollStats.cacheMisses;
+			}
+		});
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		threads.emplace_back([&]()
+			{
+				std::vector<uint8_t> buffer(readSize);
+				for (uint64_t offset = 0; offset < files[0].data.size(); offset += readSize)
+				{
+					if (reader->ReadFromFile(fileHandle, offset, readSize, buffer.data()) == 0)
+						numErrors++;
+				}
+			});
+	}
+	for (auto& it : threads)
+		it.join();
+	stopPolling = true;
+	poller.join();
+	CHECK(numErrors == 0);
+	uint32_t numReads = 0;
+	uint32_t numBlockAccesses = 0;
+	for (uint64_t offset = 0; offset < files[0].data.size(); offset += readSize)
+	{
+		numReads++;
+		uint64_t lastByte = std::min<uint64_t>(offset + readSize, files[0].data.size()) - 1;
+		numBlockAccesses += (uint32_t)(lastByte / blockSize - offset / blockSize) + 1;
+	}
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.cacheHits + stats.cacheMisses == numThreads * numBlockAccesses);
+	uint64_t numLatencySamples = 0;
+	for (size_t i = 0; i < ZArchiveReader::Stats::kHistogramBuckets; i++)
+		numLatencySamples += stats.readFromFileLatency[i];
+	CHECK(numLatencySamples == numThreads * numReads);
+	// trace records and the compressed blocks
+	CHECK(stats.memoryUsage >= initialMemoryUsage + numThreads * numBlockAccesses * sizeof(_ZARCHIVE::TraceRecord) + stats.bytesReadFromDisk);
+	reader->SetCompressedCacheSize(0);
+	CHECK(reader->GetStats(stats));
+	CHECK(stats.memoryUsage >= initialMemoryUsage + numThreads * numBlockAccesses * sizeof(_ZARCHIVE::TraceRecord));
+	CHECK(stats.memoryUsage < initialMemoryUsage + numThreads * numBlockAccesses * sizeof(_ZARCHIVE::TraceRecord) * 2 + 1024);
+	return true;
+}
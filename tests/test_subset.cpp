@@ -0,0 +1,59 @@
+#include "testutil.h"
+
+#include <memory>
+#include <cstring>
+#include <zstd.h>
+
+static bool _subset_SelectPublic(std::string_view path, [[maybe_unused]] bool isDirectory, [[maybe_unused]] void* ctx)
+{
+	return path == "public" || path == "readme.txt";
+}
+
+// unselected files which share a block with selected ones must not leak into the subset
+ZARCHIVE_TEST(subset_scrub)
+{
+	std::vector<uint8_t> secret = GenerateData(6000, 50, false);
+	std::vector<TestFile> files = {
+		{ "readme.txt", GenerateData(4000, 51, true) },
+		{ "secret.bin", secret },
+		{ "public/a.bin", GenerateData(150000, 52, false) },
+		{ "public/b.txt", GenerateData(2000, 53, true) },
+		{ "private/c.txt", GenerateData(90000, 54, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("full.zar"), files));
+	std::unique_ptr<ZArchiveReader> source(ZArchiveReader::OpenFromFile(TestPath("full.zar")));
+	CHECK(source);
+	// the secret shares its block with selected files
+	const uint32_t blockSize = source->GetBlockSize();
+	CHECK(source->GetFileDataOffset(source->LookUp("secret.bin")) / blockSize == source->GetFileDataOffset(source->LookUp("readme.txt")) / blockSize);
+	CHECK(WriteArchiveWith(TestPath("subset.zar"), [&](ZArchiveWriter& writer) { return writer.AppendArchive(source.get(), "", _subset_SelectPublic, nullptr); }));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("subset.zar")));
+	CHECK(reader);
+	CHECK(reader->LookUp("secret.bin") == ZARCHIVE_INVALID_NODE);
+	CHECK(reader->LookUp("private") == ZARCHIVE_INVALID_NODE);
+	std::vector<TestFile> selectedFiles = { files[0], files[2], files[3] };
+	if (!VerifyTestArchive(reader.get(), selectedFiles))
+		return false;
+	// neither the stored nor the decompressed blocks contain any part of the secret
+	std::vector<uint8_t> storedData;
+	std::vector<uint32_t> storedSizes;
+	CHECK(reader->ReadStoredBlocks(0, (uint32_t)reader->GetBlockCount(), storedData, storedSizes));
+	std::vector<uint8_t> decompressedData;
+	size_t storedOffset = 0;
+	for (uint32_t storedSize : storedSizes)
+	{
+		std::vector<uint8_t> block(blockSize, 0);
+		if (storedSize == blockSize)
+			memcpy(block.data(), storedData.data() + storedOffset, blockSize);
+		else if (storedSize != 0)
+			CHECK(ZSTD_decompress(block.data(), blockSize, storedData.data() + storedOffset, storedSize) == blockSize);
+		decompressedData.insert(decompressedData.end(), block.begin(), block.end());
+		storedOffset += storedSize;
+	}
+	for (size_t offset = 0; offset + 64 <= secret.size(); offset += 1000)
+	{
+		CHECK(!ContainsBytes(storedData, secret.data() + offset, 64));
+		CHECK(!ContainsBytes(decompressedData, secret.data() + offset, 64));
+	}
+	return true;
+}
@@ -0,0 +1,275 @@
+#include "testutil.h"
+
+#include <fstream>
+#include <cstdlib>
+#include <memory>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// runs the tool with the given arguments, each one is quoted. The output goes to a file to keep the test log short
+static int _tool_Run(std::initializer_list<std::string> arguments)
+{
+	std::string command = "\"";
+	command += GetToolPath().string();
+	command += "\"";
+	for (auto& it : arguments)
+	{
+		command += " \"";
+		command += it;
+		command += "\"";
+	}
+	command += " > \"";
+	command += TestPath("tool_output.txt").string();
+	command += "\"";
+	return std::system(command.c_str());
+}
+
+static bool _tool_WriteFile(const fs::path& path, const std::vector<uint8_t>& data)
+{
+	std::ofstream file(path, std::ios::binary);
+	file.write((const char*)data.data(), data.size());
+	return file.good();
+}
+
+// --order stores the listed files first, in the listed order and matched like archive paths. Unlisted files follow
+ZARCHIVE_TEST(tool_access_order)
+{
+	CHECK(!GetToolPath().empty());
+	const char* paths[] = { "a.txt", "b.txt", "dir/c.txt", "dir/d.txt", "e.txt" };
+	fs::create_directories(TestPath("input/dir"));
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+		CHECK(_tool_WriteFile(TestPath("input") / paths[i], GenerateData(20000, 200 + i, true)));
+	{
+		std::ofstream orderFile(TestPath("order.txt"), std::ios::binary);
+		orderFile << "DIR/D.TXT\r\n" << "missing.txt\n" << "/b.txt\n" << "dir/d.txt\n" << "e.txt\n";
+	}
+	CHECK(_tool_Run({ std::string("--order=") + TestPath("order.txt").string(), TestPath("input").string(), TestPath("ordered.zar").string() }) == 0);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("ordered.zar")));
+	CHECK(reader);
+	uint64_t offsetD = reader->GetFileDataOffset(reader->LookUp("dir/d.txt"));
+	uint64_t offsetB = reader->GetFileDataOffset(reader->LookUp("b.txt"));
+	uint64_t offsetE = reader->GetFileDataOffset(reader->LookUp("e.txt"));
+	CHECK(offsetD == 0);
+	CHECK(offsetB > offsetD && offsetE > offsetB);
+	CHECK(reader->GetFileDataOffset(reader->LookUp("a.txt")) > offsetE);
+	CHECK(reader->GetFileDataOffset(reader->LookUp("dir/c.txt")) > offsetE);
+	return true;
+}
+
+// many small files share blocks and large ones span several, every worker count has to reproduce the input exactly
+ZARCHIVE_TEST(tool_parallel_extract)
+{
+	CHECK(!GetToolPath().empty());
+	std::vector<TestFile> files;
+	for (uint32_t i = 0; i < 48; i++)
+	{
+		size_t size = (i % 8 == 0) ? 200000 + i * 1000 : (i % 5 == 0) ? 0 : 300 + i * 977;
+		std::string path = "dir" + std::to_string(i % 3);
+		path += "/sub" + std::to_string(i % 2);
+		path += "/file" + std::to_string(i) + ".bin";
+		files.push_back({ path, GenerateData(size, 120 + i, (i % 3) != 0) });
+	}
+	for (auto& it : files)
+	{
+		fs::create_directories((TestPath("input") / it.path).parent_path());
+		CHECK(_tool_WriteFile(TestPath("input") / it.path, it.data));
+	}
+	CHECK(_tool_Run({ "--block-size=16K", TestPath("input").string(), TestPath("a.zar").string() }) == 0);
+	std::string singleThreadDecompressed;
+	for (const char* threads : { "--threads=1", "--threads=4", "--threads=16" })
+	{
+		fs::path outputPath = TestPath(threads + 10);
+		CHECK(_tool_Run({ "--stats", threads, TestPath("a.zar").string(), outputPath.string() }) == 0);
+		// small files share blocks, no matter how they are distributed between the workers each block is decompressed once like in a sequential run
+		std::vector<uint8_t> toolOutput = ReadWholeFile(TestPath("tool_output.txt"));
+		std::string outputText(toolOutput.begin(), toolOutput.end());
+		size_t statsPos = outputText.find("Decompressed: ");
+		if (statsPos != std::string::npos)
+		{
+			std::string decompressed = outputText.substr(statsPos, outputText.find(" bytes", statsPos) - statsPos);
+			if (singleThreadDecompressed.empty())
+				singleThreadDecompressed = decompressed;
+			CHECK(decompressed == singleThreadDecompressed);
+		}
+		for (auto& it : files)
+		{
+			CHECK(fs::file_size(outputPath / it.path) == it.data.size());
+			CHECK(ReadWholeFile(outputPath / it.path) == it.data);
+		}
+	}
+	return true;
+}
+
+// the input tree is scanned and read by several threads, the archive has to come out the same regardless of their number
+ZARCHIVE_TEST(tool_parallel_pack)
+{
+	CHECK(!GetToolPath().empty());
+	std::vector<TestFile> files;
+	for (uint32_t i = 0; i < 40; i++)
+	{
+		// a few files are larger than the read-ahead budget
+		size_t size = (i % 10 == 0) ? 3 * 1024 * 1024 + i : 1000 + i * 3000;
+		std::string path = "d";
+		path += std::to_string(i % 4);
+		path += "/f";
+		path += std::to_string(i);
+		path += ".txt";
+		files.push_back({ path, GenerateData(size, 140 + i, (i % 2) == 0) });
+	}
+	files.push_back({ "empty.txt", {} });
+	for (auto& it : files)
+	{
+		fs::create_directories((TestPath("input") / it.path).parent_path());
+		CHECK(_tool_WriteFile(TestPath("input") / it.path, it.data));
+	}
+	CHECK(_tool_Run({ "--threads=1", TestPath("input").string(), TestPath("single.zar").string() }) == 0);
+	CHECK(_tool_Run({ "--threads=8", "--read-ahead=1M", TestPath("input").string(), TestPath("multi.zar").string() }) == 0);
+	CHECK(ReadWholeFile(TestPath("single.zar")) == ReadWholeFile(TestPath("multi.zar")));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("multi.zar")));
+	CHECK(reader);
+	// files are stored in sorted path order
+	std::vector<std::string> sortedPaths;
+	for (auto& it : files)
+		sortedPaths.emplace_back(it.path);
+	std::sort(sortedPaths.begin(), sortedPaths.end());
+	for (size_t i = 1; i < sortedPaths.size(); i++)
+		CHECK(reader->GetFileDataOffset(reader->LookUp(sortedPaths[i - 1])) <= reader->GetFileDataOffset(reader->LookUp(sortedPaths[i])));
+	return VerifyTestArchive(reader.get(), files);
+}
+
+// O_DIRECT output falls back to buffered writes where it is unsupported, either way the archive must not change
+ZARCHIVE_TEST(tool_direct_io)
+{
+	CHECK(!GetToolPath().empty());
+	fs::create_directories(TestPath("input"));
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(3 * 1024 * 1024 + 123, 160, true) },
+		{ "b.bin", GenerateData(500000, 161, false) },
+	};
+	for (auto& it : files)
+		CHECK(_tool_WriteFile(TestPath("input") / it.path, it.data));
+	CHECK(_tool_Run({ "--output-buffer=0", TestPath("input").string(), TestPath("plain.zar").string() }) == 0);
+	CHECK(_tool_Run({ "--output-buffer=64K", TestPath("input").string(), TestPath("buffered.zar").string() }) == 0);
+	CHECK(ReadWholeFile(TestPath("buffered.zar")) == ReadWholeFile(TestPath("plain.zar")));
+	CHECK(_tool_Run({ "--output-buffer=1000", TestPath("input").string(), TestPath("invalid.zar").string() }) != 0);
+#ifdef __linux__
+	CHECK(_tool_Run({ "--direct-io", "--output-buffer=64K", TestPath("input").string(), TestPath("direct.zar").string() }) == 0);
+	CHECK(ReadWholeFile(TestPath("direct.zar")) == ReadWholeFile(TestPath("plain.zar")));
+	// parts have to start at aligned offsets of the output chunks
+	CHECK(_tool_Run({ "--direct-io", "--split=100000", TestPath("input").string(), TestPath("unaligned.zar").string() }) != 0);
+	CHECK(_tool_Run({ "--direct-io", "--output-buffer=64K", "--split=256K", TestPath("input").string(), TestPath("split.zar").string() }) == 0);
+	CHECK(fs::exists(TestPath("split.zar.1")));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("split.zar")));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+#endif
+	return true;
+}
+
+// recompress keeps the data stream, so options which change it are refused. Delta archives are recompressed into deltas against the same base
+ZARCHIVE_TEST(tool_recompress_options)
+{
+	CHECK(!GetToolPath().empty());
+	fs::create_directories(TestPath("base"));
+	fs::create_directories(TestPath("input"));
+	std::vector<uint8_t> data = GenerateData(400000, 170, false);
+	CHECK(_tool_WriteFile(TestPath("base/a.bin"), data));
+	for (size_t i = 0; i < 100; i++)
+		data[200000 + i] ^= 0x5A;
+	CHECK(_tool_WriteFile(TestPath("input/a.bin"), data));
+	CHECK(_tool_Run({ TestPath("base").string(), TestPath("base.zar").string() }) == 0);
+	CHECK(_tool_Run({ std::string("--delta-base=") + TestPath("base.zar").string(), TestPath("input").string(), TestPath("delta.zar").string() }) == 0);
+	CHECK(_tool_Run({ "--dedup", "recompress", TestPath("dedup.zar").string(), TestPath("base.zar").string() }) != 0);
+	CHECK(!fs::exists(TestPath("dedup.zar")));
+	CHECK(_tool_Run({ "--level=1", std::string("--delta-base=") + TestPath("base.zar").string(), "recompress", TestPath("recompressed.zar").string(), TestPath("delta.zar").string() }) == 0);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("recompressed.zar")));
+	CHECK(reader);
+	return VerifyTestArchive(reader.get(), { { "a.bin", data } });
+}
+
+// extracting a sparse archive leaves the all-zero ranges of a file unallocated, also within the large read buffers of the tool
+ZARCHIVE_TEST(tool_sparse_extract)
+{
+	CHECK(!GetToolPath().empty());
+	std::vector<uint8_t> data = GenerateData(100000, 100, false);
+	data.resize(data.size() + 9 * 1024 * 1024, 0);
+	std::vector<uint8_t> tail = GenerateData(70000, 101, false);
+	data.insert(data.end(), tail.begin(), tail.end());
+	// zero ranges smaller than the read buffer of the tool
+	std::vector<uint8_t> partial(1024 * 1024, 0);
+	std::vector<uint8_t> middle = GenerateData(1000, 103, false);
+	partial.insert(partial.end(), middle.begin(), middle.end());
+	partial.resize(partial.size() + 200 * 1024, 0);
+	std::vector<uint8_t> text = GenerateData(5000, 102, true);
+	fs::create_directories(TestPath("input/dir"));
+	CHECK(_tool_WriteFile(TestPath("input/dir/sparse.bin"), data));
+	CHECK(_tool_WriteFile(TestPath("input/dir/partial.bin"), partial));
+	CHECK(_tool_WriteFile(TestPath("input/text.txt"), text));
+	CHECK(_tool_Run({ "--sparse", "--block-size=16K", TestPath("input").string(), TestPath("sparse.zar").string() }) == 0);
+	// the output is never overwritten
+	CHECK(_tool_Run({ "--sparse", TestPath("input").string(), TestPath("sparse.zar").string() }) != 0);
+	CHECK(_tool_Run({ "--threads=2", TestPath("sparse.zar").string(), TestPath("output").string() }) == 0);
+	CHECK(ReadWholeFile(TestPath("output/dir/sparse.bin")) == data);
+	CHECK(ReadWholeFile(TestPath("output/dir/partial.bin")) == partial);
+	CHECK(ReadWholeFile(TestPath("output/text.txt")) == text);
+#if defined(__unix__) || defined(__APPLE__)
+	// only checked if the file system supports sparse files at all
+	{
+		std::ofstream probe(TestPath("probe.bin"), std::ios::binary);
+	}
+	fs::resize_file(TestPath("probe.bin"), 16 * 1024 * 1024);
+	struct stat probeStat, outputStat;
+	CHECK(stat(TestPath("probe.bin").c_str(), &probeStat) == 0);
+	if ((uint64_t)probeStat.st_blocks * 512 < 1024 * 1024)
+	{
+		CHECK(stat(TestPath("output/dir/sparse.bin").c_str(), &outputStat) == 0);
+		CHECK((uint64_t)outputStat.st_blocks * 512 < 1024 * 1024);
+		CHECK(stat(TestPath("output/dir/partial.bin").c_str(), &outputStat) == 0);
+		CHECK((uint64_t)outputStat.st_blocks * 512 < 256 * 1024);
+	}
+	else
+		puts("File system does not support sparse files, allocation not checked");
+#endif
+	return true;
+}
+
+// a command which fails midway removes the parts it already wrote
+ZARCHIVE_TEST(tool_failed_split_output)
+{
+	CHECK(!GetToolPath().empty());
+	CHECK(WriteTestArchive(TestPath("a.zar"), { { "a.bin", GenerateData(600000, 180, false) } }));
+	CHECK(WriteTestArchive(TestPath("b.zar"), { { "A.BIN", GenerateData(1000, 181, false) } }));
+	// the second archive conflicts with the first one, which has been copied to the output by then
+	CHECK(_tool_Run({ "--split=64K", "--output-buffer=64K", "merge", TestPath("merged.zar").string(), TestPath("a.zar").string(), TestPath("b.zar").string() }) != 0);
+	CHECK(!fs::exists(TestPath("merged.zar")));
+	CHECK(!fs::exists(TestPath("merged.zar.1")));
+	CHECK(!fs::exists(TestPath("merged.zar.2")));
+	return true;
+}
+
+// subset reads a delta input through its base and writes the selection as a delta against the same base
+ZARCHIVE_TEST(tool_subset_delta)
+{
+	CHECK(!GetToolPath().empty());
+	fs::create_directories(TestPath("base/keep"));
+	fs::create_directories(TestPath("input/keep"));
+	std::vector<uint8_t> data = GenerateData(400000, 171, false);
+	CHECK(_tool_WriteFile(TestPath("base/keep/a.bin"), data));
+	for (size_t i = 0; i < 100; i++)
+		data[300000 + i] ^= 0x5A;
+	CHECK(_tool_WriteFile(TestPath("input/keep/a.bin"), data));
+	CHECK(_tool_WriteFile(TestPath("input/drop.bin"), GenerateData(100000, 172, false)));
+	std::string deltaBase = std::string("--delta-base=") + TestPath("base.zar").string();
+	CHECK(_tool_Run({ TestPath("base").string(), TestPath("base.zar").string() }) == 0);
+	CHECK(_tool_Run({ deltaBase, TestPath("input").string(), TestPath("delta.zar").string() }) == 0);
+	CHECK(_tool_Run({ deltaBase, "subset", TestPath("subset.zar").string(), TestPath("delta.zar").string(), "keep" }) == 0);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenDelta(TestPath("base.zar"), TestPath("subset.zar")));
+	CHECK(reader);
+	CHECK(reader->LookUp("drop.bin") == ZARCHIVE_INVALID_NODE);
+	return VerifyTestArchive(reader.get(), { { "keep/a.bin", data } });
+}
@@ -0,0 +1,45 @@
+#include "testutil.h"
+
+#include <memory>
+
+namespace fs = std::filesystem;
+
+ZARCHIVE_TEST(trace_and_prefetch)
+{
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(1000000, 110, true) },
+		{ "b.bin", GenerateData(300000, 111, false) },
+	};
+	CHECK(WriteTestArchive(TestPath("a.zar"), files));
+	CHECK(WriteTestArchive(TestPath("other.zar"), { files[1] }));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	reader->StartTracing();
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	reader->StopTracing();
+	CHECK(reader->SaveTrace(TestPath("full.trace")));
+	const uint64_t headerSize = sizeof(_ZARCHIVE::TraceHeader);
+	const uint64_t recordSize = sizeof(_ZARCHIVE::TraceRecord);
+	uint64_t fullRecordCount = (fs::file_size(TestPath("full.trace")) - headerSize) / recordSize;
+	CHECK(fullRecordCount > 20);
+	// recording stops once the limit is reached
+	reader->StartTracing(20);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	CHECK(reader->SaveTrace(TestPath("capped.trace")));
+	CHECK(fs::file_size(TestPath("capped.trace")) == headerSize + 20 * recordSize);
+	reader.reset();
+	// blocks are prefetched in the background while the archive is read
+	reader.reset(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	CHECK(reader->PrefetchFromTrace(TestPath("full.trace"), 2));
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	// traces of other archives are rejected
+	std::unique_ptr<ZArchiveReader> otherReader(ZArchiveReader::OpenFromFile(TestPath("other.zar")));
+	CHECK(otherReader);
+	CHECK(!otherReader->PrefetchFromTrace(TestPath("full.trace")));
+	CHECK(!otherReader->PrefetchFromTrace(TestPath("missing.trace")));
+	return true;
+}
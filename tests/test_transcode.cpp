@@ -0,0 +1,47 @@
+#include "testutil.h"
+
+#include <memory>
+
+ZARCHIVE_TEST(transcode)
+{
+	// several batches of 4MiB so that the worker threads actually run in parallel
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(5 * 1024 * 1024, 60, true) },
+		{ "dir/b.bin", GenerateData(3 * 1024 * 1024 + 12345, 61, false) },
+		{ "dir/c.txt", GenerateData(1000, 62, true) },
+		{ "dir/aligned.txt", GenerateData(300000, 63, true), true },
+		{ "empty.txt", {} },
+	};
+	CHECK(WriteTestArchive(TestPath("source.zar"), files));
+	std::unique_ptr<ZArchiveReader> source(ZArchiveReader::OpenFromFile(TestPath("source.zar")));
+	CHECK(source);
+	for (uint32_t blockSize : { 16u * 1024, 64u * 1024, 256u * 1024 })
+	{
+		for (uint32_t numThreads : { 1u, 4u })
+		{
+			CHECK(WriteArchiveWith(TestPath("transcoded" + std::to_string(numThreads) + ".zar"), [&](ZArchiveWriter& writer)
+				{
+					CHECK(writer.SetBlockSize(blockSize));
+					writer.SetCompressionLevel(3);
+					return writer.TranscodeArchive(source.get(), numThreads);
+				}));
+		}
+		// the result does not depend on the number of threads
+		CHECK(ReadWholeFile(TestPath("transcoded1.zar")) == ReadWholeFile(TestPath("transcoded4.zar")));
+		std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("transcoded4.zar")));
+		CHECK(reader);
+		CHECK(reader->GetBlockSize() == blockSize);
+		// empty files have no data and no meaningful offset
+		for (auto& it : files)
+			CHECK(it.data.empty() || reader->GetFileDataOffset(reader->LookUp(it.path)) == source->GetFileDataOffset(source->LookUp(it.path)));
+		if (!VerifyTestArchive(reader.get(), files))
+			return false;
+	}
+	// transcoding has to come first
+	return WriteArchiveWith(TestPath("invalid.zar"), [&](ZArchiveWriter& writer)
+		{
+			CHECK(writer.StartNewFile("a.txt"));
+			CHECK(!writer.TranscodeArchive(source.get()));
+			return true;
+		});
+}
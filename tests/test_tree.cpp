@@ -0,0 +1,83 @@
+#include "testutil.h"
+
+#include <memory>
+
+// enough nodes and name bytes to span several node and name chunks of the writer
+ZARCHIVE_TEST(writer_large_tree)
+{
+	const uint32_t numDirs = 40;
+	const uint32_t filesPerDir = 500;
+	std::string padding(100, 'x');
+	std::vector<TestFile> files;
+	for (uint32_t d = 0; d < numDirs; d++)
+	{
+		for (uint32_t i = 0; i < filesPerDir; i++)
+		{
+			std::string path = "dir_";
+			path += std::to_string(d);
+			path += "/";
+			// every directory uses the same file names, the other half of the names is unique. Shared names differ in case between odd and even directories
+			path += (i % 2) ? ((d % 2) ? "Shared_" : "shared_") : "unique_";
+			path += (i % 2) ? std::to_string(i) : std::to_string(d * filesPerDir + i);
+			path += padding;
+			files.push_back({ path, GenerateData(i % 7, d * filesPerDir + i, true) });
+		}
+	}
+	CHECK(WriteTestArchive(TestPath("tree.zar"), files));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("tree.zar")));
+	CHECK(reader);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("")) == numDirs);
+	for (uint32_t d = 0; d < numDirs; d++)
+		CHECK(reader->GetDirEntryCount(reader->LookUp("dir_" + std::to_string(d))) == filesPerDir);
+	// names are only shared if they match exactly
+	for (auto& it : files)
+	{
+		ZArchiveNodeHandle dirHandle = reader->LookUp(it.path.substr(0, it.path.find('/')));
+		std::string_view expectedName = std::string_view(it.path).substr(it.path.find('/') + 1);
+		bool isFound = false;
+		ZArchiveReader::DirEntry dirEntry;
+		for (uint32_t i = 0; i < reader->GetDirEntryCount(dirHandle) && !isFound; i++)
+			isFound = reader->GetDirEntry(dirHandle, i, dirEntry) && dirEntry.name == expectedName;
+		CHECK(isFound);
+	}
+	return VerifyTestArchive(reader.get(), files);
+}
+
+// directories with more than 32 entries switch to a hashed index, names still have to match case-insensitively on both sides of the switch
+ZARCHIVE_TEST(writer_large_directory)
+{
+	std::vector<TestFile> files;
+	CHECK(WriteArchiveWith(TestPath("dir.zar"), [&](ZArchiveWriter& writer)
+		{
+			CHECK(writer.MakeDir("big"));
+			for (uint32_t i = 0; i < 3000; i++)
+			{
+				std::string path = "big/File_";
+				path += std::to_string(i);
+				path += ".Txt";
+				CHECK(writer.StartNewFile(path.c_str()));
+				std::vector<uint8_t> data = GenerateData(i % 13, i, true);
+				writer.AppendData(data.data(), data.size());
+				files.push_back({ path, std::move(data) });
+				// names which differ only in case are duplicates, before and after the index is built
+				if (i == 10 || i == 40 || i == 2999)
+				{
+					CHECK(!writer.StartNewFile("big/FILE_5.TXT"));
+					CHECK(!writer.StartNewFile("BIG/file_10.txt"));
+					CHECK(!writer.MakeDir("big/fIlE_3.tXt"));
+					CHECK(!writer.MakeDir("Big/file_1.txt/sub", true));
+				}
+			}
+			// entries which are added after the switch can also be found again
+			CHECK(!writer.StartNewFile("big/FILE_2999.TXT"));
+			CHECK(writer.MakeDir("BIG/Sub/Dir", true));
+			CHECK(writer.MakeDir("big/sub/dir/deeper", true));
+			return true;
+		}));
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("dir.zar")));
+	CHECK(reader);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("big")) == 3000 + 1);
+	CHECK(reader->GetDirEntryCount(reader->LookUp("big/sub/dir")) == 1);
+	CHECK(reader->LookUp("BIG/FILE_1234.TXT") == reader->LookUp("big/file_1234.txt"));
+	return VerifyTestArchive(reader.get(), files);
+}
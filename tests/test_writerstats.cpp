@@ -0,0 +1,46 @@
+#include "testutil.h"
+
+#include <memory>
+
+struct ProgressLog
+{
+	std::vector<ZArchiveWriter::Stats> reports;
+};
+
+static void _writerStats_Progress(const ZArchiveWriter::Stats& stats, void* ctx)
+{
+	((ProgressLog*)ctx)->reports.emplace_back(stats);
+}
+
+ZARCHIVE_TEST(writer_stats_and_progress)
+{
+	const uint64_t interval = 256 * 1024;
+	std::vector<TestFile> files = {
+		{ "a.txt", GenerateData(1500000, 50, true) },
+		{ "b.bin", GenerateData(600000, 51, false) },
+	};
+	ProgressLog log;
+	CHECK(WriteTestArchive(TestPath("a.zar"), files, [&](ZArchiveWriter& writer)
+		{
+			writer.SetProgressCallback(_writerStats_Progress, &log, interval);
+			ZArchiveWriter::Stats stats = writer.GetStats();
+			return stats.uncompressedBytes == 0 && stats.compressedBytes == 0 && stats.blockCount == 0 && stats.compressionLevel == 6;
+		}));
+	// one report per interval plus the final one
+	uint64_t dataSize = GetDataStreamSize(files);
+	CHECK(log.reports.size() >= dataSize / interval);
+	for (size_t i = 1; i < log.reports.size(); i++)
+	{
+		CHECK(log.reports[i].uncompressedBytes >= log.reports[i - 1].uncompressedBytes);
+		CHECK(log.reports[i].elapsedTime >= log.reports[i - 1].elapsedTime);
+	}
+	const ZArchiveWriter::Stats& stats = log.reports.back();
+	CHECK(stats.uncompressedBytes == (dataSize + 0xFFFF) / 0x10000 * 0x10000);
+	CHECK(stats.blockCount == stats.uncompressedBytes / 0x10000);
+	CHECK(stats.compressedBytes == std::filesystem::file_size(TestPath("a.zar")));
+	CHECK(stats.GetCompressionRatio() > 1.0);
+	CHECK(stats.compressTime > 0 && stats.hashTime > 0 && stats.elapsedTime >= stats.compressTime);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("a.zar")));
+	CHECK(reader);
+	return VerifyTestArchive(reader.get(), files);
+}
@@ -0,0 +1,30 @@
+#include "testutil.h"
+
+#include <memory>
+
+ZARCHIVE_TEST(zero_block_elision)
+{
+	const uint32_t blockSize = 64 * 1024;
+	std::vector<uint8_t> data = GenerateData(blockSize, 11, false);
+	data.resize(data.size() + 4 * blockSize, 0);
+	std::vector<uint8_t> tail = GenerateData(1000, 12, true);
+	data.insert(data.end(), tail.begin(), tail.end());
+	std::vector<TestFile> files = {
+		{ "sparse.bin", data },
+		{ "zeros.bin", std::vector<uint8_t>(100000, 0) },
+		{ "after.txt", GenerateData(3000, 13, true) },
+	};
+	CHECK(WriteTestArchive(TestPath("sparse.zar"), files, [](ZArchiveWriter& writer) { return writer.SetZeroBlockElision(true); }));
+	CHECK(ReadFooterVersion(TestPath("sparse.zar")) == _ZARCHIVE::Footer::kVersion2);
+	std::unique_ptr<ZArchiveReader> reader(ZArchiveReader::OpenFromFile(TestPath("sparse.zar")));
+	CHECK(reader);
+	if (!VerifyTestArchive(reader.get(), files))
+		return false;
+	// without elision the same blocks are compressed and stored
+	CHECK(WriteTestArchive(TestPath("dense.zar"), files));
+	CHECK(ReadFooterVersion(TestPath("dense.zar")) == _ZARCHIVE::Footer::kVersion1);
+	CHECK(std::filesystem::file_size(TestPath("sparse.zar")) < std::filesystem::file_size(TestPath("dense.zar")));
+	std::unique_ptr<ZArchiveReader> denseReader(ZArchiveReader::OpenFromFile(TestPath("dense.zar")));
+	CHECK(denseReader);
+	return VerifyTestArchive(denseReader.get(), files);
+}
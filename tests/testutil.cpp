@@ -0,0 +1,187 @@
+#include "testutil.h"
+
+#include <fstream>
+#include <map>
+#include <cstring>
+#include <algorithm>
+
+namespace fs = std::filesystem;
+
+std::map<std::string, TestFunction>& GetTestRegistry()
+{
+	static std::map<std::string, TestFunction> s_registry;
+	return s_registry;
+}
+
+TestRegistration::TestRegistration(const char* name, TestFunction function)
+{
+	GetTestRegistry().emplace(name, function);
+}
+
+fs::path g_testWorkDirectory;
+fs::path g_toolPath;
+
+fs::path TestPath(std::string_view name)
+{
+	return g_testWorkDirectory / fs::path(name);
+}
+
+const fs::path& GetToolPath()
+{
+	return g_toolPath;
+}
+
+std::vector<uint8_t> GenerateData(size_t size, uint64_t seed, bool compressible)
+{
+	// xorshift64, compressible data repeats a small set of words
+	uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+	auto next = [&]() -> uint64_t
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	};
+	std::vector<uint8_t> data(size);
+	for (size_t i = 0; i < size;)
+	{
+		uint64_t v = next();
+		if (compressible)
+		{
+			static const char* s_words[] = { "zarchive ", "block ", "offset ", "record ", "zstd ", "file ", "tree ", "cache ", "\n" };
+			const char* word = s_words[v % (sizeof(s_words) / sizeof(s_words[0]))];
+			for (const char* c = word; *c && i < size; c++)
+				data[i++] = (uint8_t)*c;
+		}
+		else
+		{
+			for (int b = 0; b < 8 && i < size; b++)
+				data[i++] = (uint8_t)(v >> (b * 8));
+		}
+	}
+	return data;
+}
+
+std::vector<uint8_t> ReadWholeFile(const fs::path& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+bool ContainsBytes(const std::vector<uint8_t>& haystack, const uint8_t* needle, size_t needleSize)
+{
+	return std::search(haystack.begin(), haystack.end(), needle, needle + needleSize) != haystack.end();
+}
+
+struct TestOutput
+{
+	fs::path path;
+	std::ofstream file;
+	bool hasError{ false };
+};
+
+static void _test_NewOutputFile(const int32_t partIndex, void* ctx)
+{
+	TestOutput* output = (TestOutput*)ctx;
+	fs::path outputPath = output->path;
+	if (partIndex > 0)
+	{
+		outputPath += ".";
+		outputPath += std::to_string(partIndex);
+	}
+	if (output->file.is_open())
+		output->file.close();
+	output->file = std::ofstream(outputPath, std::ios::binary);
+	if (!output->file.is_open())
+		output->hasError = true;
+}
+
+static void _test_WriteOutputData(const void* data, size_t length, void* ctx)
+{
+	TestOutput* output = (TestOutput*)ctx;
+	output->file.write((const char*)data, length);
+}
+
+bool WriteArchiveWith(const fs::path& path, const std::function<bool(ZArchiveWriter&)>& populate)
+{
+	TestOutput output;
+	output.path = path;
+	{
+		ZArchiveWriter writer(_test_NewOutputFile, _test_WriteOutputData, &output);
+		if (!populate(writer))
+			return false;
+		writer.Finalize();
+	}
+	output.file.close();
+	return !output.hasError && !output.file.fail();
+}
+
+bool WriteTestArchive(const fs::path& path, const std::vector<TestFile>& files, const std::function<bool(ZArchiveWriter&)>& configure)
+{
+	return WriteArchiveWith(path, [&](ZArchiveWriter& writer)
+		{
+			if (configure && !configure(writer))
+				return false;
+			for (auto& it : files)
+			{
+				size_t dirEnd = it.path.find_last_of('/');
+				if (dirEnd != std::string::npos)
+					writer.MakeDir(it.path.substr(0, dirEnd).c_str(), true);
+				if (!writer.StartNewFile(it.path.c_str(), it.blockAligned))
+					return false;
+				// uneven pieces exercise the block buffering of the writer
+				for (size_t offset = 0; offset < it.data.size();)
+				{
+					size_t size = std::min<size_t>(it.data.size() - offset, 100000);
+					writer.AppendData(it.data.data() + offset, size);
+					offset += size;
+				}
+			}
+			return true;
+		});
+}
+
+bool VerifyTestArchive(ZArchiveReader* reader, const std::vector<TestFile>& files)
+{
+	std::vector<uint8_t> buffer;
+	for (auto& it : files)
+	{
+		ZArchiveNodeHandle handle = reader->LookUp(it.path, true, false);
+		CHECK(handle != ZARCHIVE_INVALID_NODE);
+		CHECK(reader->IsFile(handle));
+		CHECK(reader->GetFileSize(handle) == it.data.size());
+		buffer.assign(it.data.size() + 1, 0xCC);
+		CHECK(reader->ReadFromFile(handle, 0, it.data.size() + 1, buffer.data()) == it.data.size());
+		CHECK(it.data.empty() || memcmp(buffer.data(), it.data.data(), it.data.size()) == 0);
+		// pieces which start and end within blocks
+		const uint64_t pieceSize = 12345;
+		for (uint64_t offset = 0; offset < it.data.size(); offset += pieceSize)
+		{
+			uint64_t expectedSize = std::min<uint64_t>(pieceSize, it.data.size() - offset);
+			CHECK(reader->ReadFromFile(handle, offset, pieceSize, buffer.data()) == expectedSize);
+			CHECK(memcmp(buffer.data(), it.data.data() + offset, expectedSize) == 0);
+		}
+	}
+	return true;
+}
+
+uint32_t ReadFooterVersion(const fs::path& path)
+{
+	std::vector<uint8_t> data = ReadWholeFile(path);
+	if (data.size() < sizeof(_ZARCHIVE::Footer))
+		return 0;
+	_ZARCHIVE::Footer footer;
+	memcpy(&footer, data.data() + data.size() - sizeof(_ZARCHIVE::Footer), sizeof(_ZARCHIVE::Footer));
+	_ZARCHIVE::Footer::Deserialize(&footer, &footer);
+	if (footer.magic != _ZARCHIVE::Footer::kMagic)
+		return 0;
+	return footer.version;
+}
+
+uint64_t GetDataStreamSize(const std::vector<TestFile>& files)
+{
+	uint64_t size = 0;
+	for (auto& it : files)
+		size += it.data.size();
+	return size;
+}
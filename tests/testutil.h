@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <filesystem>
+
+#include "zarchive/zarchivewriter.h"
+#include "zarchive/zarchivereader.h"
+
+// minimal test harness. Every test registers itself by name and is run as its own CTest test in a fresh work directory
+typedef bool(*TestFunction)();
+
+struct TestRegistration
+{
+	TestRegistration(const char* name, TestFunction function);
+};
+
+#define ZARCHIVE_TEST(name) \
+	static bool _test_##name(); \
+	static TestRegistration _testRegistration_##name(#name, _test_##name); \
+	static bool _test_##name()
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			return false; \
+		} \
+	} while (false)
+
+struct TestFile
+{
+	std::string path;
+	std::vector<uint8_t> data;
+	bool blockAligned{ false };
+};
+
+std::filesystem::path TestPath(std::string_view name); // path within the work directory of the running test
+const std::filesystem::path& GetToolPath(); // the zarchive executable
+
+std::vector<uint8_t> GenerateData(size_t size, uint64_t seed, bool compressible);
+std::vector<uint8_t> ReadWholeFile(const std::filesystem::path& path);
+bool ContainsBytes(const std::vector<uint8_t>& haystack, const uint8_t* needle, size_t needleSize);
+
+// writes an archive through the writer callbacks. Parts of split archives are named <path>.1, <path>.2, ...
+// populate adds the content, Finalize is called afterwards
+bool WriteArchiveWith(const std::filesystem::path& path, const std::function<bool(ZArchiveWriter&)>& populate);
+// writes the given files, directories are created as needed. configure is called before any file is added
+bool WriteTestArchive(const std::filesystem::path& path, const std::vector<TestFile>& files, const std::function<bool(ZArchiveWriter&)>& configure = nullptr);
+// reads every file in full and in odd-sized pieces and compares it with the expected content
+bool VerifyTestArchive(ZArchiveReader* reader, const std::vector<TestFile>& files);
+
+uint32_t ReadFooterVersion(const std::filesystem::path& path);
+uint64_t GetDataStreamSize(const std::vector<TestFile>& files); // size of the uncompressed data stream if no file is block aligned